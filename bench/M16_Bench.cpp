@@ -0,0 +1,476 @@
+// Benchmark suite: runs standard workloads on every engine and reports results as JSON.
+//
+//     m16_bench [--quick] [--time <seconds>] [--out <file.json>]
+//
+// --quick runs every workload once, which is enough to check that the corpus is sane.
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+
+#include "../src/include/M16.h"
+#include "M16_Workloads.h"
+
+namespace m16 {
+	namespace bench {
+		using clock = std::chrono::steady_clock;
+
+		// Guard against corpus programs, which never halt
+		constexpr uint64_t MAX_INSTRUCTIONS = 1ull << 28;
+
+		// Copies of every workload run together by the lockstep engine
+		constexpr int LOCKSTEP_LANES = 256;
+
+		// Cores of machine, which run pure workloads side by side
+		constexpr int MACHINE_CORES = 4;
+
+		// Copies of every workload time-sliced by scheduler
+		constexpr int SCHEDULED_INSTANCES = 16;
+
+		struct engine {
+			const char* name;
+			void (*setup)(cpu* vm, program* prog);		// Called after image is loaded
+			uint64_t (*run)(cpu* vm);					// Run until halt, return executed instructions count
+		};
+
+		static const engine engines[] = {
+			{ "reference", nullptr, [](cpu* vm) {
+				uint64_t count = 0;
+				while (!vm->debugHalt && count < MAX_INSTRUCTIONS) {
+					vm->process();
+					count++;
+				}
+
+				return count;
+			} },
+			{ "decoded", [](cpu* vm, program* prog) { vm->attachDecoded(prog); }, [](cpu* vm) {
+				uint64_t count = 0;
+				while (!vm->debugHalt && count < MAX_INSTRUCTIONS) {
+					vm->processDecoded();
+					count++;
+				}
+
+				return count;
+			} },
+			{ "decoded_run", [](cpu* vm, program* prog) { vm->attachDecoded(prog); }, [](cpu* vm) {
+				uint64_t start = vm->retired;
+				vm->run(MAX_INSTRUCTIONS);
+
+				return vm->retired - start;
+			} },
+			{ "decoded_pipeline", [](cpu* vm, program* prog) {
+				static pipeline model;
+
+				vm->attachDecoded(prog);
+				vm->attachPipeline(&model);
+			}, [](cpu* vm) {
+				uint64_t start = vm->retired;
+				vm->run(MAX_INSTRUCTIONS);
+
+				return vm->retired - start;
+			} },
+			{ "decoded_profile", [](cpu* vm, program* prog) {
+				static profile counters;
+
+				vm->attachDecoded(prog);
+				vm->attachProfile(&counters);
+			}, [](cpu* vm) {
+				uint64_t start = vm->retired;
+				vm->run(MAX_INSTRUCTIONS);
+
+				return vm->retired - start;
+			} },
+			{ "decoded_cached", [](cpu* vm, program* prog) {
+				// Default L1 caches, warm after the first run
+				static memoryHierarchy caches;
+
+				vm->attachDecoded(prog);
+				vm->attachCaches(&caches);
+			}, [](cpu* vm) {
+				uint64_t start = vm->retired;
+				vm->run(MAX_INSTRUCTIONS);
+
+				return vm->retired - start;
+			} },
+		};
+
+		struct options {
+			bool quick = false;
+			double minTime = 0.5;
+			const char* out = nullptr;
+		};
+
+		static double seconds(clock::duration d) {
+			return std::chrono::duration<double>(d).count();
+		}
+
+		static void printRegs(FILE* json, cpu* vm) {
+			fprintf(json, "[");
+			for (int r = 0; r <= (int)Register::PSR; r++) {
+				fprintf(json, "%s%u", r ? ", " : "", vm->getRegister((Register)r));
+			}
+			fprintf(json, "]");
+		}
+
+		// Every lane runs the same workload, so each of them must end with the reference state
+		static bool runLockstep(FILE* json, const workload& w, micrasm& assembly, const options& opts, FILE* sink, const word* expected) {
+			uint64_t instructions = 0;
+			int runs = 0;
+			clock::duration elapsed = clock::duration::zero();
+
+			lockstep lanes(LOCKSTEP_LANES);
+			lanes.console = sink;
+
+			do {
+				lanes.loadImage(assembly.getCode());
+
+				clock::time_point start = clock::now();
+				instructions += lanes.run(MAX_INSTRUCTIONS);
+				elapsed += clock::now() - start;
+
+				runs++;
+			} while (!opts.quick && seconds(elapsed) < opts.minTime);
+
+			double secs = seconds(elapsed);
+
+			bool ok = true;
+			for (int l = 0; l < LOCKSTEP_LANES; l++) {
+				if (!lanes.isHalted(l)) {
+					fprintf(stderr, "lockstep: '%s' lane %d did not halt\n", w.name, l);
+					ok = false;
+					break;
+				}
+
+				for (int r = 0; r <= (int)Register::PSR; r++) {
+					if (expected[r] != lanes.getRegister(l, (Register)r)) {
+						fprintf(stderr, "lockstep: '%s' lane %d final R%d differs from %s\n", w.name, l, r, engines[0].name);
+						ok = false;
+					}
+				}
+
+				if (!ok) break;
+			}
+
+			fprintf(json, ",\n\t\t{ \"workload\": \"%s\", \"engine\": \"lockstep\", \"lanes\": %d, \"halted\": %s, \"runs\": %d, \"instructions\": %llu, "
+				"\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.3f }",
+				w.name, LOCKSTEP_LANES, ok ? "true" : "false", runs, (unsigned long long)instructions,
+				secs, instructions / secs / 1e6, secs * 1e9 / instructions);
+
+			return ok;
+		}
+
+		// Every instance must end with the reference state, whatever thread ran its quanta
+		static bool runScheduled(FILE* json, const workload& w, micrasm& assembly, const options& opts, FILE* sink, const word* expected) {
+			int threads = (int)std::thread::hardware_concurrency();
+			if (threads < 2) threads = 2;
+
+			uint64_t instructions = 0;
+			int runs = 0;
+			clock::duration elapsed = clock::duration::zero();
+			bool ok = true;
+
+			do {
+				std::vector<std::unique_ptr<cpu>> vms;
+				scheduler pool(threads);
+
+				for (int i = 0; i < SCHEDULED_INSTANCES; i++) {
+					vms.emplace_back(new cpu());
+					vms.back()->console = sink;
+					vms.back()->loadImage(assembly.getCode());
+
+					limits lim;
+					lim.instructions = MAX_INSTRUCTIONS;
+					pool.add(vms.back().get(), lim);
+				}
+
+				clock::time_point start = clock::now();
+				pool.run();
+				elapsed += clock::now() - start;
+
+				runs++;
+
+				for (int i = 0; i < SCHEDULED_INSTANCES && ok; i++) {
+					const scheduler::stats& s = pool.getStats(i);
+					instructions += s.instructions;
+
+					if (s.state != status::halted) {
+						fprintf(stderr, "scheduler: '%s' instance %d stopped with '%s'\n", w.name, i, statusName(s.state));
+						ok = false;
+					}
+
+					for (int r = 0; r <= (int)Register::PSR; r++) {
+						if (expected[r] != vms[i]->getRegister((Register)r)) {
+							fprintf(stderr, "scheduler: '%s' instance %d final R%d differs from %s\n", w.name, i, r, engines[0].name);
+							ok = false;
+						}
+					}
+				}
+			} while (ok && !opts.quick && seconds(elapsed) < opts.minTime);
+
+			double secs = seconds(elapsed);
+
+			fprintf(json, ",\n\t\t{ \"workload\": \"%s\", \"engine\": \"scheduler\", \"instances\": %d, \"threads\": %d, \"halted\": %s, \"runs\": %d, "
+				"\"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.3f }",
+				w.name, SCHEDULED_INSTANCES, threads, ok ? "true" : "false", runs, (unsigned long long)instructions,
+				secs, instructions / secs / 1e6, secs * 1e9 / instructions);
+
+			return ok;
+		}
+
+		// Every core runs its own copy of workload in shared memory, so each of them must end with the reference state
+		static bool runMachine(FILE* json, const workload& w, micrasm& assembly, machine::mode mode, const options& opts, FILE* sink, const word* expected) {
+			const char* name = mode == machine::mode::relaxed ? "machine_relaxed" : "machine_deterministic";
+
+			uint64_t instructions = 0;
+			int runs = 0;
+			clock::duration elapsed = clock::duration::zero();
+			bool ok = true;
+
+			do {
+				machine system(MACHINE_CORES, mode);
+				system.loadImage(assembly.getCode());
+				for (int c = 0; c < MACHINE_CORES; c++) system.getCore(c).console = sink;
+
+				clock::time_point start = clock::now();
+				instructions += system.run(MAX_INSTRUCTIONS);
+				elapsed += clock::now() - start;
+
+				runs++;
+
+				for (int c = 0; c < MACHINE_CORES && ok; c++) {
+					if (!system.isHalted(c)) {
+						fprintf(stderr, "%s: '%s' core %d did not halt\n", name, w.name, c);
+						ok = false;
+					}
+
+					for (int r = 0; r <= (int)Register::PSR; r++) {
+						if (expected[r] != system.getCore(c).getRegister((Register)r)) {
+							fprintf(stderr, "%s: '%s' core %d final R%d differs from %s\n", name, w.name, c, r, engines[0].name);
+							ok = false;
+						}
+					}
+				}
+			} while (ok && !opts.quick && seconds(elapsed) < opts.minTime);
+
+			double secs = seconds(elapsed);
+
+			fprintf(json, ",\n\t\t{ \"workload\": \"%s\", \"engine\": \"%s\", \"cores\": %d, \"halted\": %s, \"runs\": %d, \"instructions\": %llu, "
+				"\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.3f }",
+				w.name, name, MACHINE_CORES, ok ? "true" : "false", runs, (unsigned long long)instructions,
+				secs, instructions / secs / 1e6, secs * 1e9 / instructions);
+
+			return ok;
+		}
+
+		// Returns false, if workload did not halt or engines disagree on the final state
+		static bool runWorkload(FILE* json, const workload& w, const options& opts, FILE* sink, bool& first) {
+			micrasm assembly;
+			assembly.assemble(w.source);
+
+			bool ok = true;
+			word expected[10];
+
+			for (const engine& e : engines) {
+				uint64_t instructions = 0;
+				int runs = 0;
+				clock::duration elapsed = clock::duration::zero();
+
+				cpu* vm = nullptr;
+				program prog;
+
+				do {
+					delete vm;
+					vm = new cpu();
+					vm->console = sink;
+					vm->loadImage(assembly.getCode());
+					if (e.setup != nullptr) e.setup(vm, &prog);
+
+					clock::time_point start = clock::now();
+					instructions += e.run(vm);
+					elapsed += clock::now() - start;
+
+					runs++;
+				} while (!opts.quick && seconds(elapsed) < opts.minTime);
+
+				double secs = seconds(elapsed);
+
+				fprintf(json, "%s\n\t\t{ \"workload\": \"%s\", \"engine\": \"%s\", \"halted\": %s, \"runs\": %d, \"instructions\": %llu, "
+					"\"seconds\": %.6f, \"mips\": %.3f, \"ns_per_instruction\": %.3f, \"final_regs\": ",
+					first ? "" : ",", w.name, e.name, vm->debugHalt ? "true" : "false", runs, (unsigned long long)instructions,
+					secs, instructions / secs / 1e6, secs * 1e9 / instructions);
+				printRegs(json, vm);
+				fprintf(json, " }");
+
+				first = false;
+
+				if (!vm->debugHalt) {
+					fprintf(stderr, "%s: '%s' did not halt\n", e.name, w.name);
+					ok = false;
+				}
+
+				for (int r = 0; r <= (int)Register::PSR; r++) {
+					if (&e == &engines[0]) expected[r] = vm->getRegister((Register)r);
+					else if (expected[r] != vm->getRegister((Register)r)) {
+						fprintf(stderr, "%s: '%s' final R%d differs from %s\n", e.name, w.name, r, engines[0].name);
+						ok = false;
+					}
+				}
+
+				delete vm;
+			}
+
+			ok &= runLockstep(json, w, assembly, opts, sink, expected);
+
+			ok &= runScheduled(json, w, assembly, opts, sink, expected);
+
+			if (w.isPure) {
+				ok &= runMachine(json, w, assembly, machine::mode::relaxed, opts, sink, expected);
+				ok &= runMachine(json, w, assembly, machine::mode::deterministic, opts, sink, expected);
+			}
+
+			return ok;
+		}
+
+		// Cores contend on one counter and one lock, both must end with every increment counted
+		static bool benchAtomics(FILE* json, const options& opts) {
+			micrasm assembly;
+			assembly.assemble(SHARED_COUNTER_SOURCE);
+
+			word counter = assembly.getLabels().at("counter");
+			word plain = assembly.getLabels().at("plain");
+			word expected = MACHINE_CORES * SHARED_COUNTER_ITERATIONS;
+
+			uint64_t instructions = 0;
+			int runs = 0;
+			clock::duration elapsed = clock::duration::zero();
+			bool ok = true;
+
+			do {
+				machine system(MACHINE_CORES);
+				system.loadImage(assembly.getCode());
+
+				clock::time_point start = clock::now();
+				instructions += system.run(MAX_INSTRUCTIONS);
+				elapsed += clock::now() - start;
+
+				runs++;
+
+				for (int c = 0; c < MACHINE_CORES; c++) ok &= system.isHalted(c);
+
+				cpu& core = system.getCore(0);
+				if (core.readWord(counter) != expected || core.readWord(plain) != expected) {
+					fprintf(stderr, "shared_counter: counter = %u, plain = %u, expected %u\n", core.readWord(counter), core.readWord(plain), expected);
+					ok = false;
+				}
+			} while (ok && !opts.quick && seconds(elapsed) < opts.minTime);
+
+			double secs = seconds(elapsed);
+			fprintf(json, "\t\"shared_counter\": { \"cores\": %d, \"ok\": %s, \"runs\": %d, \"instructions\": %llu, \"seconds\": %.6f, \"mips\": %.3f },\n",
+				MACHINE_CORES, ok ? "true" : "false", runs, (unsigned long long)instructions, secs, instructions / secs / 1e6);
+
+			return ok;
+		}
+
+		static void benchAssembler(FILE* json, const options& opts) {
+			size_t bytes = 0;
+			clock::duration elapsed = clock::duration::zero();
+
+			do {
+				for (const workload& w : WORKLOADS) {
+					micrasm assembly;
+
+					clock::time_point start = clock::now();
+					assembly.assemble(w.source);
+					elapsed += clock::now() - start;
+
+					bytes += strlen(w.source);
+				}
+			} while (!opts.quick && seconds(elapsed) < opts.minTime);
+
+			double secs = seconds(elapsed);
+			fprintf(json, "\t\"assembler\": { \"bytes\": %zu, \"seconds\": %.6f, \"mb_per_second\": %.3f },\n",
+				bytes, secs, bytes / secs / 1e6);
+		}
+
+		static void benchImageLoad(FILE* json, const options& opts) {
+			micrasm assembly;
+			assembly.assemble(WORKLOADS[0].source);
+
+			cpu* vm = new cpu();
+
+			int loads = 0;
+			clock::duration elapsed = clock::duration::zero();
+
+			do {
+				clock::time_point start = clock::now();
+				vm->loadImage(assembly.getCode());
+				elapsed += clock::now() - start;
+
+				loads++;
+			} while (!opts.quick && seconds(elapsed) < opts.minTime / 10);
+
+			fprintf(json, "\t\"image_load\": { \"loads\": %d, \"ns_per_load\": %.1f },\n", loads, seconds(elapsed) * 1e9 / loads);
+
+			delete vm;
+		}
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	using namespace m16;
+
+	bench::options opts;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--quick") == 0) opts.quick = true;
+		else if (strcmp(argv[i], "--time") == 0 && i + 1 < argc) opts.minTime = atof(argv[++i]);
+		else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) opts.out = argv[++i];
+		else {
+			fprintf(stderr, "Usage: m16_bench [--quick] [--time <seconds>] [--out <file.json>]\n");
+			return 64;
+		}
+	}
+
+	FILE* json = stdout;
+	if (opts.out != nullptr) {
+		json = fopen(opts.out, "w");
+		if (json == nullptr) {
+			fprintf(stderr, "Can't open '%s' for writing\n", opts.out);
+			return 1;
+		}
+	}
+
+	// Guest output is not a part of the report
+	FILE* sink = tmpfile();
+	if (sink == nullptr) sink = stderr;
+
+	fprintf(json, "{\n");
+
+	bool ok = true;
+
+	try {
+		bench::benchAssembler(json, opts);
+		bench::benchImageLoad(json, opts);
+		ok &= bench::benchAtomics(json, opts);
+
+		fprintf(json, "\t\"results\": [");
+
+		bool first = true;
+		for (const bench::workload& w : bench::WORKLOADS) {
+			ok &= bench::runWorkload(json, w, opts, sink, first);
+		}
+
+		fprintf(json, "\n\t]\n");
+	} catch (std::runtime_error& e) {
+		fprintf(stderr, "[ERROR] - %s\n", e.what());
+		return 1;
+	}
+
+	fprintf(json, "}\n");
+
+	if (sink != stderr) fclose(sink);
+	if (json != stdout) fclose(json);
+
+	return ok ? 0 : 2;
+}
@@ -0,0 +1,357 @@
+#pragma once
+
+// Standard corpus of guest programs for benchmarking.
+// Every program ends with 'trap x25', so it can be run until halt.
+// Note: label names, which start with 'b', 'o' or 'x', are parsed as numbers in operands.
+
+namespace m16 {
+	namespace bench {
+		struct workload {
+			const char* name;
+			const char* source;
+			bool isPure;		// Does not write memory, so all cores of machine can run it at once
+		};
+
+		// Fibonacci from README, but with longer sequence and printing only the last number
+		constexpr const char* FIB_SOURCE = R"(
+		lea r0, n
+		ldr r0, r0, #0
+
+		lea r1, n1
+		ldr r1, r1, #0
+
+		lea r2, n2
+		ldr r2, r2, #0
+
+loop:
+		add r3, r1, r2
+		add r1, r2, #0
+		add r2, r3, #0
+
+		add r0, r0, #-1
+		brp loop
+
+		add r4, r1, #0
+		trap x10        ; Print contents of register R4
+
+		trap x25
+
+n1:		.dat #1
+n2:		.dat #1
+n:		.dat #30000		; Length of sequence
+)";
+
+		// Byte-wise copy with LDB/STB pairs
+		constexpr const char* MEMCPY_SOURCE = R"(
+		lea r5, times
+		ldr r5, r5, #0
+
+again:	lea r0, src
+		lea r2, count
+		ldr r2, r2, #0
+		add r1, r0, r2			; Destination follows source
+
+copy:	ldb r3, r0, #0
+		stb r3, r1, #0
+		add r0, r0, #1
+		add r1, r1, #1
+		add r2, r2, #-1
+		brp copy
+
+		add r5, r5, #-1
+		brp again
+
+		trap x25
+
+times:	.dat #16
+count:	.dat #2048
+src:	.blk #4096
+)";
+
+		// Word-wise fill with STR
+		constexpr const char* MEMSET_SOURCE = R"(
+		lea r5, times
+		ldr r5, r5, #0
+
+again:	lea r0, area
+		lea r2, count
+		ldr r2, r2, #0
+		lea r3, pattern
+		ldr r3, r3, #0
+
+fill:	str r3, r0, #0
+		add r0, r0, #2
+		add r2, r2, #-1
+		brp fill
+
+		add r3, r3, #1
+		add r5, r5, #-1
+		brp again
+
+		trap x25
+
+times:	.dat #32
+count:	.dat #2048
+pattern:	.dat x5a5a
+area:	.blk #4096
+)";
+
+		// Same copy as MEMCPY_SOURCE by DMA device
+		constexpr const char* MEMCPY_DMA_SOURCE = R"(
+		lea r5, times
+		ldr r5, r5, #0
+
+again:	lea r1, src
+		lea r2, count
+		ldr r2, r2, #0
+		add r0, r1, r2			; Destination follows source
+		trap x29
+
+		add r5, r5, #-1
+		brp again
+
+		trap x25
+
+times:	.dat #16
+count:	.dat #2048
+src:	.blk #4096
+)";
+
+		// Same amount of memory as MEMSET_SOURCE filled by DMA device, byte pattern
+		constexpr const char* MEMSET_DMA_SOURCE = R"(
+		lea r5, times
+		ldr r5, r5, #0
+
+		lea r1, pattern
+		ldr r1, r1, #0
+
+again:	lea r0, area
+		lea r2, count
+		ldr r2, r2, #0
+		trap x2a
+
+		add r1, r1, #1
+		add r5, r5, #-1
+		brp again
+
+		trap x25
+
+times:	.dat #32
+count:	.dat #4096
+pattern:	.dat x5a
+area:	.blk #4096
+)";
+
+		// Sort reversed array of 128 words
+		constexpr const char* BUBBLE_SOURCE = R"(
+		lea r0, arr
+		lea r1, n
+		ldr r1, r1, #0
+		add r2, r1, #0
+
+init:	str r2, r0, #0
+		add r0, r0, #2
+		add r2, r2, #-1
+		brp init
+
+		lea r1, n
+		ldr r1, r1, #0
+		add r1, r1, #-1			; Passes
+
+pass:	lea r0, arr
+		add r2, r1, #0
+
+inner:	ldr r3, r0, #0
+		ldr r4, r0, #1
+		not r5, r3
+		add r5, r5, #1
+		add r5, r4, r5			; r4 - r3
+		brzp noswap
+
+		str r4, r0, #0
+		str r3, r0, #1
+
+noswap:	add r0, r0, #2
+		add r2, r2, #-1
+		brp inner
+
+		add r1, r1, #-1
+		brp pass
+
+		trap x25
+
+n:		.dat #128
+arr:	.blk #256
+)";
+
+		// Linear congruential-like sequence with MUL, DIV and MOD in the loop
+		constexpr const char* ARITH_SOURCE = R"(
+		lea r0, n
+		ldr r0, r0, #0
+		and r1, r1, #0
+		add r1, r1, #7
+		lea r2, k
+		ldr r2, r2, #0
+		lea r3, m
+		ldr r3, r3, #0
+		and r5, r5, #0
+
+loop:	mul r1, r1, #13
+		add r1, r1, #7
+		mod r1, r1, r3
+		div r4, r1, r2
+		add r5, r5, r4
+		mul r5, r5, r2
+		add r0, r0, #-1
+		brp loop
+
+		add r4, r5, #0
+		trap x10
+		trap x25
+
+n:		.dat #20000
+k:		.dat #13
+m:		.dat #1021
+)";
+
+		// Sum of decimal digits of every number below n: DIV and MOD by the same divisor
+		constexpr const char* DIGITS_SOURCE = R"(
+		lea r0, n
+		ldr r0, r0, #0
+		and r2, r2, #0
+		add r2, r2, #10
+		and r5, r5, #0
+
+again:	add r1, r0, #0
+digit:	mod r3, r1, r2
+		add r5, r5, r3
+		div r1, r1, r2
+		brp digit
+
+		add r0, r0, #-1
+		brp again
+
+		add r4, r5, #0
+		trap x10
+		trap x25
+
+n:		.dat #30000
+)";
+
+		// Naive recursive Fibonacci, heavy on JSR/RET and stack traffic
+		constexpr const char* RECURSION_SOURCE = R"(
+		lea r6, stack
+		lea r0, n
+		ldr r0, r0, #0
+		jsr fib
+		add r4, r1, #0
+		trap x10
+		trap x25
+
+; r1 = fib(r0), clobbers r2
+fib:	add r6, r6, #-2
+		str r7, r6, #0
+		add r2, r0, #-2
+		brzp recurse
+		add r1, r0, #0
+		brnzp done
+
+recurse:	add r6, r6, #-2
+		str r0, r6, #0
+		add r0, r0, #-1
+		jsr fib
+		ldr r0, r6, #0
+		add r6, r6, #-2
+		str r1, r6, #0
+		add r0, r0, #-2
+		jsr fib
+		ldr r2, r6, #0
+		add r6, r6, #2
+		add r1, r1, r2
+		ldr r0, r6, #0
+		add r6, r6, #2
+
+done:	ldr r7, r6, #0
+		add r6, r6, #2
+		ret
+
+n:		.dat #20
+		.blk #256
+stack:
+)";
+
+		// Print string character by character through 'trap x10'
+		constexpr const char* PRINT_SOURCE = R"(
+		lea r5, times
+		ldr r5, r5, #0
+
+again:	lea r0, text
+next:	ldb r4, r0, #0
+		brz eol
+		trap x10
+		add r0, r0, #1
+		brnzp next
+
+eol:	add r5, r5, #-1
+		brp again
+
+		trap x25
+
+times:	.dat #200
+text:	.strz "Hello, MCPU-16! The quick brown fox jumps over the lazy dog."
+)";
+
+		// Multi-core workload: every core increments shared counter with fetch-add,
+		// and the plain one under spinlock taken with compare-and-swap
+		constexpr const char* SHARED_COUNTER_SOURCE = R"(
+		lea r5, n
+		ldr r5, r5, #0
+
+loop:	lea r0, counter
+		and r1, r1, #0
+		add r1, r1, #1
+		trap x27				; Fetch-add
+
+lock:	lea r0, mutex
+		and r1, r1, #0
+		and r2, r2, #0
+		add r2, r2, #1
+		trap x26				; Compare-and-swap 0 -> 1
+		brnp lock
+
+		lea r3, plain
+		ldr r4, r3, #0
+		add r4, r4, #1
+		str r4, r3, #0
+
+		lea r3, mutex
+		and r4, r4, #0
+		str r4, r3, #0			; Unlock
+
+		add r5, r5, #-1
+		brp loop
+
+		trap x25
+
+n:		.dat #2000
+counter:	.dat #0
+mutex:	.dat #0
+plain:	.dat #0
+)";
+
+		constexpr int SHARED_COUNTER_ITERATIONS = 2000;
+
+		constexpr workload WORKLOADS[] = {
+			{ "fibonacci", FIB_SOURCE, true },
+			{ "memcpy", MEMCPY_SOURCE, false },
+			{ "memset", MEMSET_SOURCE, false },
+			{ "memcpy_dma", MEMCPY_DMA_SOURCE, false },
+			{ "memset_dma", MEMSET_DMA_SOURCE, false },
+			{ "bubble_sort", BUBBLE_SOURCE, false },
+			{ "mul_div", ARITH_SOURCE, true },
+			{ "div_mod_digits", DIGITS_SOURCE, true },
+			{ "recursion", RECURSION_SOURCE, false },
+			{ "print", PRINT_SOURCE, true },
+		};
+	}
+}
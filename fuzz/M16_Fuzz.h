@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstdint>
+#include <cstdlib>
+
+#include "../src/include/M16.h"
+
+// Every fuzz target exports this entry point, so it can be linked either with libFuzzer
+// or with the standalone driver from M16_FuzzDriver.cpp
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+namespace m16 {
+	namespace fuzz {
+		// Consumes fuzzer input byte by byte. Once input is exhausted, zeros are returned,
+		// so every input is a valid (maybe short) test case
+		class input {
+		private:
+			const uint8_t* data;
+			size_t size;
+			size_t pos = 0;
+
+		public:
+			input(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+			bool empty() const { return pos >= size; }
+			size_t remaining() const { return empty() ? 0 : size - pos; }
+
+			byte nextByte() { return empty() ? 0 : data[pos++]; }
+			word nextWord() {
+				word high = nextByte();
+				return (high << 8) | nextByte();
+			}
+
+			// Random integer in range [low, high]
+			int nextInt(int low, int high) {
+				return low + (int)(nextWord() % (unsigned)(high - low + 1));
+			}
+
+			bool nextBool() { return nextByte() & 1; }
+		};
+
+		inline void fail(const char* fmt, ...) {
+			va_list a;
+
+			va_start(a, fmt);
+			fprintf(stderr, "[FUZZ MISMATCH] ");
+			vfprintf(stderr, fmt, a);
+			fprintf(stderr, "\n");
+			va_end(a);
+
+			abort();
+		}
+	}
+}
@@ -0,0 +1,381 @@
+// Assembler round-trip fuzzer.
+// Input is turned into random, but valid micrasm program. Every line is encoded independently
+// with m16::enc, and the result must match bytes, produced by micrasm.
+// Then the bytes are disassembled with symbols and assembled again, the result must be the same.
+// At last the program is laid out by its profile, which must not put any label out of reach.
+// Compile-time assembler casm is checked against m16::enc by static_assert.
+
+#include "M16_Fuzz.h"
+
+namespace m16 {
+	namespace fuzz {
+		constexpr int MAX_LINES = 128;
+
+		struct line {
+			std::string text;
+			word expected = 0;
+			int label = -1;		// Index of the referenced line or -1
+			int offsetSize = 0;
+			bool isData = false;
+		};
+
+		static std::string reg(int r) {
+			return "r" + std::to_string(r);
+		}
+
+		// Micrasm accepts numbers in one of the four bases
+		static std::string number(input& in, int value) {
+			const char* sign = value < 0 ? "-" : "";
+			unsigned magnitude = value < 0 ? -value : value;
+
+			char buf[32];
+			switch (in.nextByte() & 3) {
+			case 0:
+				snprintf(buf, sizeof(buf), "#%s%u", sign, magnitude);
+				break;
+			case 1:
+				snprintf(buf, sizeof(buf), "x%s%x", sign, magnitude);
+				break;
+			case 2:
+				snprintf(buf, sizeof(buf), "o%s%o", sign, magnitude);
+				break;
+			default: {
+				std::string bin;
+				do {
+					bin.insert(bin.begin(), '0' + (magnitude & 1));
+					magnitude >>= 1;
+				} while (magnitude);
+
+				snprintf(buf, sizeof(buf), "b%s%s", sign, bin.c_str());
+				break;
+			}
+			}
+
+			return buf;
+		}
+
+		// Micrasm does not accept the lowest negative number of the signed range
+		static int signedValue(input& in, int size) {
+			int limit = (1 << (size - 1)) - 1;
+			return in.nextInt(-limit, limit);
+		}
+
+		// Image of casm holds exactly 'words', high byte first
+		template<size_t N>
+		consteval bool encodes(const std::array<byte, N>& image, std::initializer_list<word> words) {
+			if (N != words.size() * 2) return false;
+
+			size_t i = 0;
+			for (word w : words) {
+				if (image[i] != (w >> 8) || image[i + 1] != (w & 0xff)) return false;
+				i += 2;
+			}
+
+			return true;
+		}
+
+		// casm runs only in constant evaluation, so it is checked against enc at compile time.
+		// Offsets are in words from the next instruction, 'done' and 'msg' are referenced before declared
+		static_assert(encodes(casm::assemble<R"(
+		start:	brz done
+				add r1, r1, r2
+				ldr r3, r4, #-2
+		done:	lea r5, msg
+				brnzp start
+				halt
+		msg:	.dat x1234, #-1
+		)">(), {
+			enc::BR(false, true, false, 2),
+			enc::ADD(Register::R1, Register::R1, Register::R2),
+			enc::LDR(Register::R3, Register::R4, -2),
+			enc::LEA(Register::R5, 2),
+			enc::BR(true, true, true, -5),
+			enc::HALT(),
+			0x1234,
+			0xffff,
+		}));
+
+		static_assert(encodes(casm::assemble<R"(
+				jsr sub
+				mul r0, r1, #-3
+				div r2, r3, r4
+				mod r2, r3, r4
+				arshf r6, r7, #15
+				not r0, r1
+				stb r0, r6, x1f
+		sub:	and r1, r2, b1010
+				trap x25
+				ret
+		)">(), {
+			enc::JSR(6),
+			enc::MUL(Register::R0, Register::R1, -3),
+			enc::DIV(Register::R2, Register::R3, Register::R4),
+			enc::MOD(Register::R2, Register::R3, Register::R4),
+			enc::ARSHF(Register::R6, Register::R7, 15),
+			enc::NOT(Register::R0, Register::R1),
+			enc::STB(Register::R0, Register::R6, 0x1f),
+			enc::AND(Register::R1, Register::R2, 0b1010),
+			enc::TRAP(0x25),
+			enc::RET(),
+		}));
+
+		// Relocatable programs reference code only by labels, so block layout can move all of it
+		static line generate(input& in, int lineCount, bool isRelocatable) {
+			Register rd = (Register)in.nextInt(0, 7);
+			Register rs1 = (Register)in.nextInt(0, 7);
+			Register rs2 = (Register)in.nextInt(0, 7);
+
+			std::string d = reg((int)rd), s1 = reg((int)rs1), s2 = reg((int)rs2);
+
+			line l;
+
+			// Label references are patched in later
+			auto labelOrOffset = [&](int size, word op, const char* text) {
+				if (isRelocatable || in.nextBool()) {
+					l.label = in.nextInt(0, lineCount - 1);
+					l.offsetSize = size;
+					l.text = std::string(text) + "l" + std::to_string(l.label);
+					l.expected = op;
+				} else {
+					int offset = signedValue(in, size);
+					l.text = std::string(text) + number(in, offset);
+					l.expected = op | (offset & ((1 << size) - 1));
+				}
+			};
+
+			switch (in.nextInt(0, 21)) {
+			case 0: l = { "add " + d + ", " + s1 + ", " + s2, enc::ADD(rd, rs1, rs2) }; break;
+			case 1: { int v = signedValue(in, 5); l = { "add " + d + ", " + s1 + ", " + number(in, v), enc::ADD(rd, rs1, v) }; break; }
+			case 2: l = { "and " + d + ", " + s1 + ", " + s2, enc::AND(rd, rs1, rs2) }; break;
+			case 3: { int v = signedValue(in, 5); l = { "and " + d + ", " + s1 + ", " + number(in, v), enc::AND(rd, rs1, v) }; break; }
+			case 4: l = { "mul " + d + ", " + s1 + ", " + s2, enc::MUL(rd, rs1, rs2) }; break;
+			case 5: { int v = signedValue(in, 5); l = { "mul " + d + ", " + s1 + ", " + number(in, v), enc::MUL(rd, rs1, v) }; break; }
+			case 6: l = { "div " + d + ", " + s1 + ", " + s2, enc::DIV(rd, rs1, rs2) }; break;
+			case 7: l = { "mod " + d + ", " + s1 + ", " + s2, enc::MOD(rd, rs1, rs2) }; break;
+			case 8: { int v = signedValue(in, 6); l = { "ldb " + d + ", " + s1 + ", " + number(in, v), enc::LDB(rd, rs1, v) }; break; }
+			case 9: { int v = signedValue(in, 6); l = { "stb " + d + ", " + s1 + ", " + number(in, v), enc::STB(rd, rs1, v) }; break; }
+			case 10: { int v = signedValue(in, 6); l = { "ldr " + d + ", " + s1 + ", " + number(in, v), enc::LDR(rd, rs1, v) }; break; }
+			case 11: { int v = signedValue(in, 6); l = { "str " + d + ", " + s1 + ", " + number(in, v), enc::STR(rd, rs1, v) }; break; }
+			case 12: l = { "not " + d + ", " + s1, enc::NOT(rd, rs1) }; break;
+			case 13: {
+				int v = in.nextInt(0, 15);
+				switch (in.nextInt(0, 2)) {
+				case 0: l = { "lshf " + d + ", " + s1 + ", " + number(in, v), enc::LSHF(rd, rs1, v) }; break;
+				case 1: l = { "rshf " + d + ", " + s1 + ", " + number(in, v), enc::RSHF(rd, rs1, v) }; break;
+				default: l = { "arshf " + d + ", " + s1 + ", " + number(in, v), enc::ARSHF(rd, rs1, v) }; break;
+				}
+				break;
+			}
+			case 14: {
+				bool n = in.nextBool(), z = in.nextBool(), p = in.nextBool();
+				std::string op = std::string("br") + (n ? "n" : "") + (z ? "z" : "") + (p ? "p" : "") + " ";
+
+				labelOrOffset(9, enc::BR(n, z, p, 0), op.c_str());
+				break;
+			}
+			case 15: labelOrOffset(9, enc::LEA(rd, 0), ("lea " + d + ", ").c_str()); break;
+			case 16: labelOrOffset(11, enc::JSR(0), "jsr "); break;
+			case 17: l = { "jsr " + s1, enc::JSRR(rs1) }; break;
+			case 18: l = { "jmp " + s1, enc::JMP(rs1) }; break;
+			case 19: {
+				int v = in.nextInt(0, 255);
+				l = { "trap " + number(in, v), enc::TRAP(v) };
+				break;
+			}
+			case 20: {
+				int v = signedValue(in, 16);
+				l = { ".dat " + number(in, v), (word)v };
+				l.isData = true;
+				break;
+			}
+			default:
+				switch (in.nextInt(0, 3)) {
+				case 0: l = { "ret", enc::RET() }; break;
+				case 1: l = { "rti", enc::RTI() }; break;
+				case 2: l = { "nop", enc::NOP() }; break;
+				default: l = { "halt", enc::HALT() }; break;
+				}
+				break;
+			}
+
+			return l;
+		}
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	using namespace m16;
+
+	// Corrupted sections must be rejected, not read out of bounds
+	debugInfo garbage;
+	garbage.decode(data, size);
+
+	// So must be any text given to preprocessor
+	static sourceCache includes;
+	static std::vector<std::string> includePaths;
+
+	try {
+		preprocessor pre(includes, includePaths);
+		pre.process(std::string((const char*)data, size).c_str(), "");
+	} catch (micrasm_error&) {
+	}
+
+	fuzz::input in(data, size);
+
+	int lineCount = in.nextInt(1, fuzz::MAX_LINES);
+
+	bool isRelocatable = in.nextBool();
+
+	std::vector<fuzz::line> lines;
+	for (int i = 0; i < lineCount; i++) lines.push_back(fuzz::generate(in, lineCount, isRelocatable));
+
+	// Every line gets label, so any line can be referenced
+	std::string source;
+	std::vector<int> sourceLines;
+	for (int i = 0; i < lineCount; i++) {
+		bool isOwnLine = in.nextBool();
+
+		source += "l" + std::to_string(i) + ":" + (isOwnLine ? "\n\t" : "\t") + lines[i].text;
+		source += in.nextBool() ? "\t; comment\n" : "\n";
+
+		sourceLines.push_back((i == 0 ? 1 : sourceLines.back() + 1) + (isOwnLine ? 1 : 0));
+	}
+
+	micrasm assembly;
+
+	try {
+		assembly.assemble(source.c_str());
+	} catch (micrasm_error& e) {
+		fuzz::fail("micrasm rejected valid program: %s\n%s", e.what(), source.c_str());
+	}
+
+	const byte* code = assembly.getCode();
+
+	for (int i = 0; i < lineCount; i++) {
+		fuzz::line& l = lines[i];
+		word expected = l.expected;
+
+		if (l.label >= 0) {
+			int offset = l.label - (i + 1);
+			expected |= offset & ((1 << l.offsetSize) - 1);
+		}
+
+		word actual = (code[i * 2] << 8) | code[i * 2 + 1];
+		if (actual != expected) fuzz::fail("line %d '%s' = 0x%04x, expected 0x%04x", i + 1, l.text.c_str(), actual, expected);
+	}
+
+	// A bad line is reported on its line, the rest assembles as before
+	int badLine = in.nextInt(0, lineCount - 1);
+	size_t badAt = 0;
+	for (int l = 1; l < sourceLines[badLine]; l++) badAt = source.find('\n', badAt) + 1;
+
+	std::string broken = source;
+	broken.insert(badAt, in.nextBool() ? "\tadd r1, r9, #1\n" : "\t@ bad\n");
+
+	micrasm recovery;
+	recovery.setErrorLimit(10);
+	recovery.assemble(broken.c_str());
+
+	const std::vector<diagnostic>& diagnostics = recovery.getDiagnostics();
+	if (diagnostics.size() != 1 || diagnostics[0].line != sourceLines[badLine]) {
+		fuzz::fail("bad line %d gave %d errors, first on line %d\n%s", sourceLines[badLine], (int)diagnostics.size(),
+			diagnostics.empty() ? 0 : diagnostics[0].line, broken.c_str());
+	}
+
+	if (memcmp(code, recovery.getCode(), lineCount * 2) != 0) fuzz::fail("assembly after bad line differs\n%s", broken.c_str());
+
+	// The same line from a macro, with a skipped bad block before it
+	int macroLine = in.nextInt(0, lineCount - 1);
+	size_t macroAt = 0;
+	for (int l = 1; l < sourceLines[macroLine]; l++) macroAt = source.find('\n', macroAt) + 1;
+
+	std::string macroSource = ".equ SKIP #0\n.macro emit\n\t" + lines[macroLine].text + "\n.endm\n.if SKIP\n\t@ bad\n.endif\n";
+	const int MACRO_LINES = 7;
+
+	size_t textAt = source.find(lines[macroLine].text, macroAt);
+	macroSource += source.substr(0, textAt) + "emit" + source.substr(textAt + lines[macroLine].text.size());
+
+	micrasm expansion;
+
+	try {
+		expansion.assemble(macroSource.c_str());
+	} catch (micrasm_error& e) {
+		fuzz::fail("preprocessor broke the program: %s\n%s", e.what(), macroSource.c_str());
+	}
+
+	if (memcmp(code, expansion.getCode(), lineCount * 2) != 0) fuzz::fail("macro expansion differs\n%s", macroSource.c_str());
+
+	for (int i = 0; i < lineCount; i++) {
+		const lineEntry* e = expansion.getDebugInfo().find((word)(i * 2));
+		if (e == nullptr || e->line != sourceLines[i] + MACRO_LINES) fuzz::fail("expanded x%04x has line %d, expected %d\n%s", i * 2, e != nullptr ? e->line : 0, sourceLines[i] + MACRO_LINES, macroSource.c_str());
+	}
+
+	// Bytes -> disassembly -> bytes
+	disasm dis(assembly.getLabels());
+
+	std::string listing;
+	for (int i = 0; i < lineCount; i++) {
+		word inst = (code[i * 2] << 8) | code[i * 2 + 1];
+
+		listing += "l" + std::to_string(i) + ":\t";
+		listing += lines[i].isData ? ".dat #" + std::to_string((int16_t)inst) : dis.format(inst, i * 2);
+		listing += "\n";
+	}
+
+	micrasm reassembly;
+
+	try {
+		reassembly.assemble(listing.c_str());
+	} catch (micrasm_error& e) {
+		fuzz::fail("micrasm rejected disassembly: %s\n%s", e.what(), listing.c_str());
+	}
+
+	if (memcmp(code, reassembly.getCode(), lineCount * 2) != 0) {
+		fuzz::fail("disassembly does not round-trip:\n%s\nsource:\n%s", listing.c_str(), source.c_str());
+	}
+
+	// Line table -> image section -> line table
+	std::vector<byte> image(code, code + lineCount * 2);
+	assembly.getDebugInfo().encode(image);
+
+	const byte* section;
+	size_t sectionSize;
+	if (debugInfo::splitImage(image.data(), image.size(), &section, &sectionSize) != (size_t)lineCount * 2) fuzz::fail("image section is not found");
+
+	debugInfo decoded;
+	if (!decoded.decode(section, sectionSize)) fuzz::fail("line table does not decode");
+	if (decoded.getLabels() != assembly.getLabels()) fuzz::fail("labels do not round-trip");
+
+	for (int i = 0; i < lineCount * 2; i++) {
+		const lineEntry* e = decoded.find((word)i);
+		if (e == nullptr || e->line != sourceLines[i / 2]) fuzz::fail("address x%04x has line %d, expected %d\n%s", i, e != nullptr ? e->line : 0, sourceLines[i / 2], source.c_str());
+	}
+
+	if (decoded.find((word)(lineCount * 2)) != nullptr) fuzz::fail("line after the end of program");
+
+	// Block layout by a short run must keep every label in reach
+	static FILE* sink = tmpfile();
+
+	cpu vm;
+	vm.console = sink != nullptr ? sink : stderr;
+	vm.loadImage(assembly.getCode());
+
+	profile counts;
+	vm.attachProfile(&counts);
+	vm.run(4096);
+
+	micrasm laidOut;
+
+	try {
+		laidOut.assemble(source.c_str(), counts);
+	} catch (micrasm_error& e) {
+		fuzz::fail("block layout broke the program: %s\n%s", e.what(), source.c_str());
+	}
+
+	// Lines of laid out code are lines of the source
+	for (const lineEntry& e : laidOut.getDebugInfo().getLines()) {
+		if (std::find(sourceLines.begin(), sourceLines.end(), e.line) == sourceLines.end()) fuzz::fail("laid out x%04x has line %d\n%s", e.address, e.line, source.c_str());
+	}
+
+	return 0;
+}
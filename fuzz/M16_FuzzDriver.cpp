@@ -0,0 +1,72 @@
+// Standalone driver for fuzz targets, used when libFuzzer is not available.
+// Accepts a subset of libFuzzer's command line, so both builds are run the same way:
+//
+//     m16_fuzz_exec [-runs=N] [-seed=N] [-max_len=N] [file...]
+//
+// Files are replayed as inputs (e.g. crash reproducers), otherwise N random inputs are generated.
+
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "M16_Fuzz.h"
+
+static bool readFile(const char* path, std::vector<uint8_t>& data) {
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr) return false;
+
+	uint8_t buf[4096];
+	size_t bytesRead;
+	while ((bytesRead = fread(buf, 1, sizeof(buf), file)) > 0) {
+		data.insert(data.end(), buf, buf + bytesRead);
+	}
+
+	fclose(file);
+	return true;
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned long runs = 1000;
+	unsigned long seed = 16;
+	unsigned long maxLen = 4096;
+
+	std::vector<const char*> files;
+
+	for (int i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "-runs=", 6) == 0) runs = strtoul(argv[i] + 6, nullptr, 10);
+		else if (strncmp(argv[i], "-seed=", 6) == 0) seed = strtoul(argv[i] + 6, nullptr, 10);
+		else if (strncmp(argv[i], "-max_len=", 9) == 0) maxLen = strtoul(argv[i] + 9, nullptr, 10);
+		else if (argv[i][0] == '-') fprintf(stderr, "Ignoring unknown option '%s'\n", argv[i]);
+		else files.push_back(argv[i]);
+	}
+
+	if (!files.empty()) {
+		for (const char* path : files) {
+			std::vector<uint8_t> data;
+
+			if (!readFile(path, data)) {
+				fprintf(stderr, "Can't open '%s'\n", path);
+				return 1;
+			}
+
+			LLVMFuzzerTestOneInput(data.data(), data.size());
+		}
+
+		printf("Replayed %zu input(s)\n", files.size());
+		return 0;
+	}
+
+	std::mt19937 rng(seed);
+	std::vector<uint8_t> data;
+
+	for (unsigned long run = 0; run < runs; run++) {
+		data.resize(rng() % (maxLen + 1));
+		for (uint8_t& b : data) b = rng() & 0xff;
+
+		LLVMFuzzerTestOneInput(data.data(), data.size());
+	}
+
+	printf("Done %lu runs, seed %lu\n", runs, seed);
+	return 0;
+}
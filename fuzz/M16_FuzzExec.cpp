@@ -0,0 +1,241 @@
+// Differential execution fuzzer.
+// Random initial state and memory image is executed by every engine,
+// state of each engine must match the reference cpu::process() after every block.
+// Cache simulation and pipeline model must not change anything but cycles.
+// Lockstep engine runs several lanes with perturbed registers, each lane is checked against its own reference run.
+
+#include "M16_Fuzz.h"
+
+namespace m16 {
+	namespace fuzz {
+		constexpr int BLOCK_SIZE = 64;
+		constexpr int BLOCK_COUNT = 16;
+		constexpr int LOCKSTEP_LANES = 5;
+		constexpr int BANKS = 3;		// Engines get banks, so 'trap x28' switches them. Lanes have none
+
+		// Small caches, so lines are evicted and written back all the time. One hierarchy per engine
+		static memoryHierarchy* caches(int id) {
+			static std::unique_ptr<memoryHierarchy> hierarchies[3];
+
+			if (hierarchies[id] == nullptr) {
+				hierarchyConfig config;
+				config.l1i = { 256, 2, 16, writePolicy::writeBack };
+				config.l1d = { 128, 2, 8, writePolicy::writeBack };
+				config.l2 = { 1024, 4, 32, writePolicy::writeThrough };
+
+				hierarchies[id].reset(new memoryHierarchy(config));
+			}
+
+			hierarchies[id]->reset();
+			return hierarchies[id].get();
+		}
+
+		// No forwarding from MEM/WB, so operands fall out of forwarding window
+		static pipeline* timing() {
+			pipelineConfig config;
+			config.memForwarding = false;
+			config.predictorBits = 4;
+
+			static pipeline model(config);
+			model.reset();
+
+			return &model;
+		}
+
+		static profile* counts() {
+			static profile counters;
+			counters.reset();
+
+			return &counters;
+		}
+
+		struct engine {
+			const char* name;
+			void (*setup)(cpu* vm, program* prog);		// Called after image is loaded
+			void (*step)(cpu* vm);
+			bool isShared = false;		// Memory of cpu is not its own, as on cores of machine
+		};
+
+		static const engine engines[] = {
+			{ "reference", nullptr, [](cpu* vm) { vm->process(); } },
+			{ "decoded", [](cpu* vm, program* prog) { vm->attachDecoded(prog); }, [](cpu* vm) { vm->processDecoded(); } },
+			{ "cached", [](cpu* vm, program*) { vm->attachCaches(caches(0)); }, [](cpu* vm) { vm->run(1); } },
+			{ "decoded_cached", [](cpu* vm, program* prog) {
+				vm->attachDecoded(prog);
+				vm->attachCaches(caches(1));
+			}, [](cpu* vm) { vm->run(1); } },
+			{ "pipelined", [](cpu* vm, program*) {
+				vm->attachCaches(caches(2));
+				vm->attachPipeline(timing());
+			}, [](cpu* vm) { vm->run(1); } },
+			{ "decoded_profiled", [](cpu* vm, program* prog) {
+				vm->attachDecoded(prog);
+				vm->attachProfile(counts());
+			}, [](cpu* vm) { vm->run(1); } },
+			{ "shared", nullptr, [](cpu* vm) { vm->process(); }, true },
+			{ "decoded_shared", [](cpu* vm, program* prog) { vm->attachDecoded(prog); }, [](cpu* vm) { vm->run(1); }, true },
+		};
+
+		constexpr size_t ENGINE_COUNT = sizeof(engines) / sizeof(engines[0]);
+
+		// Guest output of 'trap x10' is not compared
+		static FILE* sink() {
+			static FILE* file = tmpfile();
+			return file != nullptr ? file : stderr;
+		}
+
+		struct instance {
+			cpu* vm = new cpu();
+			program prog;
+			bool stopped = false;
+			std::unique_ptr<byte[]> memory;
+
+			instance() { vm->console = sink(); }
+			~instance() { delete vm; }
+
+			void share() {
+				delete vm;
+				memory.reset(new byte[MAX_MEM_SIZE]());
+				vm = new cpu(memory.get());
+				vm->console = sink();
+			}
+		};
+
+		static void runBlock(const engine& e, instance& inst) {
+			for (int i = 0; i < BLOCK_SIZE; i++) {
+				if (inst.vm->debugHalt) {
+					inst.stopped = true;
+					return;
+				}
+
+				e.step(inst.vm);
+			}
+		}
+
+		static void compare(instance& ref, instance& other, const char* name, int block) {
+			for (int r = 0; r <= (int)Register::PSR; r++) {
+				word expected = ref.vm->getRegister((Register)r);
+				word actual = other.vm->getRegister((Register)r);
+
+				if (expected != actual) fail("%s: block %d, register %d = 0x%04x, expected 0x%04x", name, block, r, actual, expected);
+			}
+
+			if (ref.vm->debugHalt != other.vm->debugHalt) fail("%s: block %d, halt state differs", name, block);
+			if (ref.vm->unhandledException != other.vm->unhandledException) fail("%s: block %d, unhandled exception differs", name, block);
+			if (ref.vm->getStatus() != other.vm->getStatus()) fail("%s: block %d, status differs", name, block);
+
+			for (int addr = 0; addr < MAX_MEM_SIZE; addr++) {
+				byte expected = ref.vm->readByte(addr);
+				byte actual = other.vm->readByte(addr);
+
+				if (expected != actual) fail("%s: block %d, memory[0x%04x] = 0x%02x, expected 0x%02x", name, block, addr, actual, expected);
+			}
+
+			if (ref.vm->getSelectedBank() != other.vm->getSelectedBank()) fail("%s: block %d, selected bank differs", name, block);
+
+			for (int id = 0; id < BANKS; id++) {
+				if (memcmp(ref.vm->getBank(id), other.vm->getBank(id), BANK_SIZE) != 0) fail("%s: block %d, bank %d differs", name, block, id);
+			}
+		}
+
+		// Lane 0 gets initial registers as is, others get them mixed with the lane number,
+		// so lanes diverge on branches and meet again
+		static word laneRegister(const word* regs, int lane, int r) {
+			if (lane == 0 || r >= (int)Register::PC) return regs[r];
+
+			return regs[r] ^ (word)(lane * (r + 1) * 0x1111);
+		}
+
+		static void checkLockstep(const byte* image, const word* regs) {
+			lockstep lanes(LOCKSTEP_LANES);
+			lanes.console = sink();
+			lanes.loadImage(image);
+
+			for (int l = 0; l < LOCKSTEP_LANES; l++) {
+				for (int r = 0; r < 10; r++) lanes.setRegister(l, (Register)r, laneRegister(regs, l, r));
+			}
+
+			// In blocks, so lanes parked by the budget of one call resume in the next
+			for (int b = 0; b < BLOCK_COUNT; b++) lanes.run(BLOCK_SIZE);
+
+			for (int l = 0; l < LOCKSTEP_LANES; l++) {
+				instance ref;
+				ref.vm->loadImage((byte*)image);
+				for (int r = 0; r < 10; r++) ref.vm->setRegister((Register)r, laneRegister(regs, l, r));
+
+				uint64_t steps = 0;
+				for (; steps < BLOCK_SIZE * BLOCK_COUNT && !ref.vm->debugHalt; steps++) ref.vm->process();
+
+				for (int r = 0; r <= (int)Register::PSR; r++) {
+					word expected = ref.vm->getRegister((Register)r);
+					word actual = lanes.getRegister(l, (Register)r);
+
+					if (expected != actual) fail("lockstep: lane %d, register %d = 0x%04x, expected 0x%04x", l, r, actual, expected);
+				}
+
+				if (ref.vm->getStatus() != lanes.getStatus(l)) fail("lockstep: lane %d, status '%s', expected '%s'", l,
+					statusName(lanes.getStatus(l)), statusName(ref.vm->getStatus()));
+				if (ref.vm->unhandledException != lanes.getUnhandledException(l)) fail("lockstep: lane %d, unhandled exception differs", l);
+				if (steps != lanes.getRetired(l)) fail("lockstep: lane %d, retired %llu instructions, expected %llu", l,
+					(unsigned long long)lanes.getRetired(l), (unsigned long long)steps);
+
+				for (int addr = 0; addr < MAX_MEM_SIZE; addr++) {
+					byte expected = ref.vm->readByte(addr);
+					byte actual = lanes.readByte(l, addr);
+
+					if (expected != actual) fail("lockstep: lane %d, memory[0x%04x] = 0x%02x, expected 0x%02x", l, addr, actual, expected);
+				}
+			}
+		}
+	}
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	using namespace m16;
+
+	fuzz::input in(data, size);
+
+	// Initial register file goes first, the rest of the input is memory image
+	word regs[10];
+	for (int r = 0; r < 10; r++) regs[r] = in.nextWord();
+
+	byte* image = new byte[MAX_MEM_SIZE];
+	memset(image, 0, MAX_MEM_SIZE);
+
+	size_t imageSize = in.remaining() < MAX_MEM_SIZE ? in.remaining() : MAX_MEM_SIZE;
+	for (size_t i = 0; i < imageSize; i++) image[i] = in.nextByte();
+
+	// Start somewhere inside of the image
+	regs[8] = imageSize >= 2 ? (regs[8] % imageSize) & ~1 : 0;
+
+	fuzz::instance instances[fuzz::ENGINE_COUNT];
+	for (size_t e = 0; e < fuzz::ENGINE_COUNT; e++) {
+		fuzz::instance& inst = instances[e];
+
+		if (fuzz::engines[e].isShared) inst.share();
+
+		inst.vm->setBankCount(fuzz::BANKS - 1);
+		inst.vm->loadImage(image);
+		if (fuzz::engines[e].setup != nullptr) fuzz::engines[e].setup(inst.vm, &inst.prog);
+
+		for (int r = 0; r < 10; r++) inst.vm->setRegister((Register)r, regs[r]);
+	}
+
+	fuzz::checkLockstep(image, regs);
+
+	delete[] image;
+
+	for (int block = 0; block < fuzz::BLOCK_COUNT; block++) {
+		for (size_t e = 0; e < fuzz::ENGINE_COUNT; e++) {
+			fuzz::runBlock(fuzz::engines[e], instances[e]);
+		}
+
+		for (size_t e = 1; e < fuzz::ENGINE_COUNT; e++) {
+			fuzz::compare(instances[0], instances[e], fuzz::engines[e].name, block);
+		}
+
+		if (instances[0].stopped) break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,453 @@
+#include <climits>
+
+#include "include/M16.h"
+#include "include/M16_C.h"
+
+using namespace m16;
+
+struct m16_vm {
+	cpu vm;
+	program prog;
+	bool isDecoded = false;
+
+	std::unique_ptr<memoryHierarchy> caches;
+	std::unique_ptr<pipeline> timing;
+	std::unique_ptr<profile> counts;
+	std::unordered_map<std::string, word> labels;
+
+	// Line table of the last assembled source or of the loaded image. Section of an image stays encoded until it is needed
+	std::string sourceName;
+	std::unique_ptr<debugInfo> debug;
+	std::vector<byte> debugSection;
+
+	sourceCache includes;
+	std::vector<std::string> includePaths;
+};
+
+static void configure(m16_vm* vm, micrasm& assembly) {
+	assembly.setSourceName(vm->sourceName);
+	assembly.setSourceCache(&vm->includes);
+	for (const std::string& dir : vm->includePaths) assembly.addIncludePath(dir);
+}
+
+// Without memory for the table the image has no lines
+static const debugInfo* lineTable(m16_vm* vm) {
+	if (!vm->debugSection.empty()) {
+		try {
+			std::unique_ptr<debugInfo> info(new debugInfo());
+
+			if (info->decode(vm->debugSection.data(), vm->debugSection.size())) {
+				vm->labels = info->getLabels();
+				vm->debug = std::move(info);
+			}
+		} catch (std::exception&) {
+			vm->labels.clear();
+		}
+
+		vm->debugSection.clear();
+	}
+
+	return vm->debug.get();
+}
+
+static cacheConfig toCacheConfig(const m16_cache_config* c) {
+	if (c == nullptr) return cacheConfig();
+
+	return { (int)c->size, (int)c->ways, (int)c->line_size, c->policy == M16_WRITE_THROUGH ? writePolicy::writeThrough : writePolicy::writeBack };
+}
+
+static_assert((int)status::illegalOpcode == M16_ILLEGAL_OPCODE, "m16_status must follow m16::status");
+static_assert(STALL_COUNT == M16_STALL_COUNT, "m16_stall must follow m16::stall");
+
+extern "C" {
+	int m16_api_version(void) {
+		return M16_API_VERSION;
+	}
+
+	m16_vm* m16_create(void) {
+		// Members allocate too: memory of cpu, tables of program
+		try {
+			return new m16_vm();
+		} catch (std::exception&) {
+			return nullptr;
+		}
+	}
+
+	void m16_destroy(m16_vm* vm) {
+		delete vm;
+	}
+
+	int m16_load_image(m16_vm* vm, const uint8_t* image, size_t size) {
+		const byte* section;
+		size_t sectionSize;
+		size_t memorySize = size > 0 ? debugInfo::splitImage(image, size, &section, &sectionSize) : 0;
+
+		if (memorySize > MAX_MEM_SIZE) return 1;
+
+		try {
+			std::vector<byte> full(MAX_MEM_SIZE, 0);
+			if (memorySize > 0) memcpy(full.data(), image, memorySize);
+
+			vm->vm.loadImage(full.data());
+			vm->labels.clear();
+			vm->debug.reset();
+			vm->debugSection.clear();
+
+			if (size > 0 && section != nullptr) vm->debugSection.assign(section, section + sectionSize);
+			return 0;
+		} catch (std::exception&) {
+			return 1;
+		}
+	}
+
+	int m16_assemble(m16_vm* vm, const char* source, char* error, size_t errorSize) {
+		try {
+			micrasm assembly;
+			configure(vm, assembly);
+			assembly.assemble(source);
+
+			vm->vm.loadImage(assembly.getCode());
+			vm->labels = assembly.getLabels();
+			vm->debug.reset(new debugInfo(assembly.getDebugInfo()));
+			vm->debugSection.clear();
+			return 0;
+		} catch (std::exception& e) {
+			if (error != nullptr && errorSize > 0) snprintf(error, errorSize, "%s", e.what());
+			return 1;
+		}
+	}
+
+	int m16_assemble_report(m16_vm* vm, const char* source, int maxErrors, m16_diagnostic_fn fn, void* user) {
+		try {
+			micrasm assembly;
+			configure(vm, assembly);
+
+			assembly.setErrorLimit(maxErrors > 0 ? maxErrors : INT_MAX);
+			assembly.assemble(source);
+
+			const std::vector<diagnostic>& diagnostics = assembly.getDiagnostics();
+
+			if (diagnostics.empty()) {
+				vm->vm.loadImage(assembly.getCode());
+				vm->labels = assembly.getLabels();
+				vm->debug.reset(new debugInfo(assembly.getDebugInfo()));
+				vm->debugSection.clear();
+			}
+
+			if (fn != nullptr) {
+				for (const diagnostic& d : diagnostics) fn(d.line, d.message.c_str(), user);
+			}
+
+			return (int)diagnostics.size();
+		} catch (std::exception& e) {
+			if (fn != nullptr) fn(0, e.what(), user);
+			return 1;
+		}
+	}
+
+	int m16_assemble_with_profile(m16_vm* vm, const char* source, const char* profilePath, m16_layout_stats* stats, char* error, size_t errorSize) {
+		try {
+			profile counts;
+
+			if (!counts.load(profilePath)) {
+				if (error != nullptr && errorSize > 0) snprintf(error, errorSize, "can't read profile '%s'", profilePath);
+				return 1;
+			}
+
+			micrasm assembly;
+			configure(vm, assembly);
+			assembly.assemble(source, counts);
+
+			vm->vm.loadImage(assembly.getCode());
+			vm->labels = assembly.getLabels();
+			vm->debug.reset(new debugInfo(assembly.getDebugInfo()));
+			vm->debugSection.clear();
+
+			if (stats != nullptr) {
+				const layoutStats& s = assembly.getLayoutStats();
+				*stats = { s.regions, s.laidOut, s.blocks, s.movedBlocks, s.invertedBranches, s.addedBranches, s.removedBranches };
+			}
+			return 0;
+		} catch (std::exception& e) {
+			if (error != nullptr && errorSize > 0) snprintf(error, errorSize, "%s", e.what());
+			return 1;
+		}
+	}
+
+	void m16_use_decoded(m16_vm* vm, int enable) {
+		vm->isDecoded = enable != 0;
+		vm->vm.attachDecoded(vm->isDecoded ? &vm->prog : nullptr);
+	}
+
+	void m16_set_debug(m16_vm* vm, int enable) {
+		vm->vm.isDebug = enable != 0;
+	}
+
+	m16_status m16_run(m16_vm* vm, uint64_t budget) {
+		return (m16_status)vm->vm.run(budget);
+	}
+
+	m16_status m16_run_limits(m16_vm* vm, uint64_t instructions, uint64_t cycles, double seconds) {
+		limits lim;
+		lim.instructions = instructions;
+		lim.cycles = cycles;
+		lim.seconds = seconds;
+
+		return (m16_status)vm->vm.run(lim);
+	}
+
+	m16_status m16_get_status(m16_vm* vm) {
+		return (m16_status)vm->vm.getStatus();
+	}
+
+	const char* m16_status_name(m16_status s) {
+		return statusName((status)s);
+	}
+
+	uint64_t m16_get_retired(m16_vm* vm) {
+		return vm->vm.retired;
+	}
+
+	uint64_t m16_get_cycles(m16_vm* vm) {
+		return vm->vm.cycles;
+	}
+
+	uint16_t m16_get_register(m16_vm* vm, m16_register reg) {
+		return vm->vm.getRegister((Register)reg);
+	}
+
+	void m16_set_register(m16_vm* vm, m16_register reg, uint16_t value) {
+		vm->vm.setRegister((Register)reg, value);
+	}
+
+	uint8_t m16_read_byte(m16_vm* vm, uint16_t address) {
+		return vm->vm.readByte(address);
+	}
+
+	void m16_write_byte(m16_vm* vm, uint16_t address, uint8_t value) {
+		vm->vm.writeByte(address, value);
+	}
+
+	uint16_t m16_read_word(m16_vm* vm, uint16_t address) {
+		return vm->vm.readWord(address);
+	}
+
+	void m16_write_word(m16_vm* vm, uint16_t address, uint16_t value) {
+		vm->vm.writeWord(address, value);
+	}
+
+	void m16_read_memory(m16_vm* vm, uint16_t address, uint8_t* buffer, size_t size) {
+		for (size_t i = 0; i < size; i++) buffer[i] = vm->vm.readByte((word)(address + i));
+	}
+
+	void m16_write_memory(m16_vm* vm, uint16_t address, const uint8_t* buffer, size_t size) {
+		for (size_t i = 0; i < size; i++) vm->vm.writeByte((word)(address + i), buffer[i]);
+	}
+
+	void m16_bind_trap(m16_vm* vm, uint8_t vector, m16_trap_fn fn, void* user) {
+		if (fn == nullptr) {
+			vm->vm.bindTrap(vector, nullptr);
+			return;
+		}
+
+		// Out of memory leaves the previous binding
+		try {
+			vm->vm.bindTrap(vector, [vm, vector, fn, user](cpu&) { fn(vm, vector, user); });
+		} catch (std::exception&) {
+		}
+	}
+
+	void m16_set_output(m16_vm* vm, m16_output_fn fn, void* user) {
+		if (fn == nullptr) {
+			vm->vm.bindTrap(0x10, nullptr);
+			return;
+		}
+
+		// Same text as cpu prints to console. Without debug traps x10 goes to the guest handler
+		try {
+			vm->vm.bindTrap(0x10, [fn, user](cpu& c) {
+				if (!c.isDebug) {
+					c.setRegister(Register::PC, c.readWord(0x10 << 1));
+					return;
+				}
+
+				char text[16];
+				int size = snprintf(text, sizeof(text), "%d\n", c.getRegister(Register::R4));
+				fn(text, (size_t)size, user);
+			});
+		} catch (std::exception&) {
+		}
+	}
+
+	int m16_set_caches(m16_vm* vm, const m16_cache_config* l1i, const m16_cache_config* l1d, const m16_cache_config* l2) {
+		m16_disable_caches(vm);
+
+		hierarchyConfig config;
+		config.l1i = toCacheConfig(l1i);
+		config.l1d = toCacheConfig(l1d);
+		config.l2 = toCacheConfig(l2);
+
+		try {
+			vm->caches.reset(new memoryHierarchy(config));
+		} catch (std::exception&) {
+			return 1;
+		}
+
+		vm->vm.attachCaches(vm->caches.get());
+		return 0;
+	}
+
+	void m16_disable_caches(m16_vm* vm) {
+		vm->vm.attachCaches(nullptr);
+		vm->caches.reset();
+	}
+
+	int m16_get_cache_stats(m16_vm* vm, m16_cache_level level, m16_cache_stats* stats) {
+		if (vm->caches == nullptr) return 1;
+
+		const cache* c = level == M16_L1I ? vm->caches->getL1I() : level == M16_L1D ? vm->caches->getL1D() : vm->caches->getL2();
+		if (c == nullptr) return 1;
+
+		stats->accesses = c->getStats().accesses;
+		stats->misses = c->getStats().misses;
+		stats->write_backs = c->getStats().writeBacks;
+		return 0;
+	}
+
+	// Reports sort their rows, without memory for that nothing is printed
+	void m16_print_cache_report(m16_vm* vm, FILE* out, int count) {
+		try {
+			if (vm->caches != nullptr) vm->caches->report(out, vm->vm, vm->labels, count, lineTable(vm));
+		} catch (std::exception&) {
+		}
+	}
+
+	int m16_set_pipeline(m16_vm* vm, m16_predictor prediction, int forwarding) {
+		m16_disable_pipeline(vm);
+
+		pipelineConfig config;
+		config.prediction = (predictor)prediction;
+		config.exForwarding = forwarding != 0;
+		config.memForwarding = forwarding != 0;
+
+		try {
+			vm->timing.reset(new pipeline(config));
+		} catch (std::exception&) {
+			return 1;
+		}
+
+		vm->vm.attachPipeline(vm->timing.get());
+		return 0;
+	}
+
+	void m16_disable_pipeline(m16_vm* vm) {
+		vm->vm.attachPipeline(nullptr);
+		vm->timing.reset();
+	}
+
+	int m16_get_pipeline_stats(m16_vm* vm, m16_pipeline_stats* stats) {
+		if (vm->timing == nullptr) return 1;
+
+		const pipeline::stats& s = vm->timing->getStats();
+		stats->instructions = s.instructions;
+		stats->cycles = s.cycles;
+		for (int c = 0; c < STALL_COUNT; c++) stats->stalls[c] = s.stalls[c];
+		stats->branches = s.branches;
+		stats->mispredictions = s.mispredictions;
+		return 0;
+	}
+
+	const char* m16_stall_name(m16_stall s) {
+		return stallName((stall)s);
+	}
+
+	void m16_print_pipeline_report(m16_vm* vm, FILE* out) {
+		try {
+			if (vm->timing != nullptr) vm->timing->report(out);
+		} catch (std::exception&) {
+		}
+	}
+
+	int m16_enable_profile(m16_vm* vm) {
+		m16_disable_profile(vm);
+
+		try {
+			vm->counts.reset(new profile());
+		} catch (std::exception&) {
+			return 1;
+		}
+
+		vm->vm.attachProfile(vm->counts.get());
+		return 0;
+	}
+
+	void m16_disable_profile(m16_vm* vm) {
+		vm->vm.attachProfile(nullptr);
+		vm->counts.reset();
+	}
+
+	int m16_save_profile(m16_vm* vm, const char* path) {
+		if (vm->counts == nullptr) return 1;
+
+		try {
+			lineTable(vm);
+			return vm->counts->save(path, vm->labels) ? 0 : 1;
+		} catch (std::exception&) {
+			return 1;
+		}
+	}
+
+	void m16_print_branch_report(m16_vm* vm, FILE* out, int count) {
+		try {
+			if (vm->counts != nullptr) vm->counts->report(out, vm->vm, vm->labels, count, lineTable(vm));
+		} catch (std::exception&) {
+		}
+	}
+
+	// Out of memory leaves the settings unchanged
+	void m16_add_include_path(m16_vm* vm, const char* dir) {
+		try {
+			vm->includePaths.push_back(dir);
+		} catch (std::exception&) {
+		}
+	}
+
+	void m16_set_source_name(m16_vm* vm, const char* name) {
+		try {
+			vm->sourceName = name != nullptr ? name : "";
+		} catch (std::exception&) {
+		}
+	}
+
+	int m16_find_line(m16_vm* vm, uint16_t address, const char** file, int* line) {
+		const debugInfo* lines = lineTable(vm);
+		const lineEntry* e = lines != nullptr ? lines->find(address) : nullptr;
+		if (e == nullptr) return 1;
+
+		if (file != nullptr) *file = lines->getFile(e->file).c_str();
+		if (line != nullptr) *line = e->line;
+		return 0;
+	}
+
+	int m16_save_image(m16_vm* vm, const char* path, int withDebug) {
+		try {
+			// Trailing zeros are not stored, loading zeroes the rest of memory
+			size_t size = MAX_MEM_SIZE;
+			while (size > 0 && vm->vm.readByte((word)(size - 1)) == 0) size--;
+
+			std::vector<byte> image(size);
+			for (size_t i = 0; i < size; i++) image[i] = vm->vm.readByte((word)i);
+
+			const debugInfo* lines = withDebug != 0 ? lineTable(vm) : nullptr;
+			if (lines != nullptr) lines->encode(image);
+
+			FILE* file = fopen(path, "wb");
+			if (file == nullptr) return 1;
+
+			bool isWritten = fwrite(image.data(), 1, image.size(), file) == image.size();
+			return fclose(file) == 0 && isWritten ? 0 : 1;
+		} catch (std::exception&) {
+			return 1;
+		}
+	}
+}
@@ -1,6 +1,38 @@
+#include <chrono>
+
 #include "include/M16_CPU.h"
+#include "include/M16_Cache.h"
+#include "include/M16_Pipeline.h"
+#include "include/M16_Profile.h"
 
 namespace m16 {
+	const char* statusName(status s) {
+		switch (s) {
+		case status::running: return "running";
+		case status::halted: return "halted";
+		case status::instructionLimit: return "instruction limit exceeded";
+		case status::cycleLimit: return "cycle limit exceeded";
+		case status::timeLimit: return "time limit exceeded";
+		case status::unalignedAccess: return "unaligned access";
+		case status::divideByZero: return "division by zero";
+		case status::privilegeViolation: return "privilege violation";
+		case status::illegalOpcode: return "illegal opcode";
+		}
+
+		return "unknown";
+	}
+
+	status statusOf(exception id) {
+		switch (id) {
+		case exception::privilegeViolation: return status::privilegeViolation;
+		case exception::illegalOpcode: return status::illegalOpcode;
+		case exception::divideByZero: return status::divideByZero;
+		case exception::unalignedAccess: return status::unalignedAccess;
+		}
+
+		return status::halted;
+	}
+
 	word subscr(word val, int start, int end) {
 		return (~(0xffff << end) & val) >> start;
 	}
@@ -14,31 +46,14 @@ namespace m16 {
 	}
 
 	word mult(word a, word b) {
-		word c = 0;
-
-		while (b & 0xffff) {
-			if (b & 1) c += a;
-
-			a <<= 1;
-			b >>= 1;
-		}
-
-		return c;
+		return arith::mul(a, b);
 	}
 
+	// Division by zero gives all ones, as there is no cpu to raise exception on
 	word idiv(word a, word b) {
-		word q = 0, r = 0;
-
-		for (int i = 15; i > 0; i--) {
-			r <<= 1;
-			r |= (a >> i) & 1;
-			if (r >= b) {
-				r -= b;
-				q |= 1 << i;
-			}
-		}
+		if (b == 0) return 0xffff;
 
-		return q;
+		return arith::div(a, b);
 	}
 
 	word signext(word val, int size) {
@@ -54,12 +69,67 @@ namespace m16 {
 		return val_5;
 	}
 
+	cpu::cpu() : memory(new byte[MAX_MEM_SIZE]()), ownsMemory(true) {
+		resetPages();
+	}
+
+	cpu::cpu(byte* sharedMemory) : memory(sharedMemory), ownsMemory(false) {
+		resetPages();
+	}
+
+	cpu::~cpu() {
+		if (ownsMemory) delete[] memory;
+	}
+
+	void cpu::setPage(int page, byte* data, bool isWritable) {
+		if (!isWritable && discarded == nullptr) discarded.reset(new byte[PAGE_SIZE]);
+
+		pages[page] = data;
+		writablePages[page] = isWritable ? data : discarded.get();
+	}
+
+	void cpu::resetPages() {
+		for (int page = 0; page < PAGE_COUNT; page++) setPage(page, memory + page * PAGE_SIZE, true);
+	}
+
+	void cpu::invalidateDecoded() {
+		decodedCache->invalidate(0, MAX_MEM_SIZE);
+	}
+
+	void cpu::setBankCount(int count) {
+		selectBank(0);
+
+		banks.clear();
+		for (int id = 0; id < count; id++) banks.emplace_back(new byte[BANK_SIZE]());
+	}
+
+	bool cpu::selectBank(int id) {
+		if (id < 0 || id >= getBankCount()) return false;
+		if (id == bank) return true;
+
+		byte* base = getBank(id);
+		for (int offset = 0; offset < BANK_SIZE; offset += PAGE_SIZE) {
+			setPage((BANK_WINDOW + offset) >> PAGE_BITS, base + offset, true);
+		}
+
+		bank = id;
+
+		// Code can run from banks too
+		if (decodedCache != nullptr) decodedCache->invalidate(BANK_WINDOW, BANK_SIZE);
+
+		return true;
+	}
+
 	void cpu::push(word val) {
-		writeWord(--regs[6], val);
+		regs[6] -= 2;
+		writeWord(regs[6], val);
 	}
 
 	word cpu::pop() {
-		return readWord(regs[6]++);
+		word val = readWord(regs[6]);
+		regs[6] += 2;
+
+		return val;
 	}
 
 	void cpu::setPrivileged(bool isPrivileged) {
@@ -70,50 +140,98 @@ namespace m16 {
 		return !getBit(regs[9], 15);
 	}
 
-	void cpu::setFlags(word result) {
-		if (result == 0) {
-			regs[9] = setBit(regs[9], 2, false);	// NF
-			regs[9] = setBit(regs[9], 1, true);		// ZF
-			regs[9] = setBit(regs[9], 0, false);	// PF
-			return;
-		}
+	bool cpu::mapBuffer(word address, byte* buffer, int size, bool isWritable) {
+		if ((address | size) & (PAGE_SIZE - 1) || size <= 0 || address + size > MAX_MEM_SIZE) return false;
 
-		regs[9] = setBit(regs[9], 1, false);		// ZF
-		if (result & 0x8000) {
-			regs[9] = setBit(regs[9], 2, true);		// NF
-			regs[9] = setBit(regs[9], 0, false);	// PF
-		} else {
-			regs[9] = setBit(regs[9], 2, false);	// NF
-			regs[9] = setBit(regs[9], 0, true);		// PF
+		// Words are accessed through atomic_ref, which needs them aligned
+		if ((uintptr_t)buffer % alignof(word) != 0) return false;
+		if (address < BANK_WINDOW + BANK_SIZE && BANK_WINDOW < address + size) return false;
+
+		for (int offset = 0; offset < size; offset += PAGE_SIZE) {
+			setPage((address + offset) >> PAGE_BITS, buffer + offset, isWritable);
 		}
+
+		// Code can run from mapped buffers too
+		if (decodedCache != nullptr) decodedCache->invalidate(address, size);
+
+		return true;
+	}
+
+	bool cpu::unmapBuffer(word address, int size) {
+		return mapBuffer(address, memory + address, size, true);
 	}
 
 	void cpu::loadImage(byte* code) {
-		int i = 0;
+		// Image goes into the memory block and the selected bank. Host buffers are not written,
+		// their part of the image shows after unmapBuffer()
+		for (int page = 0; page < PAGE_COUNT; page++) {
+			int address = page * PAGE_SIZE;
+			bool isWindow = address >= BANK_WINDOW && address < BANK_WINDOW + BANK_SIZE;
 
-		while (i < MAX_MEM_SIZE) {
-			memory[i] = code[i];
-			i++;
+			memcpy(isWindow ? pages[page] : memory + address, code + address, PAGE_SIZE);
 		}
+
+		if (decodedCache != nullptr) invalidateDecoded();
 	}
 
 	void cpu::process() {
-		word inst = readWord(regs[8]);
+		if (ownsMemory) execute<0>();
+		else execute<SHARED_MEMORY>();
+	}
+
+	template<int probes>
+	void cpu::execute() {
+		[[maybe_unused]] word pc = regs[8];
+
+		// Cycles of cache misses, for the pipeline model
+		[[maybe_unused]] int fetchStall = 0;
+		[[maybe_unused]] int memoryStall = 0;
+
+		auto simulateLoad = [&](word address) {
+			if constexpr ((probes & PROBE_CACHES) != 0) {
+				memoryStall = caches->load(pc, address);
+				cycles += memoryStall;
+			}
+		};
+
+		auto simulateStore = [&](word address) {
+			if constexpr ((probes & PROBE_CACHES) != 0) {
+				memoryStall = caches->store(pc, address);
+				cycles += memoryStall;
+			}
+		};
+
+		word inst;
+		if (!loadWord(regs[8], inst)) return;
 		byte opcode = inst >> 12;
 
+		if constexpr ((probes & PROBE_CACHES) != 0) {
+			fetchStall = caches->fetch(pc);
+			cycles += fetchStall;
+		}
+
+		if constexpr ((probes & PROBE_PROFILE) != 0) counts->execute(pc);
+
 		byte reg1 = (inst >> 9) & 0x7;
 		byte reg2 = (inst >> 6) & 0x7;
 		byte imm6 = inst & 0x3f;
 
 		regs[8] += 2;
+		cycles += CYCLES[opcode];
 
 		switch (opcode) {
 		case 0b0000: { /* BR */
-			if (((inst & 0x800) && (regs[9] & 0x4)) ||
+			bool isTaken = ((inst & 0x800) && (regs[9] & 0x4)) ||
 				((inst & 0x400) && (regs[9] & 0x2)) ||
-				((inst & 0x200) && (regs[9] & 0x1))) {
+				((inst & 0x200) && (regs[9] & 0x1));
+
+			if (isTaken) {
 				regs[8] += (signext(inst & 0x1ff, 9) << 1);
 			}
+
+			if constexpr ((probes & PROBE_PROFILE) != 0) {
+				if (reg1 != 0 && reg1 != 7) counts->branch(pc, isTaken);
+			}
 			break;
 		}
 		case 0b0001: { /* ADD */
@@ -127,20 +245,26 @@ namespace m16 {
 			break;
 		}
 		case 0b0010: { /* LDB */
-			regs[reg1] = zeroext(readByte(regs[reg2] + signext(imm6, 6)));
+			word address = regs[reg2] + signext(imm6, 6);
+			simulateLoad(address);
+
+			regs[reg1] = zeroext(loadByte<probes>(address));
 
 			setFlags(regs[reg1]);
 			break;
 		}
 		case 0b0011: { /* STB */
-			writeByte(regs[reg2] + signext(imm6, 6), regs[reg1]);
+			word address = regs[reg2] + signext(imm6, 6);
+			simulateStore(address);
+
+			storeByte<probes>(address, (byte)regs[reg1]);
 			break;
 		}
 		case 0b0100: { /* JSR */
 			regs[7] = regs[8];
 
 			if ((inst >> 11) & 1) {
-				regs[8] = regs[8] + (signext(inst & 0x3ff, 11) << 1);
+				regs[8] = regs[8] + (signext(inst & 0x7ff, 11) << 1);
 			} else {
 				regs[8] = regs[reg2];
 			}
@@ -157,24 +281,22 @@ namespace m16 {
 			break;
 		}
 		case 0b0110: { /* LDR */
-			regs[reg1] = readWord(regs[reg2] + (signext(imm6, 6) << 1));
+			word address = regs[reg2] + (signext(imm6, 6) << 1);
 
-			setFlags(regs[reg1]);
+			if (loadWord(address, regs[reg1])) {
+				simulateLoad(address);
+				setFlags(regs[reg1]);
+			}
 			break;
 		}
 		case 0b0111: { /* STR */
-			writeWord(regs[reg2] + (signext(imm6, 6) << 1), regs[reg1]);
+			word address = regs[reg2] + (signext(imm6, 6) << 1);
+
+			if (storeWord(address, regs[reg1])) simulateStore(address);
 			break;
 		}
 		case 0b1000: { /* RTI */
-			if (isPriviledged()) {
-				regs[8] = readWord(regs[6]);
-				regs[6] += 2;
-
-				regs[9] = readWord(regs[6]);
-				regs[6] += 2;
-			}
-
+			returnFromHandler();
 			break;
 		}
 		case 0b1001: { /* NOT */
@@ -185,22 +307,18 @@ namespace m16 {
 		}
 		case 0b1010: { /* MUL */
 			if (!(inst & 0x20)) {
-				regs[reg1] = regs[reg2] * regs[imm6 & 0x7];
+				regs[reg1] = arith::mul(regs[reg2], regs[imm6 & 0x7]);
 			} else {
-				regs[reg1] = regs[reg2] * signext(imm6 & 0x1f, 5);
+				regs[reg1] = arith::mul(regs[reg2], signext(imm6 & 0x1f, 5));
 			}
 
 			setFlags(regs[reg1]);
 			break;
 		}
 		case 0b1011: { /* DIV, MOD */
-			if (!(inst & 0x20)) {
-				regs[reg1] = regs[reg2] / regs[imm6 & 0x7];
-			} else {
-				regs[reg1] = regs[reg2] % regs[imm6 & 0x7];
+			if (divide(regs[reg2], imm6 & 0x7, regs[reg1], inst & 0x20)) {
+				setFlags(regs[reg1]);
 			}
-
-			setFlags(regs[reg1]);
 			break;
 		}
 		case 0b1100: { /* RET, JMP */
@@ -236,29 +354,333 @@ namespace m16 {
 			break;
 		}
 		case 0b1111: { /* TRAP */
-			regs[7] = regs[8] + 1;
+			trap(inst & 0xff);
+			break;
+		}
+		}
 
-			if (IS_DEBUG) {
-				switch (inst & 0xff) {
-				case 0x25:
-					debugHalt = true;
-					break;
-				case 0x10:
-					printf("%d\n", regs[4]);
-					break;
-				default:
-					break;
-				}
-			} else {
-				regs[8] = readWord(zeroext(inst & 0xff) << 1);
+		if constexpr ((probes & PROBE_PIPELINE) != 0) timing->retire(pc, disasm::decode(inst), regs[8], regs[9], fetchStall, memoryStall);
+	}
+
+	void cpu::bindTrap(byte vect, hostCall call) {
+		if (hostCalls.empty()) hostCalls.resize(256);
+
+		hostCalls[vect] = std::move(call);
+	}
+
+	void cpu::trap(byte vect) {
+		regs[7] = regs[8] + 1;
+
+		if (!hostCalls.empty() && hostCalls[vect]) {
+			hostCalls[vect](*this);
+			return;
+		}
+
+		if ((vect == TRAP_CAS || vect == TRAP_FETCH_ADD) && (regs[0] & 1)) {
+			unalignedAccess();
+			return;
+		}
+
+		switch (vect) {
+		case TRAP_CAS:
+			regs[0] = compareExchangeWord(regs[0], regs[1], regs[2]);
+			setFlags(regs[0]);
+			return;
+		case TRAP_FETCH_ADD:
+			regs[0] = fetchAddWord(regs[0], regs[1]);
+			setFlags(regs[0]);
+			return;
+		case TRAP_BANK: {
+			word previous = bank;
+			regs[0] = selectBank(regs[0]) ? previous : 0xffff;
+			setFlags(regs[0]);
+			return;
+		}
+		case TRAP_DMA_COPY:
+			dmaCopy(regs[0], regs[1], regs[2]);
+			dmaComplete();
+			return;
+		case TRAP_DMA_FILL:
+			dmaFill(regs[0], (byte)regs[1], regs[2]);
+			dmaComplete();
+			return;
+		case TRAP_DMA_COMPARE:
+			regs[0] = dmaCompare(regs[0], regs[1], regs[2]);
+			setFlags(regs[0]);
+			dmaComplete();
+			return;
+		default:
+			break;
+		}
+
+		if (isDebug) {
+			switch (vect) {
+			case 0x25:
+				halt(status::halted);
+				break;
+			case 0x10:
+				fprintf(console, "%d\n", regs[4]);
+				break;
+			default:
+				break;
+			}
+		} else {
+			regs[8] = readWord(zeroext(vect) << 1);
+
+			if (vect == 0x25) halt(status::halted);
+		}
+	}
+
+	bool cpu::divide(word a, byte divisorReg, word& result, bool isMod) {
+		word b = regs[divisorReg];
+
+		if (b == 0) {
+			raiseException(exception::divideByZero);
+			return false;
+		}
+
+		// Divisors are mostly loop invariants, so reciprocal is computed once per register value
+		arith::divider& d = dividers[divisorReg];
+		if (d.getDivisor() != b) d = arith::divider(b);
+
+		result = isMod ? d.mod(a) : d.div(a);
+		return true;
+	}
+
+	void cpu::processDecoded() {
+		if (ownsMemory) executeDecoded<0>();
+		else executeDecoded<SHARED_MEMORY>();
+	}
+
+	template<int probes>
+	void cpu::executeDecoded() {
+		[[maybe_unused]] word pc = regs[8];
+
+		// Cycles of cache misses, for the pipeline model
+		[[maybe_unused]] int fetchStall = 0;
+		[[maybe_unused]] int memoryStall = 0;
+
+		auto simulateLoad = [&](word address) {
+			if constexpr ((probes & PROBE_CACHES) != 0) {
+				memoryStall = caches->load(pc, address);
+				cycles += memoryStall;
+			}
+		};
+
+		auto simulateStore = [&](word address) {
+			if constexpr ((probes & PROBE_CACHES) != 0) {
+				memoryStall = caches->store(pc, address);
+				cycles += memoryStall;
+			}
+		};
+
+		if (regs[8] & 1) {
+			unalignedAccess();
+			return;
+		}
+
+		const decoded& inst = decodedCache->at(regs[8]);
+
+		// Stale entry is fetched, when it is executed again
+		if constexpr ((probes & PROBE_CACHES) != 0) {
+			if (inst.op != opcode::STALE) {
+				fetchStall = caches->fetch(pc);
+				cycles += fetchStall;
+			}
+		}
+
+		if constexpr ((probes & PROBE_PROFILE) != 0) {
+			if (inst.op != opcode::STALE) counts->execute(pc);
+		}
+
+		regs[8] += 2;
+		cycles += inst.cycles;
+
+		switch (inst.op) {
+		case opcode::BR: {
+			bool isTaken = (inst.reg1 & regs[9] & 0x7) != 0;
+			if (isTaken) regs[8] += inst.imm;
+
+			if constexpr ((probes & PROBE_PROFILE) != 0) {
+				if ((inst.reg1 & 7) != 0 && (inst.reg1 & 7) != 7) counts->branch(pc, isTaken);
+			}
+			break;
+		}
+		case opcode::ADD:
+			regs[inst.reg1] = regs[inst.reg2] + (inst.isImm ? inst.imm : regs[inst.reg3]);
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::LDB: {
+			word address = regs[inst.reg2] + inst.imm;
+			simulateLoad(address);
+
+			regs[inst.reg1] = zeroext(loadByte<probes>(address));
+			setFlags(regs[inst.reg1]);
+			break;
+		}
+		case opcode::STB: {
+			word address = regs[inst.reg2] + inst.imm;
+			simulateStore(address);
+
+			storeByte<probes>(address, (byte)regs[inst.reg1]);
+			break;
+		}
+		case opcode::JSR:
+			regs[7] = regs[8];
+			regs[8] += inst.imm;
+			break;
+		case opcode::JSRR:
+			regs[7] = regs[8];
+			regs[8] = regs[inst.reg2];
+			break;
+		case opcode::AND:
+			regs[inst.reg1] = regs[inst.reg2] & (inst.isImm ? (word)inst.imm : regs[inst.reg3]);
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::LDR: {
+			word address = regs[inst.reg2] + inst.imm;
+
+			if (loadWord(address, regs[inst.reg1])) {
+				simulateLoad(address);
+				setFlags(regs[inst.reg1]);
+			}
+			break;
+		}
+		case opcode::STR: {
+			word address = regs[inst.reg2] + inst.imm;
 
-				if ((inst & 0xff) == 0x25) debugHalt = true;
-			}	
+			if (storeWord(address, regs[inst.reg1])) simulateStore(address);
+			break;
+		}
+		case opcode::RTI:
+			returnFromHandler();
+			break;
+		case opcode::NOT:
+			regs[inst.reg1] = ~regs[inst.reg2];
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::MUL:
+			regs[inst.reg1] = arith::mul(regs[inst.reg2], inst.isImm ? (word)inst.imm : regs[inst.reg3]);
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::DIV:
+		case opcode::MOD:
+			if (divide(regs[inst.reg2], inst.reg3, regs[inst.reg1], inst.op == opcode::MOD)) {
+				setFlags(regs[inst.reg1]);
+			}
+			break;
+		case opcode::JMP:
+			regs[8] = regs[inst.reg2] & 0xfffE;
+			break;
+		case opcode::LSHF:
+			regs[inst.reg1] = regs[inst.reg2] << inst.imm;
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::RSHF:
+			regs[inst.reg1] = regs[inst.reg2] >> inst.imm;
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::ARSHF:
+			regs[inst.reg1] = (int16_t)regs[inst.reg2] >> inst.imm;
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::LEA:
+			regs[inst.reg1] = regs[8] + inst.imm;
+			setFlags(regs[inst.reg1]);
+			break;
+		case opcode::STALE:
+			// Not run since load or bulk change of memory, see program
+			regs[8] -= 2;
+			decodedCache->fetch(regs[8], readWord(regs[8]));
+			executeDecoded<probes>();
+			return;
+		case opcode::TRAP:
+			trap((byte)inst.imm);
 			break;
 		}
+
+		if constexpr ((probes & PROBE_PIPELINE) != 0) timing->retire(pc, inst, regs[8], regs[9], fetchStall, memoryStall);
+	}
+
+	template<bool isDecoded, int probes>
+	void cpu::runLoop(uint64_t end) {
+		while (!debugHalt && retired < end) {
+			retired++;
+
+			if constexpr (isDecoded) executeDecoded<probes>();
+			else execute<probes>();
 		}
 	}
 
+	void cpu::runBlock(uint64_t count) {
+		using loop = void (cpu::*)(uint64_t end);
+
+		// Indexed by engine and probes
+		static constexpr loop LOOPS[2][16] = {
+			{ &cpu::runLoop<false, 0>, &cpu::runLoop<false, 1>, &cpu::runLoop<false, 2>, &cpu::runLoop<false, 3>,
+			  &cpu::runLoop<false, 4>, &cpu::runLoop<false, 5>, &cpu::runLoop<false, 6>, &cpu::runLoop<false, 7>,
+			  &cpu::runLoop<false, 8>, &cpu::runLoop<false, 9>, &cpu::runLoop<false, 10>, &cpu::runLoop<false, 11>,
+			  &cpu::runLoop<false, 12>, &cpu::runLoop<false, 13>, &cpu::runLoop<false, 14>, &cpu::runLoop<false, 15> },
+			{ &cpu::runLoop<true, 0>, &cpu::runLoop<true, 1>, &cpu::runLoop<true, 2>, &cpu::runLoop<true, 3>,
+			  &cpu::runLoop<true, 4>, &cpu::runLoop<true, 5>, &cpu::runLoop<true, 6>, &cpu::runLoop<true, 7>,
+			  &cpu::runLoop<true, 8>, &cpu::runLoop<true, 9>, &cpu::runLoop<true, 10>, &cpu::runLoop<true, 11>,
+			  &cpu::runLoop<true, 12>, &cpu::runLoop<true, 13>, &cpu::runLoop<true, 14>, &cpu::runLoop<true, 15> },
+		};
+
+		int probes = (caches != nullptr ? PROBE_CACHES : 0) | (timing != nullptr ? PROBE_PIPELINE : 0) | (counts != nullptr ? PROBE_PROFILE : 0) |
+			(ownsMemory ? 0 : SHARED_MEMORY);
+
+		// Not called through the array element directly: GCC 12 with -fsanitize=undefined miscompiles that
+		loop selected = LOOPS[decodedCache != nullptr][probes];
+		(this->*selected)(retired + count);
+	}
+
+	status cpu::run(const limits& lim) {
+		using clock = std::chrono::steady_clock;
+
+		uint64_t startRetired = retired;
+		uint64_t startCycles = cycles;
+		clock::time_point deadline = clock::now() + std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(lim.seconds));
+
+		while (!debugHalt) {
+			uint64_t block = LIMIT_CHECK_INTERVAL;
+
+			if (lim.instructions != 0) {
+				uint64_t left = lim.instructions - (retired - startRetired);
+				if (left == 0) return status::instructionLimit;
+				if (left < block) block = left;
+			}
+
+			if (lim.cycles != 0 && cycles - startCycles >= lim.cycles) return status::cycleLimit;
+			if (lim.seconds > 0 && clock::now() >= deadline) return status::timeLimit;
+
+			runBlock(block);
+		}
+
+		return exitStatus;
+	}
+
+	status cpu::run(uint64_t budget) {
+		limits lim;
+		lim.instructions = budget;
+
+		// Zero budget is not "no limit" here
+		if (budget == 0) return debugHalt ? exitStatus : status::instructionLimit;
+
+		return run(lim);
+	}
+
+	void cpu::halt(status why) {
+		exitStatus = why;
+		debugHalt = true;
+	}
+
+	void cpu::attachDecoded(program* prog) {
+		decodedCache = prog;
+
+		if (decodedCache != nullptr) invalidateDecoded();
+	}
+
 	void cpu::setRegister(Register reg, word value) {
 		regs[(int)reg] = value;
 	}
@@ -267,23 +689,246 @@ namespace m16 {
 		return regs[(int)reg];
 	}
 
+	void cpu::enterHandler(word handler) {
+		word psr = regs[9];
+
+		/* Save User SP and set SP to Supervisor SP, if we come from user mode */
+		if (!isPriviledged()) {
+			USP = regs[6];
+			regs[6] = SSP;
+		}
+
+		/* Set mode to privileged */
+		setPrivileged(true);
+
+		/* Fault while entering handler is double fault: nowhere to go */
+		if (regs[6] & 1) {
+			unhandledException = (int)exception::unalignedAccess;
+			halt(status::unalignedAccess);
+			return;
+		}
+
+		/* Push PSR and PC, so RTI pops them back in reverse */
+		push(psr);
+		push(regs[8]);
+
+		regs[8] = handler;
+	}
+
+	void cpu::returnFromHandler() {
+		if (!isPriviledged()) {
+			raiseException(exception::privilegeViolation);
+			return;
+		}
+
+		if (regs[6] & 1) {
+			unalignedAccess();
+			return;
+		}
+
+		regs[8] = pop();
+		regs[9] = pop();
+
+		/* Back to user mode: switch stacks again */
+		if (!isPriviledged()) {
+			SSP = regs[6];
+			regs[6] = USP;
+		}
+	}
+
 	void cpu::sendInterrupt(byte id, int level) {
 		if (level < subscr(regs[9], 8, 10)) return;
 
 		/* Start interrupt routine! */
-		/* First set mode to privileged */
-		setPrivileged(true);
+		enterHandler(readWord(ctableSegment + (id << 1)));
+	}
 
-		/* Save User SP and set SP to Supervisor SP*/
-		USP = regs[6];
-		regs[6] = SSP;
+	void cpu::raiseException(exception id) {
+		word handler = readWord(ctableSegment + ((byte)id << 1));
 
-		/* Push PC and PSR */
-		push(regs[8]);
-		push(regs[9]);
+		/* Exceptions can't be masked, but without handler there is nowhere to go */
+		if (handler == 0) {
+			unhandledException = (int)id;
+			halt(statusOf(id));
+			return;
+		}
 
-		/* Jump to Interrupt routine */
-		regs[8] = memory[id];
+		enterHandler(handler);
+	}
+
+	void cpu::dmaCopy(word to, word from, int size) {
+		if (!ownsMemory) {
+			dmaCopyShared(to, from, size);
+			return;
+		}
+
+		// Ranges longer than half of memory can overlap at both ends, then no direction works
+		if (to != from && (word)(to - from) < size && (word)(from - to) < size) {
+			std::vector<byte> copy(size);
+			for (int i = 0; i < size; i++) copy[i] = *at(from + i);
+			for (int i = 0; i < size; i++) *writableAt(to + i) = copy[i];
+
+			if (decodedCache != nullptr) decodedCache->invalidate(to, size);
+			return;
+		}
+
+		// Overlapping copy to higher address goes from the end, as memmove does
+		bool isBackward = to != from && (word)(to - from) < size;
+
+		for (int left = size; left > 0;) {
+			int chunk = left;
+
+			if (isBackward) {
+				word lastTo = to + left - 1;
+				word lastFrom = from + left - 1;
+
+				if ((lastTo & (PAGE_SIZE - 1)) + 1 < chunk) chunk = (lastTo & (PAGE_SIZE - 1)) + 1;
+				if ((lastFrom & (PAGE_SIZE - 1)) + 1 < chunk) chunk = (lastFrom & (PAGE_SIZE - 1)) + 1;
+
+				memmove(writableAt(lastTo - chunk + 1), at(lastFrom - chunk + 1), chunk);
+			} else {
+				word nextTo = to + size - left;
+				word nextFrom = from + size - left;
+
+				if (PAGE_SIZE - (nextTo & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextTo & (PAGE_SIZE - 1));
+				if (PAGE_SIZE - (nextFrom & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextFrom & (PAGE_SIZE - 1));
+
+				memmove(writableAt(nextTo), at(nextFrom), chunk);
+			}
+
+			left -= chunk;
+		}
+
+		if (decodedCache != nullptr) decodedCache->invalidate(to, size);
+	}
+
+	void cpu::dmaFill(word to, byte value, int size) {
+		if (!ownsMemory) {
+			dmaFillShared(to, value, size);
+			return;
+		}
+
+		for (int done = 0; done < size;) {
+			word next = to + done;
+
+			int chunk = PAGE_SIZE - (next & (PAGE_SIZE - 1));
+			if (size - done < chunk) chunk = size - done;
+
+			memset(writableAt(next), value, chunk);
+			done += chunk;
+		}
+
+		if (decodedCache != nullptr) decodedCache->invalidate(to, size);
+	}
+
+	int cpu::dmaCompare(word a, word b, int size) {
+		if (!ownsMemory) return dmaCompareShared(a, b, size);
+
+		for (int done = 0; done < size;) {
+			word nextA = a + done;
+			word nextB = b + done;
+
+			int chunk = size - done;
+			if (PAGE_SIZE - (nextA & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextA & (PAGE_SIZE - 1));
+			if (PAGE_SIZE - (nextB & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextB & (PAGE_SIZE - 1));
+
+			int result = memcmp(at(nextA), at(nextB), chunk);
+			if (result != 0) return result < 0 ? -1 : 1;
+
+			done += chunk;
+		}
+
+		return 0;
+	}
+
+	void cpu::dmaCopyShared(word to, word from, int size) {
+		// Overlapping at both ends, see dmaCopy()
+		if (to != from && (word)(to - from) < size && (word)(from - to) < size) {
+			std::vector<byte> copy(size);
+			for (int i = 0; i < size; i++) copy[i] = readSharedByte(from + i);
+			for (int i = 0; i < size; i++) writeSharedByte(to + i, copy[i]);
+		} else if (to != from && (word)(to - from) < size) {
+			// From the end, words where both ranges have them
+			for (int left = size; left > 0;) {
+				word lastTo = to + left - 1;
+				word lastFrom = from + left - 1;
+
+				if (left >= 2 && (lastTo & 1) && (lastFrom & 1)) {
+					writableWordAt(lastTo - 1).store(wordAt(lastFrom - 1).load(std::memory_order_acquire), std::memory_order_release);
+					left -= 2;
+				} else {
+					writeSharedByte(lastTo, readSharedByte(lastFrom));
+					left--;
+				}
+			}
+		} else {
+			for (int done = 0; done < size;) {
+				word nextTo = to + done;
+				word nextFrom = from + done;
+
+				if (size - done >= 2 && !(nextTo & 1) && !(nextFrom & 1)) {
+					writableWordAt(nextTo).store(wordAt(nextFrom).load(std::memory_order_acquire), std::memory_order_release);
+					done += 2;
+				} else {
+					writeSharedByte(nextTo, readSharedByte(nextFrom));
+					done++;
+				}
+			}
+		}
+
+		if (decodedCache != nullptr) decodedCache->invalidate(to, size);
+	}
+
+	void cpu::dmaFillShared(word to, byte value, int size) {
+		word pair = value * 0x101;
+
+		for (int done = 0; done < size;) {
+			word next = to + done;
+
+			if (size - done >= 2 && !(next & 1)) {
+				writableWordAt(next).store(pair, std::memory_order_release);
+				done += 2;
+			} else {
+				writeSharedByte(next, value);
+				done++;
+			}
+		}
+
+		if (decodedCache != nullptr) decodedCache->invalidate(to, size);
+	}
+
+	int cpu::dmaCompareShared(word a, word b, int size) {
+		for (int done = 0; done < size;) {
+			word nextA = a + done;
+			word nextB = b + done;
+
+			// Words in guest order compare as their bytes do
+			if (size - done >= 2 && !(nextA & 1) && !(nextB & 1)) {
+				word wordA = readWord(nextA);
+				word wordB = readWord(nextB);
+
+				if (wordA != wordB) return wordA < wordB ? -1 : 1;
+				done += 2;
+			} else {
+				byte byteA = readSharedByte(nextA);
+				byte byteB = readSharedByte(nextB);
+
+				if (byteA != byteB) return byteA < byteB ? -1 : 1;
+				done++;
+			}
+		}
+
+		return 0;
+	}
+
+	void cpu::dmaComplete() {
+		cycles += regs[2] / DMA_BYTES_PER_CYCLE;
+
+		if (dmaInterrupt >= 0) sendInterrupt(dmaInterrupt, dmaLevel);
+	}
+
+	void cpu::unalignedAccess() {
+		raiseException(exception::unalignedAccess);
 	}
 
 	void cpu::dumpMem() {
@@ -293,7 +938,7 @@ namespace m16 {
 			/* Chec line for emptiness */
 			bool isEmpty = true;
 			for (int i = 0; i < 16; i++) {
-				if (memory[line + i] != 0) {
+				if (readByte(line + i) != 0) {
 					isEmpty = false;
 					break;
 				}
@@ -310,13 +955,14 @@ namespace m16 {
 			printf("%04x: ", line);
 
 			for (int i = 0; i < 16; i++) {
-				printf("%02x ", memory[line + i]);
+				printf("%02x ", readByte(line + i));
 			}
 
 			printf("| ");
 
 			for (int i = 0; i < 16; i++) {
-				printf("%c", memory[line + i] >= 32 ? memory[line + i] : '.');
+				byte c = readByte(line + i);
+				printf("%c", c >= 32 ? c : '.');
 			}
 
 			printf("\n");
@@ -341,24 +987,36 @@ namespace m16 {
 		printf("p = %s)\n***\n", regs[9] & 0x1 ? "true" : "false");
 	}
 
-	void cpu::writeWord(word address, word value) {
-		if (address & 1) throw std::runtime_error("Unaligned access to memory while writing word!");
+	word cpu::compareExchangeWord(word address, word expected, word desired) {
+		address &= 0xfffe;
 
-		memory[address] = value >> 8;
-		memory[address + 1] = value & 0xff;
-	}
+		// Read-only word is only read, the store would be discarded anyway
+		if (isReadOnly(address)) return readWord(address);
 
-	word cpu::readWord(word address) {
-		if (address & 1) throw std::runtime_error("Unaligned access to memory while reading word!");
+		word old = toGuestOrder(expected);
+		if (wordAt(address).compare_exchange_strong(old, toGuestOrder(desired))) {
+			if (decodedCache != nullptr) decodedCache->update(address, desired);
+		}
 
-		return (memory[address] << 8) | memory[address + 1];
+		return toGuestOrder(old);
 	}
 
-	void cpu::writeByte(word address, byte value) {
-		memory[address] = value;
-	}
+	word cpu::fetchAddWord(word address, word addend) {
+		address &= 0xfffe;
+
+		if (isReadOnly(address)) return readWord(address);
+
+		// Memory is big-endian, so host fetch_add can't be used directly on little-endian hosts
+		std::atomic_ref<word> target = wordAt(address);
+		word old = target.load(std::memory_order_relaxed);
+		word sum;
+
+		do {
+			sum = toGuestOrder(toGuestOrder(old) + addend);
+		} while (!target.compare_exchange_weak(old, sum));
+
+		if (decodedCache != nullptr) decodedCache->update(address, toGuestOrder(sum));
 
-	byte cpu::readByte(word address) {
-		return memory[address];
+		return toGuestOrder(old);
 	}
-}
\ No newline at end of file
+}
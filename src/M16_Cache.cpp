@@ -0,0 +1,212 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include "include/M16_Cache.h"
+#include "include/M16_DebugInfo.h"
+
+namespace m16 {
+	static bool isPowerOfTwo(int value) {
+		return value > 0 && (value & (value - 1)) == 0;
+	}
+
+	cache::cache(const cacheConfig& config) : config(config) {
+		if (!isPowerOfTwo(config.size) || config.size > MAX_MEM_SIZE) throw std::invalid_argument("cache size must be a power of two up to 64 KiB");
+		if (!isPowerOfTwo(config.lineSize) || config.lineSize < 2) throw std::invalid_argument("line size must be a power of two, 2 bytes or more");
+		if (!isPowerOfTwo(config.ways)) throw std::invalid_argument("associativity must be a power of two");
+		if (config.ways * config.lineSize > config.size) throw std::invalid_argument("cache is smaller than one set");
+
+		lineBits = std::countr_zero((unsigned)config.lineSize);
+		setMask = config.size / (config.ways * config.lineSize) - 1;
+
+		lines.resize(config.size / config.lineSize);
+	}
+
+	bool cache::access(word address, bool isWrite, int& writeBack) {
+		word tag = address >> lineBits;
+		line* set = &lines[(tag & setMask) * config.ways];
+
+		counters.accesses++;
+		useClock++;
+		writeBack = -1;
+
+		for (int w = 0; w < config.ways; w++) {
+			if (!set[w].isValid || set[w].tag != tag) continue;
+
+			set[w].lastUse = useClock;
+			if (isWrite && config.policy == writePolicy::writeBack) set[w].isDirty = true;
+
+			return true;
+		}
+
+		counters.misses++;
+
+		if (isWrite && config.policy == writePolicy::writeThrough) return false;
+
+		// Free line first, then the least recently used one
+		line* victim = set;
+		for (int w = 0; w < config.ways && victim->isValid; w++) {
+			if (!set[w].isValid || set[w].lastUse < victim->lastUse) victim = &set[w];
+		}
+
+		if (victim->isValid && victim->isDirty) {
+			writeBack = victim->tag << lineBits;
+			counters.writeBacks++;
+		}
+
+		victim->tag = tag;
+		victim->isValid = true;
+		victim->isDirty = isWrite;
+		victim->lastUse = useClock;
+
+		return false;
+	}
+
+	void cache::reset() {
+		for (line& l : lines) l = line();
+
+		useClock = 0;
+		counters = stats();
+	}
+
+	memoryHierarchy::memoryHierarchy(const hierarchyConfig& config) : config(config), sites(MAX_MEM_SIZE / 2) {
+		if (config.l1i.size != 0) l1i.reset(new cache(config.l1i));
+		if (config.l1d.size != 0) l1d.reset(new cache(config.l1d));
+		if (config.l2.size != 0) l2.reset(new cache(config.l2));
+	}
+
+	int memoryHierarchy::next(word address, bool isWrite) {
+		if (l2 == nullptr) return isWrite ? 0 : config.memoryCycles;
+
+		int writeBack;
+		bool isHit = l2->access(address, isWrite, writeBack);
+
+		if (isWrite) return 0;
+
+		return isHit ? config.l2Cycles : config.l2Cycles + config.memoryCycles;
+	}
+
+	int memoryHierarchy::access(cache* level, word address, bool isWrite, uint64_t& count, uint64_t& misses) {
+		count++;
+
+		int writeBack = -1;
+		bool isHit = level != nullptr && level->access(address, isWrite, writeBack);
+
+		if (writeBack >= 0) next((word)writeBack, true);
+
+		bool isWriteThrough = level == nullptr || level->getConfig().policy == writePolicy::writeThrough;
+
+		if (isHit) {
+			if (isWrite && isWriteThrough) next(address, true);
+			return 0;
+		}
+
+		misses++;
+
+		// Store, which does not allocate, goes to the next level as is
+		if (isWrite && isWriteThrough) return next(address, true);
+
+		int cost = next(address, false);
+		extraCycles += cost;
+
+		return cost;
+	}
+
+	void memoryHierarchy::reset() {
+		for (cache* level : { l1i.get(), l1d.get(), l2.get() }) {
+			if (level != nullptr) level->reset();
+		}
+
+		std::fill(sites.begin(), sites.end(), site());
+		extraCycles = 0;
+	}
+
+	static double missRate(uint64_t misses, uint64_t accesses) {
+		return accesses == 0 ? 0 : 100.0 * misses / accesses;
+	}
+
+	static void printLevel(FILE* out, const char* name, const cache* level) {
+		if (level == nullptr) return;
+
+		const cacheConfig& c = level->getConfig();
+		const cache::stats& s = level->getStats();
+
+		fprintf(out, "%-3s %6d B, %2d-way, %3d B lines, %s: %llu accesses, %llu misses (%.2f%%), %llu write-backs\n",
+			name, c.size, c.ways, c.lineSize, c.policy == writePolicy::writeBack ? "write-back" : "write-through",
+			(unsigned long long)s.accesses, (unsigned long long)s.misses, missRate(s.misses, s.accesses), (unsigned long long)s.writeBacks);
+	}
+
+	void memoryHierarchy::report(FILE* out, cpu& vm, const std::unordered_map<std::string, word>& labels, int count, const debugInfo* lines) const {
+		fprintf(out, "*** <Cache report>\n");
+
+		printLevel(out, "L1I", l1i.get());
+		printLevel(out, "L1D", l1d.get());
+		printLevel(out, "L2", l2.get());
+
+		fprintf(out, "Miss cycles: %llu\n", (unsigned long long)extraCycles);
+
+		disasm dis(labels);
+
+		// Misses of instructions are summed up to the label they follow
+		std::vector<int> worst;
+		std::unordered_map<std::string, site> regions;
+
+		for (int i = 0; i < (int)sites.size(); i++) {
+			const site& s = sites[i];
+			if (s.fetches == 0) continue;
+
+			if (s.misses() != 0) worst.push_back(i);
+
+			int offset;
+			const char* label = dis.labelOf((word)(i << 1), offset);
+
+			site& region = regions[label != nullptr ? label : "-"];
+			region.fetches += s.fetches;
+			region.fetchMisses += s.fetchMisses;
+			region.accesses += s.accesses;
+			region.accessMisses += s.accessMisses;
+		}
+
+		auto byMisses = [this](int a, int b) { return sites[a].misses() > sites[b].misses() || (sites[a].misses() == sites[b].misses() && a < b); };
+		std::sort(worst.begin(), worst.end(), byMisses);
+		if ((int)worst.size() > count) worst.resize(count);
+
+		fprintf(out, "\nInstructions with the most misses:\n");
+		fprintf(out, "  address  location             instruction             fetch misses         data misses%s\n", lines != nullptr ? "    source" : "");
+
+		for (int i : worst) {
+			word address = (word)(i << 1);
+			const site& s = sites[i];
+
+			int offset;
+			const char* label = dis.labelOf(address, offset);
+
+			char location[64] = "-";
+			if (label != nullptr) snprintf(location, sizeof(location), offset != 0 ? "%s+%d" : "%s", label, offset);
+
+			fprintf(out, "  x%04x    %-20s %-23s %8llu %6.2f%%   %8llu %6.2f%%", address, location, dis.format(vm.readWord(address), address).c_str(),
+				(unsigned long long)s.fetchMisses, missRate(s.fetchMisses, s.fetches),
+				(unsigned long long)s.accessMisses, missRate(s.accessMisses, s.accesses));
+
+			if (lines != nullptr) fprintf(out, "    %s", lines->describe(address).c_str());
+			fprintf(out, "\n");
+		}
+
+		std::vector<std::pair<std::string, site>> ranked(regions.begin(), regions.end());
+		std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+			return a.second.misses() > b.second.misses() || (a.second.misses() == b.second.misses() && a.first < b.first);
+		});
+
+		fprintf(out, "\nLabels with the most misses:\n");
+		fprintf(out, "  label                fetch misses         data misses\n");
+
+		for (int i = 0; i < (int)ranked.size() && i < count && ranked[i].second.misses() != 0; i++) {
+			const site& s = ranked[i].second;
+
+			fprintf(out, "  %-20s %8llu %6.2f%%   %8llu %6.2f%%\n", ranked[i].first.c_str(),
+				(unsigned long long)s.fetchMisses, missRate(s.fetchMisses, s.fetches),
+				(unsigned long long)s.accessMisses, missRate(s.accessMisses, s.accesses));
+		}
+
+		fprintf(out, "***\n");
+	}
+}
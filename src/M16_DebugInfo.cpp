@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <climits>
+
+#include "include/M16_DebugInfo.h"
+
+namespace m16 {
+	static constexpr char MAGIC[8] = { 'M', '1', '6', 'D', 'E', 'B', 'U', 'G' };
+
+	static void putUnsigned(std::vector<byte>& out, uint32_t value) {
+		do {
+			byte b = value & 0x7f;
+			value >>= 7;
+			out.push_back(value != 0 ? b | 0x80 : b);
+		} while (value != 0);
+	}
+
+	// Zigzag, so small negative deltas stay short
+	static void putSigned(std::vector<byte>& out, int32_t value) {
+		putUnsigned(out, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+	}
+
+	static void putString(std::vector<byte>& out, const std::string& s) {
+		putUnsigned(out, (uint32_t)s.size());
+		out.insert(out.end(), s.begin(), s.end());
+	}
+
+	// Bounds-checked reader of the section
+	struct reader {
+		const byte* data;
+		size_t size;
+		size_t pos = 0;
+		bool isValid = true;
+
+		uint32_t getUnsigned() {
+			uint32_t value = 0;
+
+			for (int shift = 0; shift < 35; shift += 7) {
+				if (pos >= size) break;
+
+				byte b = data[pos++];
+				value |= (uint32_t)(b & 0x7f) << shift;
+
+				if ((b & 0x80) == 0) return value;
+			}
+
+			isValid = false;
+			return 0;
+		}
+
+		int32_t getSigned() {
+			uint32_t value = getUnsigned();
+			return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+		}
+
+		std::string getString() {
+			uint32_t length = getUnsigned();
+
+			if (!isValid || length > size - pos) {
+				isValid = false;
+				return std::string();
+			}
+
+			pos += length;
+			return std::string((const char*)data + pos - length, length);
+		}
+	};
+
+	int debugInfo::addFile(const std::string& name) {
+		files.push_back(name);
+		return (int)files.size() - 1;
+	}
+
+	void debugInfo::addLine(word address, word size, int file, int line) {
+		lines.push_back({ address, size, file, line });
+	}
+
+	void debugInfo::sortLines() {
+		std::stable_sort(lines.begin(), lines.end(), [](const lineEntry& a, const lineEntry& b) { return a.address < b.address; });
+	}
+
+	const lineEntry* debugInfo::find(word address) const {
+		// The last entry, which starts at 'address' or before it
+		auto after = std::upper_bound(lines.begin(), lines.end(), address, [](word a, const lineEntry& e) { return a < e.address; });
+		if (after == lines.begin()) return nullptr;
+
+		const lineEntry& e = *(after - 1);
+		return address < e.address + e.size ? &e : nullptr;
+	}
+
+	std::string debugInfo::describe(word address) const {
+		const lineEntry* e = find(address);
+		if (e == nullptr) return std::string();
+
+		const std::string& file = files[e->file];
+		return file.empty() ? "line " + std::to_string(e->line) : file + ":" + std::to_string(e->line);
+	}
+
+	void debugInfo::encode(std::vector<byte>& out) const {
+		size_t start = out.size();
+
+		out.push_back(VERSION);
+
+		putUnsigned(out, (uint32_t)files.size());
+		for (const std::string& f : files) putString(out, f);
+
+		// By address, so images of one source are the same
+		std::vector<std::pair<word, std::string>> sorted;
+		for (const auto& l : labels) sorted.emplace_back(l.second, l.first);
+		std::sort(sorted.begin(), sorted.end());
+
+		putUnsigned(out, (uint32_t)sorted.size());
+		for (const auto& l : sorted) {
+			putUnsigned(out, l.first);
+			putString(out, l.second);
+		}
+
+		// Gap after the previous entry and change of file share one number
+		putUnsigned(out, (uint32_t)lines.size());
+
+		int end = 0;
+		int file = 0;
+		int64_t line = 0;
+
+		for (const lineEntry& e : lines) {
+			bool isNewFile = e.file != file;
+
+			putSigned(out, (e.address - end) * 2 + (isNewFile ? 1 : 0));
+			if (isNewFile) putUnsigned(out, e.file);
+			putUnsigned(out, e.size);
+			putSigned(out, (int32_t)(e.line - line));
+
+			end = e.address + e.size;
+			file = e.file;
+			line = e.line;
+		}
+
+		uint32_t size = (uint32_t)(out.size() - start);
+		for (int i = 0; i < 4; i++) out.push_back((size >> (i * 8)) & 0xff);
+		out.insert(out.end(), MAGIC, MAGIC + sizeof(MAGIC));
+	}
+
+	bool debugInfo::decode(const byte* data, size_t size) {
+		files.clear();
+		lines.clear();
+		labels.clear();
+
+		reader in{ data, size };
+
+		if (size == 0 || data[0] != VERSION) return false;
+		in.pos = 1;
+
+		uint32_t fileCount = in.getUnsigned();
+		for (uint32_t i = 0; i < fileCount && in.isValid; i++) files.push_back(in.getString());
+
+		uint32_t labelCount = in.getUnsigned();
+		for (uint32_t i = 0; i < labelCount && in.isValid; i++) {
+			word address = (word)in.getUnsigned();
+			labels[in.getString()] = address;
+		}
+
+		uint32_t lineCount = in.getUnsigned();
+		if (in.isValid && lineCount <= size) lines.reserve(lineCount);
+
+		// Wide, so deltas of a corrupted section can't overflow
+		int64_t end = 0;
+		uint32_t file = 0;
+		int64_t line = 0;
+
+		for (uint32_t i = 0; i < lineCount && in.isValid; i++) {
+			int32_t gap = in.getSigned();
+			if ((gap & 1) != 0) file = in.getUnsigned();
+
+			int64_t address = end + (gap >> 1);
+			int64_t size = in.getUnsigned();
+			int64_t l = line + in.getSigned();
+
+			if (address < 0 || address > 0xffff || size > 0xffff || l < 0 || l > INT_MAX || file >= files.size()) {
+				in.isValid = false;
+				break;
+			}
+
+			lineEntry e;
+			e.address = (word)address;
+			e.size = (word)size;
+			e.file = (int)file;
+			e.line = (int)l;
+
+			if (!lines.empty() && e.address < lines.back().address) in.isValid = false;
+
+			lines.push_back(e);
+
+			end = e.address + e.size;
+			line = e.line;
+		}
+
+		if (!in.isValid || in.pos != size) {
+			files.clear();
+			lines.clear();
+			labels.clear();
+			return false;
+		}
+
+		return true;
+	}
+
+	size_t debugInfo::splitImage(const byte* image, size_t size, const byte** section, size_t* sectionSize) {
+		*section = nullptr;
+		*sectionSize = 0;
+
+		if (size < FOOTER_SIZE || memcmp(image + size - sizeof(MAGIC), MAGIC, sizeof(MAGIC)) != 0) return size;
+
+		const byte* footer = image + size - FOOTER_SIZE;
+		uint32_t length = footer[0] | (footer[1] << 8) | (footer[2] << 16) | ((uint32_t)footer[3] << 24);
+
+		if (length > size - FOOTER_SIZE) return size;
+
+		*section = footer - length;
+		*sectionSize = length;
+
+		return size - FOOTER_SIZE - length;
+	}
+}
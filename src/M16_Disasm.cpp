@@ -0,0 +1,250 @@
+#include <algorithm>
+
+#include "include/M16_Disasm.h"
+#include "include/M16_CPU.h"
+
+namespace m16 {
+	enum class layout : byte {
+		BR,		// n z p offset9
+		RRX,	// R = R <op> (R|imm5)
+		RRB,	// R, Base, offset6
+		JSR,	// offset11 or Base
+		RTI,
+		NOT,
+		DIV,	// DIV or MOD by the bit 5
+		JMP,
+		SHF,
+		LEA,
+		TRAP,
+	};
+
+	struct tableEntry {
+		opcode op;
+		layout fmt;
+		int offsetShift;		// How much offset is shifted to get bytes
+	};
+
+	// Indexed by the upper 4 bits of instruction
+	static constexpr tableEntry DECODE_TABLE[16] = {
+		{ opcode::BR,	layout::BR,		1 },
+		{ opcode::ADD,	layout::RRX,	0 },
+		{ opcode::LDB,	layout::RRB,	0 },
+		{ opcode::STB,	layout::RRB,	0 },
+		{ opcode::JSR,	layout::JSR,	1 },
+		{ opcode::AND,	layout::RRX,	0 },
+		{ opcode::LDR,	layout::RRB,	1 },
+		{ opcode::STR,	layout::RRB,	1 },
+		{ opcode::RTI,	layout::RTI,	0 },
+		{ opcode::NOT,	layout::NOT,	0 },
+		{ opcode::MUL,	layout::RRX,	0 },
+		{ opcode::DIV,	layout::DIV,	0 },
+		{ opcode::JMP,	layout::JMP,	0 },
+		{ opcode::LSHF,	layout::SHF,	0 },
+		{ opcode::LEA,	layout::LEA,	1 },
+		{ opcode::TRAP,	layout::TRAP,	0 },
+	};
+
+	static const char* MNEMONICS[] = {
+		"br", "add", "ldb", "stb", "jsr", "jsr", "and", "ldr", "str", "rti",
+		"not", "mul", "div", "mod", "jmp", "lshf", "rshf", "arshf", "lea", "trap",
+		"stale",
+	};
+
+	static decoded staleEntry() {
+		decoded stale;
+		stale.op = opcode::STALE;
+		return stale;
+	}
+
+	program::program() : insts(MAX_MEM_SIZE / 2, staleEntry()), codePages(PAGE_COUNT, 0) {}
+
+	void program::decodeImage(const byte* image) {
+		for (int address = 0; address < MAX_MEM_SIZE; address += 2) {
+			insts[address >> 1] = disasm::decode((image[address] << 8) | image[address + 1]);
+		}
+
+		std::fill(codePages.begin(), codePages.end(), 1);
+	}
+
+	void program::invalidate(word address, int size) {
+		constexpr int PAGE_WORDS = 1 << (PAGE_BITS - 1);
+
+		int count = ((address & 1) + size + 1) >> 1;
+		if (count > (int)insts.size()) count = (int)insts.size();
+
+		// Page by page, entry count is a power of two
+		for (int done = 0; done < count;) {
+			int first = ((address >> 1) + done) & (insts.size() - 1);
+			int page = first / PAGE_WORDS;
+
+			int chunk = PAGE_WORDS - first % PAGE_WORDS;
+			if (count - done < chunk) chunk = count - done;
+
+			if (codePages[page] != 0) {
+				std::fill_n(insts.begin() + first, chunk, staleEntry());
+
+				// Whole page is STALE again
+				if (chunk == PAGE_WORDS) codePages[page] = 0;
+			}
+
+			done += chunk;
+		}
+	}
+
+	disasm::disasm(const std::unordered_map<std::string, word>& labels) {
+		for (auto& [name, address] : labels) {
+			symbols.emplace(address, name);
+		}
+	}
+
+	decoded disasm::decode(word inst) {
+		const tableEntry& entry = DECODE_TABLE[inst >> 12];
+
+		decoded d;
+		d.op = entry.op;
+		d.cycles = CYCLES[inst >> 12];
+		d.reg1 = (inst >> 9) & 0x7;
+		d.reg2 = (inst >> 6) & 0x7;
+		d.reg3 = inst & 0x7;
+
+		switch (entry.fmt) {
+		case layout::BR:
+		case layout::LEA:
+			d.imm = signext(inst & 0x1ff, 9) << entry.offsetShift;
+			break;
+		case layout::RRX:
+			d.isImm = inst & 0x20;
+			d.imm = signext(inst & 0x1f, 5);
+			break;
+		case layout::RRB:
+			d.isImm = true;
+			d.imm = signext(inst & 0x3f, 6) << entry.offsetShift;
+			break;
+		case layout::JSR:
+			if (inst & 0x800) {
+				d.isImm = true;
+				d.imm = signext(inst & 0x7ff, 11) << entry.offsetShift;
+			} else {
+				d.op = opcode::JSRR;
+			}
+			break;
+		case layout::DIV:
+			if (inst & 0x20) d.op = opcode::MOD;
+			break;
+		case layout::SHF:
+			if (inst & 0x10) d.op = opcode::LSHF;
+			else if (inst & 0x20) d.op = opcode::ARSHF;
+			else d.op = opcode::RSHF;
+
+			d.isImm = true;
+			d.imm = inst & 0xf;
+			break;
+		case layout::TRAP:
+			d.isImm = true;
+			d.imm = inst & 0xff;
+			break;
+		case layout::RTI:
+		case layout::NOT:
+		case layout::JMP:
+			break;
+		}
+
+		return d;
+	}
+
+	const char* disasm::mnemonic(opcode op) {
+		return MNEMONICS[(int)op];
+	}
+
+	const char* disasm::symbolAt(word address) const {
+		auto it = symbols.find(address);
+
+		return it == symbols.end() ? nullptr : it->second.c_str();
+	}
+
+	const char* disasm::labelOf(word address, int& offset) const {
+		auto it = symbols.upper_bound(address);
+		if (it == symbols.begin()) return nullptr;
+
+		--it;
+		offset = address - it->first;
+
+		return it->second.c_str();
+	}
+
+	std::string disasm::format(const decoded& d, word address) const {
+		constexpr size_t BUF_SIZE = 64;
+		char buf[BUF_SIZE];
+
+		// PC-relative operand: label, if there is one, otherwise offset in words
+		auto target = [&](int16_t offset) {
+			const char* name = symbolAt(address + 2 + offset);
+			if (name != nullptr) return std::string(name);
+
+			return "#" + std::to_string(offset >> 1);
+		};
+
+		const char* name = mnemonic(d.op);
+
+		switch (d.op) {
+		case opcode::BR:
+			if (d.reg1 == 0 && d.imm == 0) return "nop";
+
+			snprintf(buf, BUF_SIZE, "br%s%s%s %s", d.reg1 & 4 ? "n" : "", d.reg1 & 2 ? "z" : "", d.reg1 & 1 ? "p" : "", target(d.imm).c_str());
+			break;
+		case opcode::ADD:
+		case opcode::AND:
+		case opcode::MUL:
+			if (d.isImm) snprintf(buf, BUF_SIZE, "%s r%d, r%d, #%d", name, d.reg1, d.reg2, d.imm);
+			else snprintf(buf, BUF_SIZE, "%s r%d, r%d, r%d", name, d.reg1, d.reg2, d.reg3);
+			break;
+		case opcode::LDB:
+		case opcode::STB:
+			snprintf(buf, BUF_SIZE, "%s r%d, r%d, #%d", name, d.reg1, d.reg2, d.imm);
+			break;
+		case opcode::LDR:
+		case opcode::STR:
+			snprintf(buf, BUF_SIZE, "%s r%d, r%d, #%d", name, d.reg1, d.reg2, d.imm >> 1);
+			break;
+		case opcode::JSR:
+			snprintf(buf, BUF_SIZE, "jsr %s", target(d.imm).c_str());
+			break;
+		case opcode::JSRR:
+			snprintf(buf, BUF_SIZE, "jsr r%d", d.reg2);
+			break;
+		case opcode::RTI:
+			return "rti";
+		case opcode::NOT:
+			snprintf(buf, BUF_SIZE, "not r%d, r%d", d.reg1, d.reg2);
+			break;
+		case opcode::DIV:
+		case opcode::MOD:
+			snprintf(buf, BUF_SIZE, "%s r%d, r%d, r%d", name, d.reg1, d.reg2, d.reg3);
+			break;
+		case opcode::JMP:
+			if (d.reg2 == 7) return "ret";
+
+			snprintf(buf, BUF_SIZE, "jmp r%d", d.reg2);
+			break;
+		case opcode::LSHF:
+		case opcode::RSHF:
+		case opcode::ARSHF:
+			snprintf(buf, BUF_SIZE, "%s r%d, r%d, #%d", name, d.reg1, d.reg2, d.imm);
+			break;
+		case opcode::LEA:
+			snprintf(buf, BUF_SIZE, "lea r%d, %s", d.reg1, target(d.imm).c_str());
+			break;
+		case opcode::TRAP:
+			snprintf(buf, BUF_SIZE, "trap x%02x", d.imm);
+			break;
+		case opcode::STALE:
+			return name;
+		}
+
+		return buf;
+	}
+
+	std::string disasm::format(word inst, word address) const {
+		return format(decode(inst), address);
+	}
+}
@@ -0,0 +1,386 @@
+#include <algorithm>
+
+#include "include/M16_Layout.h"
+#include "include/M16_Profile.h"
+
+namespace m16 {
+	static bool isOrig(const sourceStatement& s) {
+		return s.text.compare(0, 5, ".orig") == 0;
+	}
+
+	blockLayout::blockLayout(const std::vector<sourceStatement>& statements, const profile& counts) : statements(statements), counts(counts) {
+		for (int i = 0; i < (int)statements.size(); i++) {
+			for (const std::string& l : statements[i].labels) labelStatements.emplace(l, i);
+		}
+
+		split();
+
+		for (region& r : regions) {
+			if (r.isMovable) chain(r);
+		}
+
+		// Until every label is in reach again
+		do {
+			items.clear();
+			newLabels.clear();
+
+			stats.invertedBranches = 0;
+			stats.addedBranches = 0;
+			stats.removedBranches = 0;
+
+			size_t next = 0;
+			for (int i = 0; i < (int)statements.size();) {
+				if (next < regions.size() && regions[next].first == i) {
+					emit(regions[next]);
+					i = regions[next++].last;
+				} else {
+					items.push_back(copy(i++));
+				}
+			}
+		} while (keepInReach());
+
+		stats.regions = (int)regions.size();
+
+		for (const region& r : regions) {
+			if (!r.isLaidOut) continue;
+
+			stats.laidOut++;
+			for (int k = 0; k < (int)r.order.size(); k++) {
+				if (r.order[k] != r.firstBlock + k) stats.movedBlocks++;
+			}
+		}
+
+		sourceLines.push_back(0);
+
+		for (const item& it : items) {
+			int line = statements[it.statement].line;
+
+			if (it.hasLabels) {
+				for (const std::string& l : statements[it.statement].labels) {
+					source += l + ":\n";
+					sourceLines.push_back(line);
+				}
+
+				if (newLabels.contains(it.statement)) {
+					source += newLabels.at(it.statement) + ":\n";
+					sourceLines.push_back(line);
+				}
+			}
+
+			if (!it.text.empty()) {
+				source += "\t" + it.text + "\n";
+				sourceLines.resize(sourceLines.size() + std::count(it.text.begin(), it.text.end(), '\n') + 1, line);
+			}
+		}
+	}
+
+	blockLayout::kind blockLayout::kindOf(const sourceStatement& s, bool& isRelative) const {
+		isRelative = false;
+
+		switch (s.inst >> 12) {
+		case 0b0000: { /* BR */
+			byte mask = (s.inst >> 9) & 7;
+			if (mask == 0) return kind::plain;
+
+			if (s.reference.empty()) {
+				isRelative = true;
+				return kind::plain;
+			}
+
+			return mask == 7 ? kind::jump : kind::branch;
+		}
+		case 0b0100: /* JSR, JSRR */
+			isRelative = (s.inst & 0x800) && s.reference.empty();
+			return kind::plain;
+		case 0b1110: /* LEA */
+			isRelative = s.reference.empty();
+			return kind::plain;
+		case 0b1000: /* RTI */
+		case 0b1100: /* JMP, RET */
+			return kind::stop;
+		case 0b1111: /* TRAP */
+			return s.inst == 0xF025 ? kind::stop : kind::plain;
+		}
+
+		return kind::plain;
+	}
+
+	void blockLayout::split() {
+		int count = (int)statements.size();
+		std::vector<int> blockOf(count, NONE);
+
+		for (int i = 0; i < count;) {
+			if (statements[i].isDirective) {
+				i++;
+				continue;
+			}
+
+			region r;
+			r.first = i;
+			r.firstBlock = (int)blocks.size();
+
+			// Block starts at label and after branch
+			kind previous = kind::plain;
+
+			for (; i < count && !statements[i].isDirective; i++) {
+				bool isRelative;
+				kind k = kindOf(statements[i], isRelative);
+
+				if (isRelative) r.isMovable = false;
+
+				if (i == r.first || !statements[i].labels.empty() || previous != kind::plain) {
+					block b;
+					b.first = i;
+					b.weight = counts.getExecutions(statements[i].address);
+
+					blocks.push_back(b);
+				}
+
+				blocks.back().last = i;
+				blocks.back().end = k;
+				blockOf[i] = (int)blocks.size() - 1;
+
+				previous = k;
+			}
+
+			r.last = i;
+			r.lastBlock = (int)blocks.size();
+
+			// Code after the region can't get a label, so it must be entered by falling through
+			bool isExitLabelled = r.last < count && !isOrig(statements[r.last]);
+
+			for (int b = r.firstBlock; b < r.lastBlock; b++) {
+				block& bl = blocks[b];
+				const sourceStatement& last = statements[bl.last];
+
+				if (!last.reference.empty() && labelStatements.contains(last.reference)) {
+					int t = labelStatements.at(last.reference);
+					if (t >= r.first && t < r.last) bl.target = blockOf[t];
+				}
+
+				if (bl.end == kind::plain || bl.end == kind::branch) {
+					bl.fallThrough = b + 1 < r.lastBlock ? b + 1 : EXIT;
+					if (bl.fallThrough == EXIT && !isExitLabelled) r.isMovable = false;
+				}
+			}
+
+			stats.blocks += r.lastBlock - r.firstBlock;
+			regions.push_back(r);
+		}
+	}
+
+	void blockLayout::chain(region& r) {
+		struct edge {
+			int from;
+			int to;
+			uint64_t weight;
+			bool isFallThrough;
+		};
+
+		std::vector<edge> edges;
+
+		for (int b = r.firstBlock; b < r.lastBlock; b++) {
+			const block& bl = blocks[b];
+			word address = statements[bl.last].address;
+
+			switch (bl.end) {
+			case kind::branch:
+				if (bl.fallThrough >= 0) edges.push_back({ b, bl.fallThrough, counts.getNotTaken(address), true });
+				if (bl.target >= 0) edges.push_back({ b, bl.target, counts.getTaken(address), false });
+				break;
+			case kind::jump:
+				if (bl.target >= 0) edges.push_back({ b, bl.target, counts.getExecutions(address), false });
+				break;
+			case kind::plain:
+				if (bl.fallThrough >= 0) edges.push_back({ b, bl.fallThrough, counts.getExecutions(address), true });
+				break;
+			case kind::stop:
+				break;
+			}
+		}
+
+		// Hottest edges first, original fall-through wins ties
+		std::stable_sort(edges.begin(), edges.end(), [](const edge& a, const edge& b) {
+			if (a.weight != b.weight) return a.weight > b.weight;
+			return a.isFallThrough && !b.isFallThrough;
+		});
+
+		int count = r.lastBlock - r.firstBlock;
+		std::vector<std::vector<int>> chains(count);
+		std::vector<int> chainOf(count);
+
+		for (int k = 0; k < count; k++) {
+			chains[k].push_back(r.firstBlock + k);
+			chainOf[k] = k;
+		}
+
+		for (const edge& e : edges) {
+			if (e.weight == 0) break;
+
+			// Region is entered at its first block
+			if (e.to == r.firstBlock) continue;
+
+			int from = chainOf[e.from - r.firstBlock];
+			int to = chainOf[e.to - r.firstBlock];
+
+			if (from == to || chains[from].back() != e.from || chains[to].front() != e.to) continue;
+
+			for (int b : chains[to]) chainOf[b - r.firstBlock] = from;
+			chains[from].insert(chains[from].end(), chains[to].begin(), chains[to].end());
+			chains[to].clear();
+		}
+
+		// Entry chain, then the others from the hottest one
+		std::vector<int> rest;
+		for (int c = 0; c < count; c++) {
+			if (!chains[c].empty() && c != chainOf[0]) rest.push_back(c);
+		}
+
+		std::stable_sort(rest.begin(), rest.end(), [&](int a, int b) {
+			return blocks[chains[a].front()].weight > blocks[chains[b].front()].weight;
+		});
+
+		r.order = chains[chainOf[0]];
+		for (int c : rest) r.order.insert(r.order.end(), chains[c].begin(), chains[c].end());
+
+		for (int k = 0; k < count; k++) {
+			if (r.order[k] != r.firstBlock + k) r.isLaidOut = true;
+		}
+	}
+
+	const std::string& blockLayout::label(int statement) {
+		if (!statements[statement].labels.empty()) return statements[statement].labels[0];
+
+		auto found = newLabels.find(statement);
+		if (found != newLabels.end()) return found->second;
+
+		char name[16];
+		snprintf(name, sizeof(name), "_bb_%04x", statements[statement].address);
+
+		std::string unique(name);
+		while (labelStatements.contains(unique) && labelStatements.at(unique) != statement) unique += "_";
+
+		labelStatements[unique] = statement;
+		return newLabels[statement] = unique;
+	}
+
+	const std::string& blockLayout::target(const region& r, int b) {
+		return label(b == EXIT ? r.last : blocks[b].first);
+	}
+
+	blockLayout::item blockLayout::copy(int statement) const {
+		const sourceStatement& s = statements[statement];
+
+		return { statement, s.text, s.end - s.address, s.reference, s.referenceBits, isOrig(s), true };
+	}
+
+	blockLayout::item blockLayout::branchTo(int statement, byte mask, const std::string& label) const {
+		std::string text = "br";
+		if (mask & 4) text += "n";
+		if (mask & 2) text += "z";
+		if (mask & 1) text += "p";
+
+		return { statement, text + " " + label, 2, label, 9, false, false };
+	}
+
+	void blockLayout::emit(const region& r) {
+		if (!r.isLaidOut) {
+			for (int i = r.first; i < r.last; i++) items.push_back(copy(i));
+			return;
+		}
+
+		for (int k = 0; k < (int)r.order.size(); k++) {
+			const block& bl = blocks[r.order[k]];
+			int next = k + 1 < (int)r.order.size() ? r.order[k + 1] : EXIT;
+
+			for (int i = bl.first; i < bl.last; i++) items.push_back(copy(i));
+
+			switch (bl.end) {
+			case kind::stop:
+				items.push_back(copy(bl.last));
+				break;
+			case kind::jump:
+				if (bl.target != NONE && bl.target == next) {
+					// Only labels are left
+					item it = copy(bl.last);
+					it.text.clear();
+					it.size = 0;
+					it.reference.clear();
+
+					items.push_back(it);
+					stats.removedBranches++;
+				} else {
+					items.push_back(copy(bl.last));
+				}
+				break;
+			case kind::branch:
+				if (bl.fallThrough == next) {
+					items.push_back(copy(bl.last));
+				} else if (bl.target != NONE && bl.target == next) {
+					byte mask = (statements[bl.last].inst >> 9) & 7;
+
+					item it = branchTo(bl.last, 7 - mask, target(r, bl.fallThrough));
+					it.hasLabels = true;
+
+					items.push_back(it);
+					stats.invertedBranches++;
+				} else {
+					items.push_back(copy(bl.last));
+					items.push_back(branchTo(bl.last, 7, target(r, bl.fallThrough)));
+					stats.addedBranches++;
+				}
+				break;
+			case kind::plain:
+				items.push_back(copy(bl.last));
+
+				if (bl.fallThrough != next) {
+					items.push_back(branchTo(bl.last, 7, target(r, bl.fallThrough)));
+					stats.addedBranches++;
+				}
+				break;
+			}
+		}
+	}
+
+	bool blockLayout::keepInReach() {
+		std::vector<int> addresses(items.size());
+		std::vector<int> statementAddresses(statements.size(), 0);
+
+		int pc = 0;
+		for (size_t k = 0; k < items.size(); k++) {
+			const item& it = items[k];
+
+			// Labels before '.orig' get the old PC
+			addresses[k] = pc;
+			pc = it.isOrig ? statements[it.statement].end : pc + it.size;
+
+			if (it.hasLabels) statementAddresses[it.statement] = addresses[k];
+		}
+
+		bool isChanged = false;
+
+		for (size_t k = 0; k < items.size(); k++) {
+			const item& it = items[k];
+			if (it.reference.empty() || it.referenceBits > 11 || !labelStatements.contains(it.reference)) continue;
+
+			int t = labelStatements.at(it.reference);
+			int difference = (statementAddresses[t] >> 1) - ((addresses[k] + 2) >> 1);
+			int limit = (1 << (it.referenceBits - 1)) - 1;
+
+			if (difference >= -limit && difference <= limit) continue;
+
+			// Distance depends only on what is between them
+			int low = std::min(it.statement, t);
+			int high = std::max(it.statement, t);
+
+			for (region& r : regions) {
+				if (!r.isLaidOut || r.first > high || r.last <= low) continue;
+
+				r.isLaidOut = false;
+				isChanged = true;
+			}
+		}
+
+		return isChanged;
+	}
+}
@@ -0,0 +1,497 @@
+#include "include/M16_Lockstep.h"
+
+#include "include/M16_LockstepKernels.h"
+
+namespace m16 {
+	// Per-lane counters of retired instructions are words, so they are flushed before they can overflow
+	static constexpr uint64_t FLUSH_INTERVAL = 0xffff;
+
+	lockstep::lockstep(int lanes) : lanes(lanes), kernels(lockstepKernels::select()) {
+		// Every register array is padded to the whole vectors
+		width = (lanes + kernels.lanes - 1) / kernels.lanes * kernels.lanes;
+
+		image.assign(0x10000, 0);
+		pages.resize((size_t)lanes * PAGE_COUNT);
+
+		for (std::vector<word>& r : regs) r.assign(width, 0);
+		USP.assign(width, 0);
+		SSP.assign(width, 0);
+		active.assign(width, 0);
+		mask.assign(width, 0);
+		pending.assign(width, 0);
+
+		exitStatus.assign(lanes, status::running);
+		unhandledException.assign(lanes, -1);
+		retired.assign(lanes, 0);
+
+		loadImage(image.data());
+	}
+
+	void lockstep::loadImage(const byte* code) {
+		if (code != image.data()) memcpy(image.data(), code, MAX_MEM_SIZE);
+
+		decodedImage.decodeImage(image.data());
+
+		privatePages.clear();
+		privateCode.assign(PAGE_COUNT, 0);
+		for (int lane = 0; lane < lanes; lane++) {
+			for (int page = 0; page < PAGE_COUNT; page++) {
+				pages[lane * PAGE_COUNT + page] = image.data() + page * PAGE_SIZE;
+			}
+
+			active[lane] = 0xffff;
+			exitStatus[lane] = status::running;
+			unhandledException[lane] = -1;
+			retired[lane] = 0;
+		}
+
+		for (std::vector<word>& r : regs) std::fill(r.begin(), r.end(), 0);
+	}
+
+	byte* lockstep::writablePageOf(int lane, word address) {
+		byte*& page = pages[lane * PAGE_COUNT + (address >> PAGE_BITS)];
+
+		// Copy on write
+		if (isShared(page)) {
+			privatePages.emplace_back(new byte[PAGE_SIZE]);
+			memcpy(privatePages.back().get(), page, PAGE_SIZE);
+
+			page = privatePages.back().get();
+			privateCode[address >> PAGE_BITS] = 1;
+		}
+
+		return page;
+	}
+
+	void lockstep::setRegister(int lane, Register reg, word value) {
+		regs[(int)reg][lane] = value;
+	}
+
+	word lockstep::getRegister(int lane, Register reg) const {
+		return regs[(int)reg][lane];
+	}
+
+	// Bit 0 is dropped as by cpu, so both bytes are on one page
+	void lockstep::writeWord(int lane, word address, word value) {
+		address &= 0xfffe;
+		byte* page = writablePageOf(lane, address);
+
+		page[address & (PAGE_SIZE - 1)] = value >> 8;
+		page[(address & (PAGE_SIZE - 1)) + 1] = value & 0xff;
+	}
+
+	word lockstep::readWord(int lane, word address) const {
+		address &= 0xfffe;
+		const byte* page = pageOf(lane, address);
+
+		return (page[address & (PAGE_SIZE - 1)] << 8) | page[(address & (PAGE_SIZE - 1)) + 1];
+	}
+
+	void lockstep::writeByte(int lane, word address, byte value) {
+		writablePageOf(lane, address)[address & (PAGE_SIZE - 1)] = value;
+	}
+
+	byte lockstep::readByte(int lane, word address) const {
+		return pageOf(lane, address)[address & (PAGE_SIZE - 1)];
+	}
+
+	void lockstep::stop(int lane, status why) {
+		active[lane] = 0;
+		exitStatus[lane] = why;
+	}
+
+	void lockstep::push(int lane, word val) {
+		regs[6][lane] -= 2;
+		writeWord(lane, regs[6][lane], val);
+	}
+
+	void lockstep::setFlags(int lane, word result) {
+		word flags = result == 0 ? 0x2 : (result & 0x8000) ? 0x4 : 0x1;
+
+		regs[9][lane] = (regs[9][lane] & ~0x7) | flags;
+	}
+
+	// Lane versions of cpu's interrupt routines, see cpu::enterHandler()
+	void lockstep::enterHandler(int lane, word handler) {
+		word psr = regs[9][lane];
+
+		if (getBit(psr, 15)) {
+			USP[lane] = regs[6][lane];
+			regs[6][lane] = SSP[lane];
+		}
+
+		regs[9][lane] = setBit(regs[9][lane], 15, false);
+
+		if (regs[6][lane] & 1) {
+			unhandledException[lane] = (int)exception::unalignedAccess;
+			stop(lane, status::unalignedAccess);
+			return;
+		}
+
+		push(lane, psr);
+		push(lane, regs[8][lane]);
+
+		regs[8][lane] = handler;
+	}
+
+	void lockstep::returnFromHandler(int lane) {
+		if (getBit(regs[9][lane], 15)) {
+			raiseException(lane, exception::privilegeViolation);
+			return;
+		}
+
+		if (regs[6][lane] & 1) {
+			raiseException(lane, exception::unalignedAccess);
+			return;
+		}
+
+		regs[8][lane] = readWord(lane, regs[6][lane]);
+		regs[6][lane] += 2;
+		regs[9][lane] = readWord(lane, regs[6][lane]);
+		regs[6][lane] += 2;
+
+		if (getBit(regs[9][lane], 15)) {
+			SSP[lane] = regs[6][lane];
+			regs[6][lane] = USP[lane];
+		}
+	}
+
+	void lockstep::raiseException(int lane, exception id) {
+		word address = ctableSegment + ((byte)id << 1);
+		word handler = readWord(lane, address);
+
+		if (handler == 0) {
+			unhandledException[lane] = (int)id;
+			stop(lane, statusOf(id));
+			return;
+		}
+
+		enterHandler(lane, handler);
+	}
+
+	void lockstep::trap(int lane, byte vect) {
+		regs[7][lane] = regs[8][lane] + 1;
+
+		// Lanes don't share memory, so atomics are plain read-modify-write
+		if (vect == TRAP_CAS || vect == TRAP_FETCH_ADD) {
+			word address = regs[0][lane];
+			if (address & 1) {
+				raiseException(lane, exception::unalignedAccess);
+				return;
+			}
+
+			word old = readWord(lane, address);
+
+			if (vect == TRAP_FETCH_ADD) writeWord(lane, address, old + regs[1][lane]);
+			else if (old == regs[1][lane]) writeWord(lane, address, regs[2][lane]);
+
+			regs[0][lane] = old;
+			setFlags(lane, old);
+			return;
+		}
+
+		// Lanes have no banks besides bank 0
+		if (vect == TRAP_BANK) {
+			regs[0][lane] = regs[0][lane] == 0 ? 0 : 0xffff;
+			setFlags(lane, regs[0][lane]);
+			return;
+		}
+
+		if (vect == TRAP_DMA_COPY || vect == TRAP_DMA_FILL || vect == TRAP_DMA_COMPARE) {
+			dma(lane, vect);
+			return;
+		}
+
+		if (isDebug) {
+			switch (vect) {
+			case 0x25:
+				stop(lane, status::halted);
+				break;
+			case 0x10:
+				fprintf(console, "%d\n", regs[4][lane]);
+				break;
+			default:
+				break;
+			}
+		} else {
+			regs[8][lane] = readWord(lane, zeroext(vect) << 1);
+
+			if (vect == 0x25) stop(lane, status::halted);
+		}
+	}
+
+	// Page by page as cpu does it, but through page table of the lane
+	void lockstep::dma(int lane, byte vect) {
+		word a = regs[0][lane];
+		word b = regs[1][lane];
+		int size = regs[2][lane];
+
+		if (vect == TRAP_DMA_FILL) {
+			for (int done = 0; done < size;) {
+				word next = a + done;
+
+				int chunk = PAGE_SIZE - (next & (PAGE_SIZE - 1));
+				if (size - done < chunk) chunk = size - done;
+
+				memset(writablePageOf(lane, next) + (next & (PAGE_SIZE - 1)), (byte)b, chunk);
+				done += chunk;
+			}
+		} else if (vect == TRAP_DMA_COPY) {
+			// Ranges longer than half of memory can overlap at both ends, then no direction works
+			if (a != b && (word)(a - b) < size && (word)(b - a) < size) {
+				std::vector<byte> copy(size);
+				for (int i = 0; i < size; i++) copy[i] = readByte(lane, b + i);
+				for (int i = 0; i < size; i++) writeByte(lane, a + i, copy[i]);
+				return;
+			}
+
+			// Overlapping copy to higher address goes from the end, as memmove does
+			bool isBackward = a != b && (word)(a - b) < size;
+
+			for (int left = size; left > 0;) {
+				int chunk = left;
+				word to = isBackward ? a + left - 1 : a + size - left;
+				word from = isBackward ? b + left - 1 : b + size - left;
+
+				if (isBackward) {
+					if ((to & (PAGE_SIZE - 1)) + 1 < chunk) chunk = (to & (PAGE_SIZE - 1)) + 1;
+					if ((from & (PAGE_SIZE - 1)) + 1 < chunk) chunk = (from & (PAGE_SIZE - 1)) + 1;
+
+					to -= chunk - 1;
+					from -= chunk - 1;
+				} else {
+					if (PAGE_SIZE - (to & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (to & (PAGE_SIZE - 1));
+					if (PAGE_SIZE - (from & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (from & (PAGE_SIZE - 1));
+				}
+
+				// Target first: copy on write can replace the source page too
+				byte* target = writablePageOf(lane, to) + (to & (PAGE_SIZE - 1));
+				memmove(target, pageOf(lane, from) + (from & (PAGE_SIZE - 1)), chunk);
+
+				left -= chunk;
+			}
+		} else {
+			int result = 0;
+
+			for (int done = 0; done < size && result == 0;) {
+				word nextA = a + done;
+				word nextB = b + done;
+
+				int chunk = size - done;
+				if (PAGE_SIZE - (nextA & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextA & (PAGE_SIZE - 1));
+				if (PAGE_SIZE - (nextB & (PAGE_SIZE - 1)) < chunk) chunk = PAGE_SIZE - (nextB & (PAGE_SIZE - 1));
+
+				result = memcmp(pageOf(lane, nextA) + (nextA & (PAGE_SIZE - 1)), pageOf(lane, nextB) + (nextB & (PAGE_SIZE - 1)), chunk);
+				done += chunk;
+			}
+
+			regs[0][lane] = result < 0 ? 0xffff : result > 0 ? 1 : 0;
+			setFlags(lane, regs[0][lane]);
+		}
+	}
+
+	void lockstep::stepLane(int l, const decoded& inst) {
+		switch (inst.op) {
+		case opcode::BR:
+			if (inst.reg1 & regs[9][l] & 0x7) regs[8][l] += inst.imm;
+			break;
+		case opcode::ADD:
+			regs[inst.reg1][l] = regs[inst.reg2][l] + (inst.isImm ? inst.imm : regs[inst.reg3][l]);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::AND:
+			regs[inst.reg1][l] = regs[inst.reg2][l] & (inst.isImm ? (word)inst.imm : regs[inst.reg3][l]);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::MUL:
+			regs[inst.reg1][l] = arith::mul(regs[inst.reg2][l], inst.isImm ? (word)inst.imm : regs[inst.reg3][l]);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::NOT:
+			regs[inst.reg1][l] = ~regs[inst.reg2][l];
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::LSHF:
+			regs[inst.reg1][l] = regs[inst.reg2][l] << inst.imm;
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::RSHF:
+			regs[inst.reg1][l] = regs[inst.reg2][l] >> inst.imm;
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::ARSHF:
+			regs[inst.reg1][l] = (int16_t)regs[inst.reg2][l] >> inst.imm;
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::LEA:
+			regs[inst.reg1][l] = regs[8][l] + inst.imm;
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::LDB:
+			regs[inst.reg1][l] = readByte(l, regs[inst.reg2][l] + inst.imm);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		case opcode::STB:
+			writeByte(l, regs[inst.reg2][l] + inst.imm, (byte)regs[inst.reg1][l]);
+			break;
+		case opcode::LDR: {
+			word address = regs[inst.reg2][l] + inst.imm;
+			if (address & 1) {
+				raiseException(l, exception::unalignedAccess);
+				break;
+			}
+
+			regs[inst.reg1][l] = readWord(l, address);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		}
+		case opcode::STR: {
+			word address = regs[inst.reg2][l] + inst.imm;
+			if (address & 1) {
+				raiseException(l, exception::unalignedAccess);
+				break;
+			}
+
+			writeWord(l, address, regs[inst.reg1][l]);
+			break;
+		}
+		case opcode::JSR:
+			regs[7][l] = regs[8][l];
+			regs[8][l] += inst.imm;
+			break;
+		case opcode::JSRR:
+			regs[7][l] = regs[8][l];
+			regs[8][l] = regs[inst.reg2][l];
+			break;
+		case opcode::JMP:
+			regs[8][l] = regs[inst.reg2][l] & 0xfffe;
+			break;
+		case opcode::RTI:
+			returnFromHandler(l);
+			break;
+		case opcode::DIV:
+		case opcode::MOD: {
+			word b = regs[inst.reg3][l];
+			if (b == 0) {
+				raiseException(l, exception::divideByZero);
+				break;
+			}
+
+			regs[inst.reg1][l] = inst.op == opcode::DIV ? arith::div(regs[inst.reg2][l], b) : arith::mod(regs[inst.reg2][l], b);
+			setFlags(l, regs[inst.reg1][l]);
+			break;
+		}
+		case opcode::TRAP:
+			trap(l, (byte)inst.imm);
+			break;
+		case opcode::STALE:		// Decoded image of lanes is never invalidated
+			break;
+		}
+	}
+
+	bool lockstep::executeVector(word pc, const decoded& inst) {
+		word* lanesOf[10];
+		for (int r = 0; r < 10; r++) lanesOf[r] = regs[r].data();
+
+		return kernels.execute(lanesOf, mask.data(), width, pc, inst);
+	}
+
+	void lockstep::execute(word pc) {
+		// Misaligned fetch raises exception in every lane, which got there
+		if (pc & 1) {
+			for (int l = 0; l < lanes; l++) {
+				if (mask[l]) raiseException(l, exception::unalignedAccess);
+			}
+
+			return;
+		}
+
+		// Lanes with private copy of the code page can use shared decoded image only, if the instruction itself
+		// was not changed: data next to code gets pages copied often
+		word shared = (image[pc] << 8) | image[pc + 1];
+		bool isModified = false;
+
+		if (privateCode[pc >> PAGE_BITS]) {
+			for (int l = 0; l < lanes; l++) {
+				if (mask[l] && readWord(l, pc) != shared) {
+					isModified = true;
+					break;
+				}
+			}
+		}
+
+		const decoded& inst = decodedImage.at(pc);
+		if (!isModified && executeVector(pc, inst)) return;
+
+		for (int l = 0; l < lanes; l++) {
+			if (!mask[l]) continue;
+
+			regs[8][l] += 2;
+
+			word current = isModified ? readWord(l, pc) : shared;
+			if (current == shared) stepLane(l, inst);
+			else stepLane(l, disasm::decode(current));
+		}
+	}
+
+	bool lockstep::schedule(word& pc) {
+		// Reconvergence: lanes with the lowest PC go first, so the others wait for them
+		pc = kernels.schedule(regs[8].data(), active.data(), mask.data(), width);
+
+		bool any = pc != 0xffff;
+
+		// 0xffff is also used for stopped lanes, so check whether any active lane really is there
+		if (!any) {
+			for (int l = 0; l < lanes; l++) any |= mask[l] != 0;
+		}
+
+		return any;
+	}
+
+	uint64_t lockstep::run(uint64_t laneBudget) {
+		uint64_t executed = 0;
+
+		// Budget is per call. Lanes which used it are parked by clearing 'active' and resumed on return
+		std::vector<uint64_t> start(retired.begin(), retired.end());
+
+		while (true) {
+			// Lane retires at most one instruction per step, so no lane can get over the budget within 'steps'
+			uint64_t steps = FLUSH_INTERVAL;
+			bool any = false;
+
+			for (int l = 0; l < lanes; l++) {
+				uint64_t used = retired[l] - start[l];
+
+				if (active[l] && used >= laneBudget) active[l] = 0;
+				if (!active[l]) continue;
+
+				any = true;
+				if (laneBudget - used < steps) steps = laneBudget - used;
+			}
+
+			if (!any) break;
+
+			for (uint64_t step = 0; step < steps; step++) {
+				word pc;
+				if (!schedule(pc)) break;
+
+				execute(pc);
+
+				kernels.count(pending.data(), mask.data(), width);
+			}
+
+			for (int l = 0; l < lanes; l++) {
+				retired[l] += pending[l];
+				executed += pending[l];
+				pending[l] = 0;
+			}
+		}
+
+		// Only halt and faults stop a lane for good
+		for (int l = 0; l < lanes; l++) {
+			if (exitStatus[l] == status::running) active[l] = 0xffff;
+		}
+
+		return executed;
+	}
+}
@@ -0,0 +1,48 @@
+// Compiled with AVX2 enabled, see CMakeLists.txt. Used only on CPUs with AVX2
+#include "include/M16_LockstepKernels.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+namespace m16 {
+	namespace {
+		struct avx2 {
+			using vec = __m256i;
+			static constexpr int LANES = 16;
+
+			static vec load(const word* p) { return _mm256_loadu_si256((const __m256i*)p); }
+			static void store(word* p, vec v) { _mm256_storeu_si256((__m256i*)p, v); }
+			static vec set1(word v) { return _mm256_set1_epi16((short)v); }
+			static vec add(vec a, vec b) { return _mm256_add_epi16(a, b); }
+			static vec mul(vec a, vec b) { return _mm256_mullo_epi16(a, b); }
+			static vec bitAnd(vec a, vec b) { return _mm256_and_si256(a, b); }
+			static vec bitOr(vec a, vec b) { return _mm256_or_si256(a, b); }
+			static vec andNot(vec a, vec b) { return _mm256_andnot_si256(a, b); }
+			static vec isZero(vec a) { return _mm256_cmpeq_epi16(a, _mm256_setzero_si256()); }
+			static vec shl(vec a, int n) { return _mm256_sll_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec shr(vec a, int n) { return _mm256_srl_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec sar(vec a, int n) { return _mm256_sra_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec sub(vec a, vec b) { return _mm256_sub_epi16(a, b); }
+			static vec equal(vec a, vec b) { return _mm256_cmpeq_epi16(a, b); }
+			static vec min(vec a, vec b) { return _mm256_min_epu16(a, b); }
+
+			static word reduceMin(vec a) {
+				__m128i half = _mm_min_epu16(_mm256_castsi256_si128(a), _mm256_extracti128_si256(a, 1));
+
+				return (word)_mm_cvtsi128_si32(_mm_minpos_epu16(half));
+			}
+		};
+	}
+
+	const lockstepKernels* avx2LockstepKernels() {
+		static constexpr lockstepKernels KERNELS = lockstepKernel<avx2>::make("avx2");
+		return &KERNELS;
+	}
+}
+#else
+namespace m16 {
+	const lockstepKernels* avx2LockstepKernels() {
+		return nullptr;
+	}
+}
+#endif
@@ -0,0 +1,49 @@
+// Compiled with AVX-512BW enabled, see CMakeLists.txt. Used only on CPUs with AVX-512BW
+#include "include/M16_LockstepKernels.h"
+
+#if defined(__AVX512BW__)
+#include <immintrin.h>
+
+namespace m16 {
+	namespace {
+		struct avx512 {
+			using vec = __m512i;
+			static constexpr int LANES = 32;
+
+			static vec load(const word* p) { return _mm512_loadu_si512(p); }
+			static void store(word* p, vec v) { _mm512_storeu_si512(p, v); }
+			static vec set1(word v) { return _mm512_set1_epi16((short)v); }
+			static vec add(vec a, vec b) { return _mm512_add_epi16(a, b); }
+			static vec mul(vec a, vec b) { return _mm512_mullo_epi16(a, b); }
+			static vec bitAnd(vec a, vec b) { return _mm512_and_si512(a, b); }
+			static vec bitOr(vec a, vec b) { return _mm512_or_si512(a, b); }
+			static vec andNot(vec a, vec b) { return _mm512_andnot_si512(a, b); }
+			static vec isZero(vec a) { return _mm512_movm_epi16(_mm512_cmpeq_epi16_mask(a, _mm512_setzero_si512())); }
+			static vec shl(vec a, int n) { return _mm512_sll_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec shr(vec a, int n) { return _mm512_srl_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec sar(vec a, int n) { return _mm512_sra_epi16(a, _mm_cvtsi32_si128(n)); }
+			static vec sub(vec a, vec b) { return _mm512_sub_epi16(a, b); }
+			static vec equal(vec a, vec b) { return _mm512_movm_epi16(_mm512_cmpeq_epi16_mask(a, b)); }
+			static vec min(vec a, vec b) { return _mm512_min_epu16(a, b); }
+
+			static word reduceMin(vec a) {
+				__m256i half = _mm256_min_epu16(_mm512_castsi512_si256(a), _mm512_extracti64x4_epi64(a, 1));
+				__m128i quarter = _mm_min_epu16(_mm256_castsi256_si128(half), _mm256_extracti128_si256(half, 1));
+
+				return (word)_mm_cvtsi128_si32(_mm_minpos_epu16(quarter));
+			}
+		};
+	}
+
+	const lockstepKernels* avx512LockstepKernels() {
+		static constexpr lockstepKernels KERNELS = lockstepKernel<avx512>::make("avx512");
+		return &KERNELS;
+	}
+}
+#else
+namespace m16 {
+	const lockstepKernels* avx512LockstepKernels() {
+		return nullptr;
+	}
+}
+#endif
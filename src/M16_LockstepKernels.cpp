@@ -0,0 +1,52 @@
+#include "include/M16_Arith.h"
+#include "include/M16_LockstepKernels.h"
+
+namespace m16 {
+	namespace {
+		// Scalar fallback: "vector" of one lane
+		struct scalar {
+			using vec = word;
+			static constexpr int LANES = 1;
+
+			static vec load(const word* p) { return *p; }
+			static void store(word* p, vec v) { *p = v; }
+			static vec set1(word v) { return v; }
+			static vec add(vec a, vec b) { return a + b; }
+			static vec mul(vec a, vec b) { return arith::mul(a, b); }
+			static vec bitAnd(vec a, vec b) { return a & b; }
+			static vec bitOr(vec a, vec b) { return a | b; }
+			static vec andNot(vec a, vec b) { return ~a & b; }
+			static vec isZero(vec a) { return a == 0 ? 0xffff : 0; }
+			static vec shl(vec a, int n) { return a << n; }
+			static vec shr(vec a, int n) { return a >> n; }
+			static vec sar(vec a, int n) { return (int16_t)a >> n; }
+			static vec sub(vec a, vec b) { return a - b; }
+			static vec equal(vec a, vec b) { return a == b ? 0xffff : 0; }
+			static vec min(vec a, vec b) { return a < b ? a : b; }
+			static word reduceMin(vec a) { return a; }
+		};
+	}
+
+	const lockstepKernels* scalarLockstepKernels() {
+		static constexpr lockstepKernels KERNELS = lockstepKernel<scalar>::make("scalar");
+		return &KERNELS;
+	}
+
+	const lockstepKernels& lockstepKernels::select() {
+		static const lockstepKernels* best = []() {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+			// Checks that OS saves the registers too
+			__builtin_cpu_init();
+			if (avx512LockstepKernels() != nullptr && __builtin_cpu_supports("avx512bw")) return avx512LockstepKernels();
+			if (avx2LockstepKernels() != nullptr && __builtin_cpu_supports("avx2")) return avx2LockstepKernels();
+#else
+			// Without the check sets are compiled in only, when the whole program targets them
+			if (avx512LockstepKernels() != nullptr) return avx512LockstepKernels();
+			if (avx2LockstepKernels() != nullptr) return avx2LockstepKernels();
+#endif
+			return scalarLockstepKernels();
+		}();
+
+		return *best;
+	}
+}
@@ -0,0 +1,102 @@
+#include <thread>
+
+#include "include/M16_Machine.h"
+
+namespace m16 {
+	machine::machine(int coreCount, mode runMode, uint64_t quantum) :
+		memory(new byte[MAX_MEM_SIZE]()), runMode(runMode), quantum(quantum) {
+		for (int id = 0; id < coreCount; id++) {
+			cores.emplace_back(new core(memory.get()));
+			cores.back()->vm.setRegister(Register::R0, id);
+
+			cores.back()->vm.bindTrap(TRAP_IPI, [this](cpu& vm) {
+				word target = vm.getRegister(Register::R0);
+				if (target < cores.size()) sendInterrupt(target, (byte)vm.getRegister(Register::R1), vm.getRegister(Register::R2));
+			});
+		}
+	}
+
+	void machine::loadImage(const byte* code) {
+		memcpy(memory.get(), code, MAX_MEM_SIZE);
+	}
+
+	void machine::sendInterrupt(int target, byte id, int level) {
+		core& c = *cores[target];
+
+		std::lock_guard<std::mutex> lock(c.mailboxLock);
+		c.mailbox.push_back({ id, level });
+		c.hasMail.store(true, std::memory_order_release);
+	}
+
+	void machine::deliverInterrupts(core& c) {
+		if (!c.hasMail.load(std::memory_order_acquire)) return;
+
+		std::vector<interrupt> pending;
+		{
+			std::lock_guard<std::mutex> lock(c.mailboxLock);
+			pending.swap(c.mailbox);
+			c.hasMail.store(false, std::memory_order_relaxed);
+		}
+
+		for (const interrupt& irq : pending) {
+			if (isStopped(c)) return;
+
+			c.vm.sendInterrupt(irq.id, irq.level);
+		}
+	}
+
+	void machine::runQuantum(core& c, uint64_t count) {
+		deliverInterrupts(c);
+
+		if (isStopped(c)) return;
+
+		c.vm.run(count);
+	}
+
+	void machine::runCore(core& c, uint64_t budget) {
+		uint64_t start = c.vm.retired;
+
+		while (!isStopped(c) && c.vm.retired - start < budget) {
+			uint64_t left = budget - (c.vm.retired - start);
+			runQuantum(c, left < quantum ? left : quantum);
+		}
+	}
+
+	uint64_t machine::run(uint64_t budget) {
+		// Budget is per call, counted from what every core retired before it
+		std::vector<uint64_t> start;
+		for (const std::unique_ptr<core>& c : cores) start.push_back(c->vm.retired);
+
+		if (runMode == mode::relaxed) {
+			std::vector<std::thread> threads;
+			for (std::unique_ptr<core>& c : cores) {
+				threads.emplace_back([this, &c, budget] { runCore(*c, budget); });
+			}
+
+			for (std::thread& t : threads) t.join();
+		} else {
+			bool isRunning = true;
+
+			while (isRunning) {
+				isRunning = false;
+
+				for (size_t id = 0; id < cores.size(); id++) {
+					core& c = *cores[id];
+					uint64_t used = c.vm.retired - start[id];
+
+					if (isStopped(c) || used >= budget) continue;
+
+					uint64_t left = budget - used;
+					runQuantum(c, left < quantum ? left : quantum);
+
+					isRunning = true;
+				}
+			}
+		}
+
+		uint64_t retired = 0;
+		for (size_t id = 0; id < cores.size(); id++) retired += cores[id]->vm.retired - start[id];
+
+		return retired;
+	}
+}
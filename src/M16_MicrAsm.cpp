@@ -1,4 +1,5 @@
 #include "include/M16_MicrAsm.h"
+#include "include/M16_Profile.h"
 
 #include <cstdarg>
 
@@ -17,18 +18,8 @@ namespace m16 {
 		return micrasm_error(std::string(buf));
 	}
 
-	void micrasm::emitWord(word val) {
-		code[PC++] = (val >> 8);
-		code[PC++] = (val & 0xff);
-	}
-
-	word micrasm::readWord(word at) {
-		return (code[at] << 8) | code[at + 1];
-	}
-
-	void micrasm::writeWord(word at, word v) {
-		code[at] = v >> 8;
-		code[at + 1] = v & 0xff;
+	void micrasm::outOfMemory(word at) {
+		throw micrasm_error::generr("line %d: Word at 0x%04x is out of memory.", line, at);
 	}
 
 	char micrasm::peekChar() {
@@ -63,7 +54,7 @@ namespace m16 {
 			return true;
 		}
 
-		return true;
+		return false;
 	}
 
 	void micrasm::skipWhitespace() {
@@ -105,7 +96,7 @@ namespace m16 {
 		}
 
 		// Otherwise, there is something, which shouldn't be there
-		throw micrasm_error::generr("line %d: Unexpected character '%s'", line, peekChar());
+		throw micrasm_error::generr("line %d: Unexpected character '%c'", line, peekChar());
 	}
 
 	bool micrasm::scanIdent() {
@@ -144,7 +135,7 @@ namespace m16 {
 		} else if (matchChar('x')) {
 			parsed = strtoul(current, &finalChar, 16);
 		} else {
-			throw micrasm_error::generr("line %d: Unknown number specifier '%s'", line, peekChar());
+			throw micrasm_error::generr("line %d: Unknown number specifier '%c'", line, peekChar());
 		}
 
 		if (parsed > (1 << size) - 1) throw micrasm_error::generr("line %d: Number exceds %d-bit unsigned range.", line, size);
@@ -181,6 +172,11 @@ namespace m16 {
 
 			std::string conv(start, current - start);
 
+			if (isRecording) {
+				lastReference = conv;
+				lastReferenceBits = size;
+			}
+
 			// check if label is defined
 			if (labels.contains(conv)) {
 				word absAddr = labels.at(conv) >> 1;
@@ -190,7 +186,7 @@ namespace m16 {
 
 				if (difference < -((1 << (size - 1)) - 1) ||
 					difference >((1 << (size - 1)) - 1))
-					throw micrasm_error::generr("line %d: Label '%s' is not reachable.", line, conv);
+					throw micrasm_error::generr("line %d: Label '%s' is not reachable.", line, conv.c_str());
 
 				start = current;
 				return difference;
@@ -201,7 +197,7 @@ namespace m16 {
 			start = current;
 			return 0;
 		} else {
-			throw micrasm_error::generr("line %d: Unknown number specifier '%s'", line, peekChar());
+			throw micrasm_error::generr("line %d: Unknown number specifier '%c'", line, peekChar());
 		}
 		if (parsed < -((1 << (size - 1)) - 1) ||
 			parsed > ((1 << (size - 1)) - 1)) 
@@ -244,7 +240,7 @@ namespace m16 {
 		skipWhitespace();
 
 		if (matchChar('"')) {
-			while (peekChar() != '"') {
+			while (peekChar() != '"' && peekChar() != '\0') {
 				// Allow some character escape sequences
 				if (matchChar('\\')) {
 					switch (peekChar()) {
@@ -491,15 +487,17 @@ namespace m16 {
 	}
 
 	void micrasm::divModOp(bool isDIV, int line) {
+		const char* name = isDIV ? "div" : "mod";
+
 		byte dest = scanRegister();
 
 		skipWhitespace();
-		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 1.", line, std::string(start, current - start));
+		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 1.", line, name);
 
 		byte src1 = scanRegister();
 
 		skipWhitespace();
-		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 2.", line, std::string(start, current - start));
+		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 2.", line, name);
 
 		byte src2 = scanRegister();
 
@@ -513,15 +511,17 @@ namespace m16 {
 	}
 
 	void micrasm::shiftOp(bool isLeft, bool isArith, int line) {
+		const char* name = isLeft ? "lshf" : isArith ? "arshf" : "rshf";
+
 		byte dest = scanRegister();
 
 		skipWhitespace();
-		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 1.", line, std::string(start, current - start));
+		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 1.", line, name);
 
 		byte src = scanRegister();
 
 		skipWhitespace();
-		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 2.", line, std::string(start, current - start));
+		if (!matchChar(',')) throw micrasm_error::generr("line %d: '%s' receives only 3 operands, got 2.", line, name);
 
 		word imm4 = scanUnsignedWord(4);
 
@@ -540,8 +540,13 @@ namespace m16 {
 		while (labelsToPatch.size() > 0) {
 			patchedLabel& label = labelsToPatch.top();
 
-			if (!labels.contains(label.name))
-				throw micrasm_error::generr("line %d: Can't find the label declaration with the name '%s'.", label.line, label.name);
+			if (!labels.contains(label.name)) {
+				micrasm_error e = micrasm_error::generr("line %d: Can't find the label declaration with the name '%s'.", label.line, label.name.c_str());
+				if (!report(label.line, e.what())) return;
+
+				labelsToPatch.pop();
+				continue;
+			}
 
 			word absAddr = labels.at(label.name) >> 1;
 			word curAddr = (label.address + 2) >> 1;
@@ -549,8 +554,13 @@ namespace m16 {
 			int16_t difference = absAddr - curAddr;
 
 			if (difference < -((1 << (label.offsetSize - 1)) - 1) ||
-				difference >((1 << (label.offsetSize - 1)) - 1))
-				throw micrasm_error::generr("line %d: Label '%s' is not reachable.", label.line, label.name);
+				difference >((1 << (label.offsetSize - 1)) - 1)) {
+				micrasm_error e = micrasm_error::generr("line %d: Label '%s' is not reachable.", label.line, label.name.c_str());
+				if (!report(label.line, e.what())) return;
+
+				labelsToPatch.pop();
+				continue;
+			}
 
 			word instr = readWord(label.address);
 			instr &= ~((1 << label.offsetSize) - 1);
@@ -561,10 +571,78 @@ namespace m16 {
 		}
 	}
 
+	sourceLocation micrasm::locate(int line) {
+		if (lineMap.empty()) return { 0, line };
+
+		return line >= 0 && line < (int)lineMap.size() ? lineMap[line] : lineMap.back();
+	}
+
+	bool micrasm::report(int line, const std::string& message) {
+		// "line N: " of preprocessed source becomes the original file and line
+		sourceLocation at = locate(line);
+		std::string located = message;
+
+		size_t colon = message.find(": ");
+		if (!lineMap.empty() && message.starts_with("line ") && colon != std::string::npos) {
+			located = preprocessor::describe(fileNames, at) + message.substr(colon);
+		}
+
+		if (errorLimit <= 0) throw micrasm_error(located);
+
+		diagnostics.push_back({ at.line, located });
+		return (int)diagnostics.size() < errorLimit;
+	}
+
+	bool micrasm::preprocess(const char* source) {
+		lineMap.clear();
+		fileNames.assign(1, sourceName);
+
+		if (!preprocessor::isNeeded(source)) return true;
+
+		preprocessor pre(*includes, includePaths);
+
+		try {
+			expanded = pre.process(source, sourceName);
+		} catch (micrasm_error& e) {
+			// Already located
+			if (errorLimit <= 0) throw;
+
+			diagnostics.push_back({ pre.getErrorLocation().line, e.what() });
+			return false;
+		}
+
+		lineMap = pre.getLines();
+		fileNames = pre.getFiles();
+		return true;
+	}
+
+	void micrasm::skipLine() {
+		while (peekChar() != '\n' && peekChar() != '\0') nextChar();
+		if (matchChar('\n')) line++;
+
+		lineHasLabelDecl = false;
+		panicMode = false;
+	}
+
 	void micrasm::assemble(const char* source) {
+		diagnostics.clear();
+
+		if (preprocess(source)) assembleText(lineMap.empty() ? source : expanded.c_str());
+	}
+
+	void micrasm::assembleText(const char* source) {
 		line = 1;
 		PC = 0;
 
+		labels.clear();
+		labelsToPatch = {};
+
+		panicMode = false;
+		bool isStopped = false;
+
+		debug = debugInfo();
+		for (const std::string& name : fileNames) debug.addFile(name);
+
 		if (code != nullptr) delete[] code;
 
 		code = new byte[MAX_MEM_SIZE];
@@ -573,7 +651,13 @@ namespace m16 {
 		start = current = source;
 		lineHasLabelDecl = false;
 
-		while (peekChar() != '\0') {
+		while (peekChar() != '\0' && !isStopped) try {
+			// Resynchronize at the next line after an error
+			if (panicMode) {
+				skipLine();
+				continue;
+			}
+
 			start = current;
 
 			skipWhitespace();
@@ -607,10 +691,11 @@ namespace m16 {
 				nextChar();
 
 				// Check whether there is a a label with the same name already declared
-				if (labels.contains(conv)) throw micrasm_error::generr("line %d: Label '%s' already exist.", line, conv);
+				if (labels.contains(conv)) throw micrasm_error::generr("line %d: Label '%s' already exist.", line, conv.c_str());
 
 				// Put label into labels table
 				labels.emplace(conv, PC);
+				if (isRecording) pendingLabels.push_back(conv);
 
 				// Mark, that current line has a label
 				lineHasLabelDecl = true;
@@ -622,6 +707,11 @@ namespace m16 {
 
 				bool isLegitOpcode = false; // This var is used to show if identifier is really an opcode
 
+				const char* opcodeStart = start;
+				word opcodeAddress = PC;
+				int opcodeLine = line;
+				if (isRecording) lastReference.clear();
+
 				// Wind up the scanning thing!
 				switch (start[0]) {
 				case '.': // If first letter is '.', it is, in fact, a pseudo_op
@@ -690,7 +780,7 @@ namespace m16 {
 					}
 					break;
 				case 'h':
-					if (checkRest(1, 2, "lt")) {
+					if (checkRest(1, 2, "lt") || checkRest(1, 3, "alt")) {
 						isLegitOpcode = true;
 						emitWord(0xF025);
 					}
@@ -708,22 +798,22 @@ namespace m16 {
 					if (current - start > 1) {
 						switch (start[1]) {
 						case 'd':
-							if (checkRest(1, 1, "r")) {
+							if (checkRest(2, 1, "r")) {
 								isLegitOpcode = true;
 								RRBtypeOp(0b0110, line);
-							} else if (checkRest(1, 1, "b")) {
+							} else if (checkRest(2, 1, "b")) {
 								isLegitOpcode = true;
 								RRBtypeOp(0b0010, line);
 							}
 							break;
 						case 'e':
-							if (checkRest(1, 1, "a")) {
+							if (checkRest(2, 1, "a")) {
 								isLegitOpcode = true;
 								leaOp(line);
 							}
 							break;
 						case 's':
-							if (checkRest(1, 2, "hf")) {
+							if (checkRest(2, 2, "hf")) {
 								isLegitOpcode = true;
 								shiftOp(true, false, line);
 							}
@@ -735,13 +825,13 @@ namespace m16 {
 					if (current - start > 1) {
 						switch (start[1]) {
 						case 'u':
-							if (checkRest(1, 1, "l")) {
+							if (checkRest(2, 1, "l")) {
 								isLegitOpcode = true;
 								RRIRtypeOp(0b1010, line);
 							}
 							break;
 						case 'o':
-							if (checkRest(1, 2, "d")) {
+							if (checkRest(2, 1, "d")) {
 								isLegitOpcode = true;
 								divModOp(false, line);
 							}
@@ -810,18 +900,105 @@ namespace m16 {
 				}
 
 				// Bonk programmer, if he wrote some shit, not the real opcode
-				if (!isLegitOpcode) throw micrasm_error::generr("line %d: Unknown opcode '%s'.", line, std::string(start, current - start));
+				if (!isLegitOpcode) throw micrasm_error::generr("line %d: Unknown opcode '%.*s'.", line, (int)(current - start), start);
+
+				// .orig only moves PC
+				if (PC != opcodeAddress && !(opcodeStart[0] == '.' && opcodeStart[1] == 'o')) {
+					sourceLocation at = locate(opcodeLine);
+					debug.addLine(opcodeAddress, PC - opcodeAddress, at.file, at.line);
+				}
+
+				if (isRecording) {
+					sourceStatement s;
+					s.labels.swap(pendingLabels);
+					s.text.assign(opcodeStart, current);
+					s.address = opcodeAddress;
+					s.end = PC;
+					s.line = opcodeLine;
+					s.reference = lastReference;
+					s.referenceBits = lastReferenceBits;
+					s.isDirective = opcodeStart[0] == '.';
+
+					statements.push_back(std::move(s));
+				}
 			}
 
 			// After scanning everything needed, to the next line;
 			skipComment();
+		} catch (micrasm_error& e) {
+			isStopped = !report(line, e.what());
+			panicMode = true;
 		}
 
-		// Finalize code: patch labels.
-		codeFinalize();
+		// Labels at the end of source
+		if (isRecording && !pendingLabels.empty()) {
+			sourceStatement s;
+			s.labels.swap(pendingLabels);
+			s.address = s.end = PC;
+			s.line = line;
+			s.isDirective = true;
+
+			statements.push_back(std::move(s));
+		}
+
+		// Finalize code: patch labels. Unresolved labels after the limit would be noise
+		if (!isStopped) codeFinalize();
+
+		debug.setLabels(labels);
+		debug.sortLines();
+
+		if (isRecording) {
+			for (sourceStatement& s : statements) {
+				if (!s.isDirective) s.inst = readWord(s.address);
+			}
+		}
+	}
+
+	void micrasm::assemble(const char* source, const profile& counts) {
+		statements.clear();
+		pendingLabels.clear();
+		layout = layoutStats();
+		diagnostics.clear();
+
+		if (!preprocess(source)) return;
+
+		isRecording = true;
+
+		try {
+			assembleText(lineMap.empty() ? source : expanded.c_str());
+		} catch (...) {
+			isRecording = false;
+			throw;
+		}
+
+		isRecording = false;
+
+		// Nothing to lay out, if there are errors
+		if (!diagnostics.empty()) {
+			statements.clear();
+			return;
+		}
+
+		blockLayout blocks(statements, counts);
+		layout = blocks.getStats();
+		statements.clear();
+
+		if (layout.laidOut == 0) return;
+
+		// Lines of the generated source go back to the original ones
+		std::vector<sourceLocation> expandedLines;
+		expandedLines.swap(lineMap);
+
+		for (int l : blocks.getLines()) lineMap.push_back(expandedLines.empty() ? sourceLocation{ 0, l } : expandedLines[l]);
+
+		assembleText(blocks.getSource().c_str());
 	}
 
 	byte* micrasm::getCode() {
 		return code;
 	}
+
+	const std::unordered_map<std::string, word>& micrasm::getLabels() {
+		return labels;
+	}
 }
\ No newline at end of file
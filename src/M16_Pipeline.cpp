@@ -0,0 +1,314 @@
+#include "include/M16_Pipeline.h"
+
+namespace m16 {
+	// Cold pipeline: results of 'nobody' are in register file, the first instruction enters EX at cycle 5.
+	// So N instructions without stalls take N + 4 cycles, and cycles are the EX cycle of the last instruction
+	constexpr uint64_t START_EX = 4;
+
+	const char* stallName(stall s) {
+		switch (s) {
+		case stall::data: return "data";
+		case stall::loadUse: return "load-use";
+		case stall::flags: return "flags";
+		case stall::execute: return "execute";
+		case stall::control: return "control";
+		case stall::mispredict: return "mispredict";
+		case stall::exception: return "exception";
+		case stall::fetch: return "fetch";
+		case stall::memory: return "memory";
+		}
+
+		return "unknown";
+	}
+
+	pipeline::pipeline(const pipelineConfig& config) : config(config) {
+		reset();
+	}
+
+	void pipeline::reset() {
+		for (result& r : registers) r = result();
+		flags = result();
+
+		history.assign((size_t)1 << config.predictorBits, 1);
+
+		lastEx = START_EX;
+		nextEx = 0;
+		nextCause = stall::control;
+		expectedPc = 0;
+
+		counters = stats();
+	}
+
+	bool pipeline::waitFor(const result& r, uint64_t& ex, int early) const {
+		uint64_t need = ex + early;
+		uint64_t fromFile = r.cycle + (r.isLoad ? 2 : 3);		// WB writes in the first half of cycle, ID reads in the second
+
+		while (need < fromFile) {
+			if (!r.isLoad && config.exForwarding && need == r.cycle + 1) break;
+			if (config.memForwarding && need == r.cycle + (r.isLoad ? 1 : 2)) break;
+
+			need++;
+		}
+
+		if (need - early == ex) return false;
+
+		ex = need - early;
+		return true;
+	}
+
+	void pipeline::countForward(const result& r, uint64_t ex, int early) {
+		uint64_t need = ex + early;
+
+		if (need >= r.cycle + (r.isLoad ? 2 : 3)) return;
+
+		if (!r.isLoad && need == r.cycle + 1) counters.exForwards++;
+		else counters.memForwards++;
+	}
+
+	void pipeline::delayNext(uint64_t cycle, stall cause) {
+		if (cycle <= nextEx) return;
+
+		nextEx = cycle;
+		nextCause = cause;
+	}
+
+	bool pipeline::predict(word pc, int16_t offset) const {
+		switch (config.prediction) {
+		case predictor::notTaken: return false;
+		case predictor::backwardTaken: return offset < 0;
+		case predictor::twoBit: return history[(pc >> 1) & (history.size() - 1)] >= 2;
+		}
+
+		return false;
+	}
+
+	void pipeline::train(word pc, bool isTaken) {
+		if (config.prediction != predictor::twoBit) return;
+
+		byte& counter = history[(pc >> 1) & (history.size() - 1)];
+
+		if (isTaken && counter < 3) counter++;
+		else if (!isTaken && counter > 0) counter--;
+	}
+
+	void pipeline::retire(word pc, const decoded& inst, word nextPc, word psr, int fetchStall, int memoryStall) {
+		// Interrupt between instructions: fetch restarts at the handler
+		if (counters.instructions != 0 && pc != expectedPc) delayNext(lastEx + 3, stall::exception);
+
+		counters.instructions++;
+
+		// Fetch could be redirected by the previous instruction, then it can miss the cache
+		uint64_t ex = lastEx + 1;
+
+		if (nextEx > ex) {
+			counters.stalls[(int)nextCause] += nextEx - ex;
+			ex = nextEx;
+		}
+
+		if (fetchStall != 0) {
+			counters.stalls[(int)stall::fetch] += fetchStall;
+			ex += fetchStall;
+		}
+
+		// Operands: register or flags, and how many cycles after EX they are needed
+		const result* sources[3];
+		int early[3];
+		int count = 0;
+
+		auto use = [&](const result& r, int cycles) {
+			sources[count] = &r;
+			early[count] = cycles;
+			count++;
+		};
+
+		bool isControl = false;
+
+		switch (inst.op) {
+		case opcode::BR:
+			isControl = true;
+			if ((inst.reg1 & 7) != 0 && (inst.reg1 & 7) != 7) use(flags, 0);
+			break;
+		case opcode::ADD:
+		case opcode::AND:
+		case opcode::MUL:
+			use(registers[inst.reg2], 0);
+			if (!inst.isImm) use(registers[inst.reg3], 0);
+			break;
+		case opcode::DIV:
+		case opcode::MOD:
+			use(registers[inst.reg2], 0);
+			use(registers[inst.reg3], 0);
+			break;
+		case opcode::LDB:
+		case opcode::LDR:
+		case opcode::NOT:
+		case opcode::LSHF:
+		case opcode::RSHF:
+		case opcode::ARSHF:
+			use(registers[inst.reg2], 0);
+			break;
+		case opcode::STB:
+		case opcode::STR:
+			use(registers[inst.reg2], 0);
+			use(registers[inst.reg1], 1);
+			break;
+		case opcode::JSRR:
+		case opcode::JMP:
+			isControl = true;
+			use(registers[inst.reg2], 0);
+			break;
+		case opcode::RTI:
+			isControl = true;
+			use(registers[6], 0);
+			break;
+		case opcode::TRAP:
+			// Services take R0 - R2
+			isControl = true;
+			use(registers[0], 0);
+			use(registers[1], 0);
+			use(registers[2], 0);
+			break;
+		case opcode::JSR:
+			isControl = true;
+			break;
+		case opcode::LEA:
+		case opcode::STALE:
+			break;
+		}
+
+		// Waiting for one operand can miss forwarding window of another, so until all of them are there at once
+		for (bool isWaiting = true; isWaiting;) {
+			isWaiting = false;
+
+			for (int i = 0; i < count; i++) {
+				uint64_t before = ex;
+				if (!waitFor(*sources[i], ex, early[i])) continue;
+
+				stall cause = sources[i] == &flags ? stall::flags : sources[i]->isLoad ? stall::loadUse : stall::data;
+				counters.stalls[(int)cause] += ex - before;
+				isWaiting = true;
+			}
+		}
+
+		for (int i = 0; i < count; i++) countForward(*sources[i], ex, early[i]);
+
+		lastEx = ex;
+		counters.cycles = ex;
+		nextEx = 0;
+
+		// Results and fetch of the next instruction
+		uint64_t loaded = ex + 1 + memoryStall;
+		if (memoryStall != 0) delayNext(loaded, stall::memory);
+
+		switch (inst.op) {
+		case opcode::BR: {
+			byte mask = inst.reg1 & 7;
+			if (mask == 0) break;
+
+			// Unconditional branch is redirected by ID
+			if (mask == 7) {
+				delayNext(ex + 2, stall::control);
+				break;
+			}
+
+			bool isTaken = (mask & psr) != 0;
+			bool isPredictedTaken = predict(pc, inst.imm);
+			train(pc, isTaken);
+
+			counters.branches++;
+
+			if (isTaken != isPredictedTaken) {
+				counters.mispredictions++;
+				delayNext(ex + 3, stall::mispredict);
+			} else if (isTaken) {
+				delayNext(ex + 2, stall::control);
+			}
+			break;
+		}
+		case opcode::ADD:
+		case opcode::AND:
+		case opcode::NOT:
+		case opcode::LSHF:
+		case opcode::RSHF:
+		case opcode::ARSHF:
+		case opcode::LEA:
+			registers[inst.reg1] = { ex, false };
+			flags = { ex, false };
+			break;
+		case opcode::MUL:
+		case opcode::DIV:
+		case opcode::MOD: {
+			uint64_t done = ex + (inst.op == opcode::MUL ? config.mulLatency : config.divLatency) - 1;
+
+			registers[inst.reg1] = { done, false };
+			flags = { done, false };
+			delayNext(done + 1, stall::execute);
+			break;
+		}
+		case opcode::LDB:
+		case opcode::LDR:
+			registers[inst.reg1] = { loaded, true };
+			flags = { loaded, true };
+			break;
+		case opcode::JSR:
+			registers[7] = { ex, false };
+			delayNext(ex + 2, stall::control);
+			break;
+		case opcode::JSRR:
+			registers[7] = { ex, false };
+			delayNext(ex + 3, stall::control);
+			break;
+		case opcode::JMP:
+			delayNext(ex + 3, stall::control);
+			break;
+		case opcode::RTI:
+			// PC and PSR are popped in MEM
+			registers[6] = { loaded, true };
+			flags = { loaded, true };
+			delayNext(ex + 3, stall::control);
+			break;
+		case opcode::TRAP:
+			registers[0] = { ex, false };
+			registers[7] = { ex, false };
+			flags = { ex, false };
+			delayNext(ex + 3, stall::control);
+			break;
+		case opcode::STB:
+		case opcode::STR:
+		case opcode::STALE:
+			break;
+		}
+
+		// Exception raised by the instruction flushes everything after it
+		if (!isControl && nextPc != (word)(pc + 2)) delayNext(ex + 3, stall::exception);
+
+		expectedPc = nextPc;
+	}
+
+	void pipeline::report(FILE* out) const {
+		const stats& s = counters;
+		double n = s.instructions == 0 ? 1 : (double)s.instructions;
+
+		static const char* PREDICTORS[] = { "not taken", "backward taken", "2-bit" };
+
+		fprintf(out, "*** <Pipeline report>\n");
+		fprintf(out, "Instructions: %llu, cycles: %llu, CPI: %.3f\n", (unsigned long long)s.instructions, (unsigned long long)s.cycles, s.cpi());
+
+		fprintf(out, "  %-12s %.3f\n", "base", s.instructions == 0 ? 0.0 : 1.0);
+		fprintf(out, "  %-12s %.3f\n", "fill", s.instructions == 0 ? 0.0 : START_EX / n);
+
+		for (int c = 0; c < STALL_COUNT; c++) {
+			fprintf(out, "  %-12s %.3f  (%llu cycles)\n", stallName((stall)c), s.stalls[c] / n, (unsigned long long)s.stalls[c]);
+		}
+
+		fprintf(out, "Forwarding: EX/MEM -> EX %s, %llu operands; MEM/WB -> EX %s, %llu operands\n",
+			config.exForwarding ? "on" : "off", (unsigned long long)s.exForwards,
+			config.memForwarding ? "on" : "off", (unsigned long long)s.memForwards);
+
+		fprintf(out, "Branches: %llu conditional, %llu mispredicted (%.2f%%), predictor: %s\n",
+			(unsigned long long)s.branches, (unsigned long long)s.mispredictions,
+			s.branches == 0 ? 0.0 : 100.0 * s.mispredictions / s.branches, PREDICTORS[(int)config.prediction]);
+
+		fprintf(out, "***\n");
+	}
+}
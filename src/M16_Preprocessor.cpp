@@ -0,0 +1,543 @@
+#include <cstdarg>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "include/M16_MicrAsm.h"
+#include "include/M16_Preprocessor.h"
+
+namespace m16 {
+	static bool isIdentStart(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == '.';
+	}
+
+	static bool isIdentChar(char c) {
+		return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (c >= '0' && c <= '9');
+	}
+
+	static bool isDigit(char c) {
+		return c >= '0' && c <= '9';
+	}
+
+	std::vector<tokenLine> tokenize(const char* text, size_t size) {
+		std::vector<tokenLine> result;
+		tokenLine current{ 1, {} };
+
+		const char* end = text + size;
+		const char* p = text;
+		bool isSpaced = false;
+
+		while (p < end) {
+			char c = *p;
+
+			if (c == '\n') {
+				if (!current.tokens.empty()) result.push_back(std::move(current));
+
+				current = { current.line + 1, {} };
+				isSpaced = false;
+				p++;
+				continue;
+			}
+
+			if (c == ' ' || c == '\t' || c == '\r') {
+				isSpaced = true;
+				p++;
+				continue;
+			}
+
+			if (c == ';') {
+				while (p < end && *p != '\n') p++;
+				continue;
+			}
+
+			const char* start = p;
+			token::kind type;
+
+			if (c == '"') {
+				// Escaped quote does not end the string, as in .strz
+				p++;
+				while (p < end && *p != '"' && *p != '\n') p += *p == '\\' && p + 1 < end && p[1] != '\n' ? 2 : 1;
+				if (p < end && *p == '"') p++;
+
+				type = token::kind::string;
+			} else if (c == '#' && p + 1 < end && (isDigit(p[1]) || (p[1] == '-' && p + 2 < end && isDigit(p[2])))) {
+				p += 2;
+				while (p < end && isIdentChar(*p)) p++;
+
+				type = token::kind::number;
+			} else if (isDigit(c)) {
+				while (p < end && isIdentChar(*p)) p++;
+
+				type = token::kind::number;
+			} else if (isIdentStart(c)) {
+				p++;
+				while (p < end && isIdentChar(*p)) p++;
+
+				type = token::kind::identifier;
+			} else {
+				p++;
+				type = token::kind::punct;
+			}
+
+			current.tokens.push_back({ type, isSpaced, std::string_view(start, p - start) });
+			isSpaced = false;
+		}
+
+		if (!current.tokens.empty()) result.push_back(std::move(current));
+
+		return result;
+	}
+
+	struct sourceCache::file {
+		const char* data = nullptr;
+		size_t size = 0;
+		std::filesystem::file_time_type modified;
+		unsigned pass = 0;
+		std::vector<tokenLine> lines;
+
+#if defined(_WIN32)
+		std::string buffer;
+#else
+		void* mapping = nullptr;
+
+		~file() {
+			if (mapping != nullptr) munmap(mapping, size);
+		}
+#endif
+
+		bool load(const std::string& path) {
+#if defined(_WIN32)
+			FILE* f = fopen(path.c_str(), "rb");
+			if (f == nullptr) return false;
+
+			char buf[4096];
+			size_t bytesRead;
+			while ((bytesRead = fread(buf, 1, sizeof(buf), f)) > 0) buffer.append(buf, bytesRead);
+
+			fclose(f);
+
+			data = buffer.data();
+			size = buffer.size();
+#else
+			int fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0) return false;
+
+			off_t length = lseek(fd, 0, SEEK_END);
+			if (length > 0) mapping = mmap(nullptr, (size_t)length, PROT_READ, MAP_PRIVATE, fd, 0);
+
+			close(fd);
+
+			if (length < 0 || mapping == MAP_FAILED) {
+				mapping = nullptr;
+				return false;
+			}
+
+			data = (const char*)mapping;
+			size = (size_t)length;
+#endif
+
+			lines = tokenize(data, size);
+			return true;
+		}
+	};
+
+	sourceCache::sourceCache() = default;
+	sourceCache::~sourceCache() = default;
+
+	const std::vector<tokenLine>* sourceCache::get(const std::string& path) {
+		std::error_code error;
+		std::filesystem::file_time_type modified = std::filesystem::last_write_time(path, error);
+		if (error) return nullptr;
+
+		auto found = files.find(path);
+
+		if (found != files.end()) {
+			file& f = *found->second;
+
+			// Tokens of the file may be in use in this pass
+			if (f.pass == pass || (f.modified == modified && std::filesystem::file_size(path, error) == f.size && !error)) {
+				f.pass = pass;
+				return &f.lines;
+			}
+		}
+
+		std::unique_ptr<file> f(new file());
+		if (!f->load(path)) return nullptr;
+
+		f->modified = modified;
+		f->pass = pass;
+
+		const std::vector<tokenLine>* lines = &f->lines;
+		files[path] = std::move(f);
+		return lines;
+	}
+
+	void preprocessor::fail(const sourceLocation& at, const char* fmt, ...) const {
+		char buf[512];
+
+		va_list a;
+		va_start(a, fmt);
+		vsnprintf(buf, sizeof(buf), fmt, a);
+		va_end(a);
+
+		errorAt = at;
+		throw micrasm_error(describe(files, at) + ": " + buf);
+	}
+
+	std::string preprocessor::describe(const std::vector<std::string>& files, const sourceLocation& at) {
+		return at.file == 0 ? "line " + std::to_string(at.line) : files[at.file] + ":" + std::to_string(at.line);
+	}
+
+	bool preprocessor::isNeeded(const char* source) {
+		for (const char* p = strchr(source, '.'); p != nullptr; p = strchr(p + 1, '.')) {
+			if (strncmp(p + 1, "include", 7) == 0 || strncmp(p + 1, "macro", 5) == 0 || strncmp(p + 1, "equ", 3) == 0 || strncmp(p + 1, "if", 2) == 0) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	std::string preprocessor::process(const char* source, const std::string& name) {
+		output.clear();
+		lines.assign(1, sourceLocation());
+		files.assign(1, name);
+		includeStack.clear();
+
+		macros.clear();
+		constants.clear();
+		defining = nullptr;
+		conditions.clear();
+
+		names.clear();
+		expansions = 0;
+		processed = 0;
+
+		includes.beginPass();
+
+		processFile(tokenize(source, strlen(source)), 0);
+
+		return output;
+	}
+
+	void preprocessor::processFile(const std::vector<tokenLine>& source, int file) {
+		size_t depth = conditions.size();
+		includeStack.push_back(file);
+
+		for (const tokenLine& l : source) processLine(l.tokens, { file, l.line }, 0);
+
+		if (defining != nullptr) fail(defining->definedAt, "'.macro' without '.endm'");
+		if (conditions.size() != depth) fail(conditions.back().at, "'.if' without '.endif'");
+
+		includeStack.pop_back();
+	}
+
+	void preprocessor::processLine(const std::vector<token>& tokens, const sourceLocation& at, int depth) {
+		if (++processed > MAX_PROCESSED_LINES) fail(at, "Macro expansion is too large.");
+
+		bool hasLabel = tokens.size() >= 2 && tokens[0].type == token::kind::identifier && tokens[1].text == ":";
+		size_t first = hasLabel ? 2 : 0;
+
+		std::string_view directive = first < tokens.size() ? tokens[first].text : std::string_view();
+
+		if (defining != nullptr) {
+			if (directive == ".endm") {
+				defining = nullptr;
+				return;
+			}
+
+			if (directive == ".macro") fail(at, "Macro can't be defined inside macro.");
+
+			if (hasLabel) defining->labels.push_back(tokens[0].text);
+			defining->body.push_back({ at.line, tokens });
+			return;
+		}
+
+		// Conditions nest in skipped lines too
+		if (directive == ".if" || directive == ".ifdef" || directive == ".ifndef") {
+			bool isParentActive = isActive();
+			bool value = isParentActive && evaluate(tokens, first, at);
+
+			conditions.push_back({ value, value, isParentActive, false, at });
+			return;
+		}
+
+		if (directive == ".else") {
+			if (conditions.empty() || conditions.back().hasElse) fail(at, "'.else' without '.if'.");
+
+			condition& c = conditions.back();
+			c.isActive = c.isParentActive && !c.isTaken;
+			c.isTaken = true;
+			c.hasElse = true;
+			return;
+		}
+
+		if (directive == ".endif") {
+			if (conditions.empty()) fail(at, "'.endif' without '.if'.");
+
+			conditions.pop_back();
+			return;
+		}
+
+		if (!isActive()) return;
+
+		if (directive == ".macro") {
+			define(tokens, first + 1, at);
+			return;
+		}
+
+		if (directive == ".endm") fail(at, "'.endm' without '.macro'.");
+
+		if (directive == ".include") {
+			if (first + 1 >= tokens.size() || tokens[first + 1].type != token::kind::string) fail(at, "'\"' expected after '.include'.");
+
+			include(tokens[first + 1], at);
+			return;
+		}
+
+		if (directive == ".equ") {
+			if (first + 2 >= tokens.size() || tokens[first + 1].type != token::kind::identifier) fail(at, "'.equ' expects a name and a value.");
+
+			constants[tokens[first + 1].text] = substitute(tokens, first + 2);
+			return;
+		}
+
+		std::vector<token> line = constants.empty() ? tokens : substitute(tokens, 0);
+
+		// Declared label is not replaced
+		if (hasLabel) line[0] = tokens[0];
+
+		if (first < line.size() && line[first].type == token::kind::identifier) {
+			auto found = macros.find(line[first].text);
+
+			if (found != macros.end()) {
+				if (hasLabel) emit(line, 0, 2, at);
+
+				expand(found->second, line, first + 1, at, depth);
+				return;
+			}
+		}
+
+		emit(line, 0, line.size(), at);
+	}
+
+	void preprocessor::include(const token& name, const sourceLocation& at) {
+		if ((int)includeStack.size() >= MAX_INCLUDE_DEPTH) fail(at, "Includes are nested too deep.");
+
+		std::string_view quoted = name.text;
+		if (quoted.size() < 2 || quoted.back() != '"') fail(at, "Unterminated string in '.include'.");
+
+		std::filesystem::path relative(std::string(quoted.substr(1, quoted.size() - 2)));
+
+		// Directory of the including file, then include paths
+		std::vector<std::filesystem::path> candidates;
+		candidates.push_back(std::filesystem::path(files[at.file]).parent_path() / relative);
+		for (const std::string& dir : includePaths) candidates.push_back(std::filesystem::path(dir) / relative);
+
+		for (const std::filesystem::path& candidate : candidates) {
+			std::string path = candidate.lexically_normal().string();
+
+			const std::vector<tokenLine>* source = includes.get(path);
+			if (source == nullptr) continue;
+
+			for (int open : includeStack) {
+				if (files[open] == path) fail(at, "'%s' includes itself.", path.c_str());
+			}
+
+			files.push_back(path);
+			processFile(*source, (int)files.size() - 1);
+			return;
+		}
+
+		fail(at, "Can't open include file '%s'.", relative.string().c_str());
+	}
+
+	void preprocessor::define(const std::vector<token>& tokens, size_t first, const sourceLocation& at) {
+		if (first >= tokens.size() || tokens[first].type != token::kind::identifier) fail(at, "Macro name expected after '.macro'.");
+
+		std::string_view name = tokens[first].text;
+		if (macros.contains(name)) fail(at, "Macro '%.*s' already exist.", (int)name.size(), name.data());
+
+		macro m;
+		m.definedAt = at;
+
+		for (size_t i = first + 1; i < tokens.size(); i++) {
+			if (tokens[i].type != token::kind::identifier) fail(at, "Parameter name expected in '.macro'.");
+
+			m.params.push_back(tokens[i].text);
+
+			if (i + 1 < tokens.size() && tokens[++i].text != ",") fail(at, "',' expected between parameters of '.macro'.");
+		}
+
+		defining = &(macros[name] = std::move(m));
+	}
+
+	void preprocessor::expand(const macro& m, const std::vector<token>& tokens, size_t first, const sourceLocation& at, int depth) {
+		if (depth >= MAX_MACRO_DEPTH) fail(at, "Macros are nested too deep.");
+
+		// Arguments are separated by ','
+		std::vector<std::vector<token>> args;
+		if (first < tokens.size()) args.emplace_back();
+
+		for (size_t i = first; i < tokens.size(); i++) {
+			if (tokens[i].text == ",") args.emplace_back();
+			else args.back().push_back(tokens[i]);
+		}
+
+		if (args.size() != m.params.size()) {
+			fail(at, "Macro '%.*s' receives %d arguments, got %d.", (int)tokens[first - 1].text.size(), tokens[first - 1].text.data(),
+				(int)m.params.size(), (int)args.size());
+		}
+
+		// Labels of this expansion
+		std::vector<std::string_view> labels;
+		expansions++;
+
+		for (std::string_view l : m.labels) {
+			names.push_back(std::string(l) + "__" + std::to_string(expansions));
+			labels.push_back(names.back());
+		}
+
+		std::vector<token> line;
+
+		for (const tokenLine& l : m.body) {
+			line.clear();
+
+			for (const token& t : l.tokens) {
+				if (t.type != token::kind::identifier) {
+					line.push_back(t);
+					continue;
+				}
+
+				bool isReplaced = false;
+
+				for (size_t p = 0; p < m.params.size() && !isReplaced; p++) {
+					if (t.text != m.params[p]) continue;
+
+					for (size_t k = 0; k < args[p].size(); k++) {
+						line.push_back(args[p][k]);
+						if (k == 0) line.back().isSpaced = t.isSpaced;
+					}
+
+					isReplaced = true;
+				}
+
+				for (size_t k = 0; k < labels.size() && !isReplaced; k++) {
+					if (t.text != m.labels[k]) continue;
+
+					line.push_back({ t.type, t.isSpaced, labels[k] });
+					isReplaced = true;
+				}
+
+				if (!isReplaced) line.push_back(t);
+			}
+
+			processLine(line, at, depth + 1);
+		}
+	}
+
+	std::vector<token> preprocessor::substitute(const std::vector<token>& tokens, size_t first) const {
+		std::vector<token> result;
+
+		for (size_t i = first; i < tokens.size(); i++) {
+			const token& t = tokens[i];
+			auto found = t.type == token::kind::identifier ? constants.find(t.text) : constants.end();
+
+			if (found == constants.end()) {
+				result.push_back(t);
+				continue;
+			}
+
+			for (size_t k = 0; k < found->second.size(); k++) {
+				result.push_back(found->second[k]);
+				if (k == 0) result.back().isSpaced = t.isSpaced;
+			}
+		}
+
+		return result;
+	}
+
+	bool preprocessor::evaluate(const std::vector<token>& tokens, size_t first, const sourceLocation& at) const {
+		std::string_view directive = tokens[first].text;
+
+		if (directive != ".if") {
+			if (first + 1 >= tokens.size() || tokens[first + 1].type != token::kind::identifier) fail(at, "Name expected after '%.*s'.", (int)directive.size(), directive.data());
+
+			std::string_view name = tokens[first + 1].text;
+			bool isDefined = constants.contains(name) || macros.contains(name);
+
+			return directive == ".ifdef" ? isDefined : !isDefined;
+		}
+
+		std::vector<token> expr = substitute(tokens, first + 1);
+		if (expr.empty()) fail(at, "Value expected after '.if'.");
+
+		// value [op value], op is one or two characters
+		size_t i = 0;
+		auto next = [&]() {
+			bool isNegative = expr[i].text == "-" && i + 1 < expr.size();
+			if (isNegative) i++;
+
+			int value = valueOf(expr[i++], at);
+			return isNegative ? -value : value;
+		};
+
+		int left = next();
+		if (i == expr.size()) return left != 0;
+
+		std::string op(expr[i++].text);
+		if (i < expr.size() && expr[i].text == "=" && !expr[i].isSpaced) op += expr[i++].text;
+
+		if (i == expr.size()) fail(at, "Value expected after '%s'.", op.c_str());
+
+		int right = next();
+		if (i != expr.size()) fail(at, "Unexpected '%.*s' in '.if'.", (int)expr[i].text.size(), expr[i].text.data());
+
+		if (op == "==") return left == right;
+		if (op == "!=") return left != right;
+		if (op == "<") return left < right;
+		if (op == "<=") return left <= right;
+		if (op == ">") return left > right;
+		if (op == ">=") return left >= right;
+
+		fail(at, "Unknown operator '%s' in '.if'.", op.c_str());
+	}
+
+	int preprocessor::valueOf(const token& t, const sourceLocation& at) const {
+		// Numbers as micrasm writes them: #10, x1f, b101, o17, and plain decimal
+		std::string text(t.text);
+		const char* digits = text.c_str();
+		int base = 10;
+
+		if (t.type == token::kind::number && text[0] == '#') digits++;
+		else if (t.type == token::kind::identifier && text.size() > 1) {
+			base = text[0] == 'x' ? 16 : text[0] == 'b' ? 2 : text[0] == 'o' ? 8 : 0;
+			digits++;
+		} else if (t.type != token::kind::number) base = 0;
+
+		char* end = nullptr;
+		long long value = base != 0 ? strtoll(digits, &end, base) : 0;
+
+		if (base == 0 || *digits == '\0' || *end != '\0') fail(at, "'%s' is neither a number nor a constant.", text.c_str());
+
+		// Signed or unsigned word, so negating it can't overflow
+		if (value < INT16_MIN || value > UINT16_MAX) fail(at, "Number '%s' exceeds 16-bit range.", text.c_str());
+
+		return (int)value;
+	}
+
+	void preprocessor::emit(const std::vector<token>& tokens, size_t first, size_t last, const sourceLocation& at) {
+		for (size_t i = first; i < last; i++) {
+			if (i > first && tokens[i].isSpaced) output += ' ';
+			output.append(tokens[i].text);
+		}
+
+		output += '\n';
+		lines.push_back(at);
+
+		if (output.size() > MAX_OUTPUT_SIZE) fail(at, "Macro expansion is too large.");
+	}
+}
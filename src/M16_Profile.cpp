@@ -0,0 +1,156 @@
+#include <algorithm>
+
+#include "include/M16_Profile.h"
+#include "include/M16_DebugInfo.h"
+
+namespace m16 {
+	profile::profile() {
+		reset();
+	}
+
+	void profile::reset() {
+		executions.assign(MAX_MEM_SIZE / 2, 0);
+		takenCounts.assign(MAX_MEM_SIZE / 2, 0);
+		notTakenCounts.assign(MAX_MEM_SIZE / 2, 0);
+		mispredictions.assign(MAX_MEM_SIZE / 2, 0);
+
+		// Weakly not taken, as in pipeline model
+		history.assign(MAX_MEM_SIZE / 2, 1);
+	}
+
+	std::vector<profile::branchSite> profile::getBranches() const {
+		std::vector<branchSite> sites;
+
+		for (int i = 0; i < MAX_MEM_SIZE / 2; i++) {
+			if (takenCounts[i] == 0 && notTakenCounts[i] == 0) continue;
+
+			branchSite site;
+			site.address = (word)(i << 1);
+			site.taken = takenCounts[i];
+			site.notTaken = notTakenCounts[i];
+			site.mispredictions = mispredictions[i];
+
+			sites.push_back(site);
+		}
+
+		return sites;
+	}
+
+	static double percent(uint64_t part, uint64_t total) {
+		return total == 0 ? 0 : 100.0 * part / total;
+	}
+
+	// "label+offset" or "-"
+	static std::string locate(const disasm& dis, word address) {
+		int offset;
+		const char* label = dis.labelOf(address, offset);
+
+		if (label == nullptr) return "-";
+
+		return offset == 0 ? std::string(label) : std::string(label) + "+" + std::to_string(offset);
+	}
+
+	void profile::report(FILE* out, cpu& vm, const std::unordered_map<std::string, word>& labels, int count, const debugInfo* lines) const {
+		disasm dis(labels);
+		std::vector<branchSite> sites = getBranches();
+
+		uint64_t total = 0;
+		uint64_t taken = 0;
+		uint64_t backwardHits = 0;
+		uint64_t biasHits = 0;
+		uint64_t dynamicMisses = 0;
+
+		for (const branchSite& s : sites) {
+			bool isBackward = disasm::decode(vm.readWord(s.address)).imm < 0;
+
+			total += s.executions();
+			taken += s.taken;
+			backwardHits += isBackward ? s.taken : s.notTaken;
+			biasHits += s.taken > s.notTaken ? s.taken : s.notTaken;
+			dynamicMisses += s.mispredictions;
+		}
+
+		fprintf(out, "*** <Branch report>\n");
+		fprintf(out, "Conditional branches: %llu executed at %d sites, %llu taken (%.2f%%)\n",
+			(unsigned long long)total, (int)sites.size(), (unsigned long long)taken, percent(taken, total));
+		fprintf(out, "Prediction accuracy: not taken %.2f%%, backward taken %.2f%%, static by bias %.2f%%, 2-bit per site %.2f%%\n",
+			percent(total - taken, total), percent(backwardHits, total), percent(biasHits, total), percent(total - dynamicMisses, total));
+
+		std::sort(sites.begin(), sites.end(), [](const branchSite& a, const branchSite& b) {
+			return a.executions() > b.executions() || (a.executions() == b.executions() && a.address < b.address);
+		});
+
+		if ((int)sites.size() > count) sites.resize(count);
+
+		fprintf(out, "\nHottest branches:\n");
+		fprintf(out, "  address  location             instruction          executions    taken     bias    2-bit%s\n", lines != nullptr ? "  source" : "");
+
+		for (const branchSite& s : sites) {
+			word inst = vm.readWord(s.address);
+
+			// Hot path jumps over cold code: inverted condition would let it fall through
+			bool isReorderable = s.taken > s.notTaken && disasm::decode(inst).imm > 0;
+
+			fprintf(out, "  x%04x    %-20s %-20s %10llu  %6.2f%%  %6.2f%%  %6.2f%%", s.address, locate(dis, s.address).c_str(),
+				dis.format(inst, s.address).c_str(), (unsigned long long)s.executions(),
+				percent(s.taken, s.executions()), 100 * s.bias(), percent(s.executions() - s.mispredictions, s.executions()));
+
+			if (lines != nullptr) fprintf(out, "  %-*s", isReorderable ? 12 : 0, lines->describe(s.address).c_str());
+			fprintf(out, "%s\n", isReorderable ? "  forward, mostly taken" : "");
+		}
+
+		fprintf(out, "***\n");
+	}
+
+	bool profile::save(const char* path, const std::unordered_map<std::string, word>& labels) const {
+		FILE* file = fopen(path, "w");
+		if (file == nullptr) return false;
+
+		disasm dis(labels);
+
+		fprintf(file, "m16-profile 1\n");
+
+		for (int i = 0; i < MAX_MEM_SIZE / 2; i++) {
+			if (executions[i] == 0) continue;
+
+			word address = (word)(i << 1);
+			fprintf(file, "count x%04x %llu ; %s\n", address, (unsigned long long)executions[i], locate(dis, address).c_str());
+		}
+
+		for (const branchSite& s : getBranches()) {
+			fprintf(file, "branch x%04x %llu %llu ; %s\n", s.address, (unsigned long long)s.taken, (unsigned long long)s.notTaken,
+				locate(dis, s.address).c_str());
+		}
+
+		return fclose(file) == 0;
+	}
+
+	bool profile::load(const char* path) {
+		reset();
+
+		FILE* file = fopen(path, "r");
+		if (file == nullptr) return false;
+
+		char line[256];
+		bool isValid = fgets(line, sizeof(line), file) != nullptr && strncmp(line, "m16-profile 1", 13) == 0;
+
+		while (isValid && fgets(line, sizeof(line), file) != nullptr) {
+			unsigned address;
+			unsigned long long first, second;
+
+			if (sscanf(line, "count x%x %llu", &address, &first) == 2 && address < MAX_MEM_SIZE) {
+				executions[address >> 1] = first;
+			} else if (sscanf(line, "branch x%x %llu %llu", &address, &first, &second) == 3 && address < MAX_MEM_SIZE) {
+				takenCounts[address >> 1] = first;
+				notTakenCounts[address >> 1] = second;
+			} else if (line[0] != '\n' && line[0] != ';') {
+				isValid = false;
+			}
+		}
+
+		fclose(file);
+
+		if (!isValid) reset();
+		return isValid;
+	}
+}
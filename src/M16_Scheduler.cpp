@@ -0,0 +1,124 @@
+#include <chrono>
+#include <thread>
+
+#include "include/M16_Scheduler.h"
+
+namespace m16 {
+	scheduler::scheduler(int threadCount, uint64_t quantum) : threadCount(threadCount < 1 ? 1 : threadCount), quantum(quantum) {
+		for (int t = 0; t < this->threadCount; t++) queues.emplace_back(new queue());
+	}
+
+	int scheduler::add(cpu* vm, const limits& lim) {
+		instances.push_back({ vm, lim, {} });
+		return (int)instances.size() - 1;
+	}
+
+	int scheduler::take(int thread) {
+		for (int i = 0; i < threadCount; i++) {
+			queue& q = *queues[(thread + i) % threadCount];
+			std::lock_guard<std::mutex> lock(q.lock);
+
+			if (q.ids.empty()) continue;
+
+			int id;
+			if (i == 0) {
+				id = q.ids.front();
+				q.ids.pop_front();
+			} else {
+				id = q.ids.back();
+				q.ids.pop_back();
+			}
+
+			return id;
+		}
+
+		return -1;
+	}
+
+	bool scheduler::runQuantum(instance& inst) {
+		stats& s = inst.accounting;
+
+		// Quantum gets what is left of limits of instance
+		limits slice;
+		slice.instructions = quantum;
+
+		if (inst.lim.instructions != 0 && inst.lim.instructions - s.instructions < quantum) {
+			slice.instructions = inst.lim.instructions - s.instructions;
+		}
+
+		if (inst.lim.cycles != 0) {
+			if (s.cycles >= inst.lim.cycles) {
+				s.state = status::cycleLimit;
+				return false;
+			}
+
+			slice.cycles = inst.lim.cycles - s.cycles;
+		}
+
+		if (inst.lim.seconds > 0) {
+			if (s.seconds >= inst.lim.seconds) {
+				s.state = status::timeLimit;
+				return false;
+			}
+
+			slice.seconds = inst.lim.seconds - s.seconds;
+		}
+
+		uint64_t retired = inst.vm->retired;
+		uint64_t cycles = inst.vm->cycles;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+		status result = inst.vm->run(slice);
+
+		s.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		s.instructions += inst.vm->retired - retired;
+		s.cycles += inst.vm->cycles - cycles;
+		s.quanta++;
+
+		// End of quantum is not end of instance
+		if (result == status::instructionLimit && (inst.lim.instructions == 0 || s.instructions < inst.lim.instructions)) return true;
+
+		s.state = result;
+		return false;
+	}
+
+	void scheduler::worker(int thread) {
+		while (unfinished.load(std::memory_order_acquire) > 0) {
+			int id = take(thread);
+
+			// Others still run their last quanta, they may requeue instances
+			if (id < 0) {
+				std::this_thread::yield();
+				continue;
+			}
+
+			if (runQuantum(instances[id])) {
+				queue& q = *queues[thread];
+				std::lock_guard<std::mutex> lock(q.lock);
+				q.ids.push_back(id);
+			} else {
+				unfinished.fetch_sub(1, std::memory_order_release);
+			}
+		}
+	}
+
+	void scheduler::run() {
+		int count = 0;
+
+		for (int id = 0; id < (int)instances.size(); id++) {
+			if (instances[id].accounting.state != status::running) continue;
+
+			queues[id % threadCount]->ids.push_back(id);
+			count++;
+		}
+
+		unfinished.store(count);
+
+		std::vector<std::thread> threads;
+		for (int t = 1; t < threadCount; t++) threads.emplace_back([this, t] { worker(t); });
+
+		worker(0);
+
+		for (std::thread& t : threads) t.join();
+	}
+}
@@ -11,5 +11,36 @@
 // Asembler "Mikrasm"
 #include "M16_MicrAsm.h"
 
+// Includes, macros, constants and conditional assembly for micrasm
+#include "M16_Preprocessor.h"
+
+// Source lines and labels of assembled images
+#include "M16_DebugInfo.h"
+
+// Disassembler and decoded program cache
+#include "M16_Disasm.h"
+
+// Cache simulation
+#include "M16_Cache.h"
+
+// Timing model of 5-stage pipeline
+#include "M16_Pipeline.h"
+
+// Execution counts and branch statistics
+#include "M16_Profile.h"
+
+// Many copies of one program in lockstep
+#include "M16_Lockstep.h"
+
+// Multiprocessor system with shared memory
+#include "M16_Machine.h"
+
+// Many independent cpu instances on a pool of host threads
+#include "M16_Scheduler.h"
+
+// Compile-time encoder and assembler
+#include "M16_Encoder.h"
+#include "M16_ConstAsm.h"
+
 // PL/T compiler
 // Work in progress
\ No newline at end of file
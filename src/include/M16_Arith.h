@@ -0,0 +1,45 @@
+#pragma once
+
+#include "M16_Common.h"
+
+namespace m16 {
+	// Arithmetic core with exact 16-bit semantics, shared by every engine.
+	// Division by zero is not handled here: engines check the divisor and raise guest exception.
+	namespace arith {
+		constexpr word mul(word a, word b) {
+			// Promote to unsigned, word * word overflows signed int
+			return (word)((uint32_t)a * b);
+		}
+
+		constexpr word div(word a, word b) { return a / b; }
+		constexpr word mod(word a, word b) { return a % b; }
+
+		// Division by invariant divisor through multiplication by reciprocal.
+		// With m = ceil(2^32 / d), (a * m) >> 32 == a / d for every 16-bit a and d,
+		// because the error of m stays below 2^32 / (a * d).
+		class divider {
+		private:
+			uint64_t magic = 0;
+			word divisor = 0;
+
+		public:
+			constexpr divider() = default;
+
+			constexpr divider(word d) : magic((((uint64_t)1 << 32) + d - 1) / d), divisor(d) {}
+
+			constexpr word getDivisor() const { return divisor; }
+
+			constexpr word div(word a) const {
+				return (word)((a * magic) >> 32);
+			}
+
+			constexpr word mod(word a) const {
+				return a - div(a) * divisor;
+			}
+		};
+
+		static_assert(divider(7).div(65535) == 65535 / 7);
+		static_assert(divider(1).div(65535) == 65535);
+		static_assert(divider(65535).mod(65534) == 65534);
+	}
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+// Stable C interface of libm16 for embedding VMs into other programs.
+// Handles are opaque, enums have fixed values and no C++ exception leaves these functions.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Exported from shared libm16. CMake defines M16_SHARED for clients of the shared library and M16_BUILDING for itself
+#if defined(_WIN32) && defined(M16_SHARED)
+#ifdef M16_BUILDING
+#define M16_API __declspec(dllexport)
+#else
+#define M16_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define M16_API __attribute__((visibility("default")))
+#else
+#define M16_API
+#endif
+
+// Incremented, when functions are added. Existing ones keep their behavior
+#define M16_API_VERSION 9
+
+typedef struct m16_vm m16_vm;
+
+// Same order as m16::status
+typedef enum m16_status {
+	M16_RUNNING = 0,
+	M16_HALTED = 1,
+	M16_INSTRUCTION_LIMIT = 2,
+	M16_CYCLE_LIMIT = 3,
+	M16_TIME_LIMIT = 4,
+	M16_UNALIGNED_ACCESS = 5,
+	M16_DIVIDE_BY_ZERO = 6,
+	M16_PRIVILEGE_VIOLATION = 7,
+	M16_ILLEGAL_OPCODE = 8,
+} m16_status;
+
+typedef enum m16_register {
+	M16_R0 = 0,
+	M16_R1 = 1,
+	M16_R2 = 2,
+	M16_R3 = 3,
+	M16_R4 = 4,
+	M16_R5 = 5,
+	M16_R6 = 6,
+	M16_R7 = 7,
+	M16_PC = 8,
+	M16_PSR = 9,
+} m16_register;
+
+// Called for TRAP 'vector' instead of the built-in service or the guest handler
+typedef void (*m16_trap_fn)(m16_vm* vm, uint8_t vector, void* user);
+
+// Receives text printed by debug trap x10
+typedef void (*m16_output_fn)(const char* text, size_t size, void* user);
+
+// Receives an assembler error. 'message' starts with "line N: " for the source itself and with "<path>:N: "
+// for a file it includes, 'line' is N in either case
+typedef void (*m16_diagnostic_fn)(int line, const char* message, void* user);
+
+typedef enum m16_write_policy {
+	M16_WRITE_BACK = 0,
+	M16_WRITE_THROUGH = 1,
+} m16_write_policy;
+
+// Size, line size and associativity are powers of two
+typedef struct m16_cache_config {
+	uint32_t size;
+	uint32_t ways;
+	uint32_t line_size;
+	m16_write_policy policy;
+} m16_cache_config;
+
+typedef enum m16_cache_level {
+	M16_L1I = 0,
+	M16_L1D = 1,
+	M16_L2 = 2,
+} m16_cache_level;
+
+typedef struct m16_cache_stats {
+	uint64_t accesses;
+	uint64_t misses;
+	uint64_t write_backs;
+} m16_cache_stats;
+
+typedef enum m16_predictor {
+	M16_PREDICT_NOT_TAKEN = 0,
+	M16_PREDICT_BACKWARD_TAKEN = 1,
+	M16_PREDICT_TWO_BIT = 2,
+} m16_predictor;
+
+// Same order as m16::stall
+typedef enum m16_stall {
+	M16_STALL_DATA = 0,
+	M16_STALL_LOAD_USE = 1,
+	M16_STALL_FLAGS = 2,
+	M16_STALL_EXECUTE = 3,
+	M16_STALL_CONTROL = 4,
+	M16_STALL_MISPREDICT = 5,
+	M16_STALL_EXCEPTION = 6,
+	M16_STALL_FETCH = 7,
+	M16_STALL_MEMORY = 8,
+	M16_STALL_COUNT = 9,
+} m16_stall;
+
+typedef struct m16_pipeline_stats {
+	uint64_t instructions;
+	uint64_t cycles;
+	uint64_t stalls[M16_STALL_COUNT];
+	uint64_t branches;
+	uint64_t mispredictions;
+} m16_pipeline_stats;
+
+// What block layout changed, see m16::layoutStats
+typedef struct m16_layout_stats {
+	int regions;
+	int laid_out;
+	int blocks;
+	int moved_blocks;
+	int inverted_branches;
+	int added_branches;
+	int removed_branches;
+} m16_layout_stats;
+
+M16_API int m16_api_version(void);
+
+// Returns NULL, if out of memory
+M16_API m16_vm* m16_create(void);
+M16_API void m16_destroy(m16_vm* vm);
+
+// Image of at most 65536 bytes, the rest of memory is zeroed. Returns 0 on success, nonzero if the image is too large or out of memory.
+// Since version 6 the image may end with a line table, see m16_save_image(). It is decoded on first use
+M16_API int m16_load_image(m16_vm* vm, const uint8_t* image, size_t size);
+
+// Assembles micrasm source and loads it. On error returns nonzero and puts message into 'error', if it is not NULL
+M16_API int m16_assemble(m16_vm* vm, const char* source, char* error, size_t errorSize);
+
+// Decoded engine is faster for programs, which don't write their code. Off by default
+M16_API void m16_use_decoded(m16_vm* vm, int enable);
+
+// Debug traps (x25 halt, x10 print) are on by default
+M16_API void m16_set_debug(m16_vm* vm, int enable);
+
+// Zero means no limit, except for m16_run() where zero budget runs nothing
+M16_API m16_status m16_run(m16_vm* vm, uint64_t budget);
+M16_API m16_status m16_run_limits(m16_vm* vm, uint64_t instructions, uint64_t cycles, double seconds);
+
+M16_API m16_status m16_get_status(m16_vm* vm);
+M16_API const char* m16_status_name(m16_status status);
+
+M16_API uint64_t m16_get_retired(m16_vm* vm);
+M16_API uint64_t m16_get_cycles(m16_vm* vm);
+
+M16_API uint16_t m16_get_register(m16_vm* vm, m16_register reg);
+M16_API void m16_set_register(m16_vm* vm, m16_register reg, uint16_t value);
+
+M16_API uint8_t m16_read_byte(m16_vm* vm, uint16_t address);
+M16_API void m16_write_byte(m16_vm* vm, uint16_t address, uint8_t value);
+
+// Bit 0 of address is ignored
+M16_API uint16_t m16_read_word(m16_vm* vm, uint16_t address);
+M16_API void m16_write_word(m16_vm* vm, uint16_t address, uint16_t value);
+
+// Copies wrap around the end of memory
+M16_API void m16_read_memory(m16_vm* vm, uint16_t address, uint8_t* buffer, size_t size);
+M16_API void m16_write_memory(m16_vm* vm, uint16_t address, const uint8_t* buffer, size_t size);
+
+// Pass NULL function to unbind
+M16_API void m16_bind_trap(m16_vm* vm, uint8_t vector, m16_trap_fn fn, void* user);
+
+// Pass NULL function to print to stdout again. Binds trap x10
+M16_API void m16_set_output(m16_vm* vm, m16_output_fn fn, void* user);
+
+// Since version 2. Runs simulate caches and count cycles of misses, NULL level has no cache.
+// Counters are cleared. Returns nonzero and leaves simulation off, if a configuration is not valid
+M16_API int m16_set_caches(m16_vm* vm, const m16_cache_config* l1i, const m16_cache_config* l1d, const m16_cache_config* l2);
+M16_API void m16_disable_caches(m16_vm* vm);
+
+// Returns nonzero, if caches are not simulated or there is no cache at the level
+M16_API int m16_get_cache_stats(m16_vm* vm, m16_cache_level level, m16_cache_stats* stats);
+
+// Levels, then instructions and labels with the most misses. Labels come from the last m16_assemble()
+M16_API void m16_print_cache_report(m16_vm* vm, FILE* out, int count);
+
+// Since version 3. Runs feed the 5-stage pipeline model, see m16::pipeline. Counters are cleared.
+// Nonzero 'forwarding' enables both forwarding paths. Since version 9 returns nonzero and leaves the model off, if out of memory
+M16_API int m16_set_pipeline(m16_vm* vm, m16_predictor prediction, int forwarding);
+M16_API void m16_disable_pipeline(m16_vm* vm);
+
+// Returns nonzero, if pipeline is not modelled
+M16_API int m16_get_pipeline_stats(m16_vm* vm, m16_pipeline_stats* stats);
+M16_API const char* m16_stall_name(m16_stall stall);
+
+// CPI broken down by stall cause
+M16_API void m16_print_pipeline_report(m16_vm* vm, FILE* out);
+
+// Since version 4. Runs count executed instructions and directions of conditional branches, see m16::profile.
+// Counters are cleared. Returns nonzero, if there is no memory for counters
+M16_API int m16_enable_profile(m16_vm* vm);
+M16_API void m16_disable_profile(m16_vm* vm);
+
+// Writes counts in the text format of m16::profile::save(). Returns nonzero, if profiling is off or the file can't be written
+M16_API int m16_save_profile(m16_vm* vm, const char* path);
+
+// Accuracy of branch predictors, then 'count' hottest branches with their bias
+M16_API void m16_print_branch_report(m16_vm* vm, FILE* out, int count);
+
+// Since version 5. Same as m16_assemble(), but basic blocks are laid out by the profile of this source,
+// written by m16_save_profile(). 'stats' may be NULL
+M16_API int m16_assemble_with_profile(m16_vm* vm, const char* source, const char* profilePath, m16_layout_stats* stats, char* error, size_t errorSize);
+
+// Since version 6. Assembled programs keep source lines of their instructions and data, see m16::debugInfo.
+// File name of lines of next assembled sources, empty by default
+M16_API void m16_set_source_name(m16_vm* vm, const char* name);
+
+// Source line of the byte at 'address'. 'file' stays valid until the next load. Returns nonzero, if there is no line
+M16_API int m16_find_line(m16_vm* vm, uint16_t address, const char** file, int* line);
+
+// Writes memory without trailing zeros, with line table and labels, if 'withDebug' is nonzero and there are lines.
+// Returns nonzero, if the file can't be written
+M16_API int m16_save_image(m16_vm* vm, const char* path, int withDebug);
+
+// Since version 7. Same as m16_assemble(), but assembly goes on after errors, from the next line, and every error
+// goes to 'fn'. Stops after 'maxErrors' errors, 0 for no limit. Returns the number of errors, the program is loaded only without them
+M16_API int m16_assemble_report(m16_vm* vm, const char* source, int maxErrors, m16_diagnostic_fn fn, void* user);
+
+// Since version 8. Sources are preprocessed, see m16::preprocessor. '.include' looks into the directory of
+// the source name, then into these directories. Included files are cached by the VM between assemblies
+M16_API void m16_add_include_path(m16_vm* vm, const char* dir);
+
+#ifdef __cplusplus
+}
+#endif
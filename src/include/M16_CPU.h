@@ -1,6 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <bit>
+#include <functional>
+#include <memory>
+
 #include "M16_Common.h"
+#include "M16_Disasm.h"
+#include "M16_Arith.h"
 
 namespace m16 {
 	word subscr(word val, int start, int end);
@@ -14,9 +21,113 @@ namespace m16 {
 	word signext(word val, int size);
 	word zeroext(byte val_5);
 
+	// Atomic host services for guests on shared memory. Address is in R0, old value is returned in R0
+	constexpr byte TRAP_CAS = 0x26;			// if [R0] == R1 then [R0] = R2
+	constexpr byte TRAP_FETCH_ADD = 0x27;	// [R0] += R1
+
+	// Bank switching: window of BANK_SIZE bytes at BANK_WINDOW shows one of the banks.
+	// Bank 0 is the memory block itself, the others are allocated by cpu::setBankCount()
+	constexpr word BANK_WINDOW = 0x8000;
+	constexpr int BANK_SIZE = 0x4000;
+
+	// Writes bank register: R0 = bank to select, previous bank is returned in R0, or xffff if there is no such bank
+	constexpr byte TRAP_BANK = 0x28;
+
+	// DMA device: block operations on R2 bytes of guest memory. Addresses wrap around the end of memory
+	constexpr byte TRAP_DMA_COPY = 0x29;		// [R0] = [R1], overlapping ranges are copied as by memmove
+	constexpr byte TRAP_DMA_FILL = 0x2a;		// [R0] = low byte of R1
+	constexpr byte TRAP_DMA_COMPARE = 0x2b;		// R0 = 0, 1 or -1 as [R0] is equal, greater or less than [R1]
+
+	// Nominal cost of DMA transfer on top of TRAP
+	constexpr int DMA_BYTES_PER_CYCLE = 8;
+
+	// Exception vectors, handlers are looked up in the same table as interrupts
+	enum class exception : byte {
+		privilegeViolation = 0x00,
+		illegalOpcode = 0x01,
+		divideByZero = 0x02,
+		unalignedAccess = 0x03,
+	};
+
+	// Why cpu stopped, or why run() returned
+	enum class status : byte {
+		running,
+		halted,					// trap x25
+		instructionLimit,
+		cycleLimit,
+		timeLimit,
+		unalignedAccess,		// Faults: unaligned access and unhandled exceptions
+		divideByZero,
+		privilegeViolation,
+		illegalOpcode,
+	};
+
+	const char* statusName(status s);
+
+	inline bool isFault(status s) { return s >= status::unalignedAccess; }
+
+	// Status of cpu, which stopped on exception without handler
+	status statusOf(exception id);
+
+	// Limits of one run() call, zero means no limit.
+	// Cycles and time are checked every LIMIT_CHECK_INTERVAL instructions, so they can be overrun by one interval
+	struct limits {
+		uint64_t instructions = 0;
+		uint64_t cycles = 0;
+		double seconds = 0;
+	};
+
+	constexpr uint64_t LIMIT_CHECK_INTERVAL = 4096;
+
+	class cpu;
+	class memoryHierarchy;
+	class pipeline;
+	class profile;
+
+	// Native routine bound to TRAP vector, see cpu::bindTrap()
+	using hostCall = std::function<void(cpu& vm)>;
+
 	class cpu {
+	public:
+		// Granularity of bank window and host buffer mappings
+		static constexpr int PAGE_BITS = 12;
+		static constexpr int PAGE_SIZE = 1 << PAGE_BITS;
+		static constexpr int PAGE_COUNT = MAX_MEM_SIZE >> PAGE_BITS;
+
 	private:
-		byte memory[MAX_MEM_SIZE] = { 0 };
+		// Own memory of standalone cpu, or memory shared by cores of one machine
+		byte* memory;
+		bool ownsMemory;		// Otherwise other cores access memory concurrently
+
+		// Every access goes through page table, so switching bank only swaps pointers.
+		// Stores go through their own table, it points read-only pages to 'discarded'
+		byte* pages[PAGE_COUNT];
+		byte* writablePages[PAGE_COUNT];
+
+		std::unique_ptr<byte[]> discarded;
+
+		std::vector<std::unique_ptr<byte[]>> banks;		// Bank 1 is banks[0]
+		int bank = 0;
+
+		byte* at(word address) {
+			return pages[address >> PAGE_BITS] + (address & (PAGE_SIZE - 1));
+		}
+
+		byte* writableAt(word address) {
+			return writablePages[address >> PAGE_BITS] + (address & (PAGE_SIZE - 1));
+		}
+
+		bool isReadOnly(word address) const {
+			return pages[address >> PAGE_BITS] != writablePages[address >> PAGE_BITS];
+		}
+
+		void setPage(int page, byte* data, bool isWritable);
+
+		// Points pages to memory block, bank window included
+		void resetPages();
+
+		// Attached program decodes everything again, as it runs
+		void invalidateDecoded();
 
 		/* GenerL purpose registers: R0 - R7, PC, PSR */
 		word regs[10] = {0};
@@ -25,33 +136,297 @@ namespace m16 {
 		word USP = 0;
 		word SSP = 0;
 
+		// Stack accesses, SP alignment is checked by the callers
 		void push(word val);
 		word pop();
 
 		void setPrivileged(bool isPrivileged);
 		bool isPriviledged();
 
-		void setFlags(word result);
+		// In the header, so the engines of every set of probes inline it
+		void setFlags(word result) {
+			if (result == 0) {
+				regs[9] = setBit(regs[9], 2, false);	// NF
+				regs[9] = setBit(regs[9], 1, true);		// ZF
+				regs[9] = setBit(regs[9], 0, false);	// PF
+				return;
+			}
+
+			regs[9] = setBit(regs[9], 1, false);		// ZF
+			if (result & 0x8000) {
+				regs[9] = setBit(regs[9], 2, true);		// NF
+				regs[9] = setBit(regs[9], 0, false);	// PF
+			} else {
+				regs[9] = setBit(regs[9], 2, false);	// NF
+				regs[9] = setBit(regs[9], 0, true);		// PF
+			}
+		}
+
+		// Common part of interrupts and exceptions, and RTI
+		void enterHandler(word handler);
+		void returnFromHandler();
+
+		void trap(byte vect);
+
+		// Indexed by vector, empty until the first bindTrap()
+		std::vector<hostCall> hostCalls;
+
+		// DMA device, see TRAP_DMA_COPY
+		int dmaInterrupt = -1;
+		int dmaLevel = 0;
+
+		void dmaCopy(word to, word from, int size);
+		void dmaFill(word to, byte value, int size);
+		int dmaCompare(word a, word b, int size);
+
+		// Same over memory shared by cores of machine: whole words are atomic, partial ones go through
+		// the containing word as LDB and STB do, so transfers don't race with other cores
+		void dmaCopyShared(word to, word from, int size);
+		void dmaFillShared(word to, byte value, int size);
+		int dmaCompareShared(word a, word b, int size);
+
+		// Accounts cycles of transfer and sends completion interrupt
+		void dmaComplete();
+
+		// Reciprocal of the last divisor seen in each register
+		arith::divider dividers[8];
+
+		// DIV and MOD for both engines. Return false, if exception was raised
+		bool divide(word a, byte divisorReg, word& result, bool isMod);
+
+		// Decoded copy of memory for processDecoded(), kept in sync by memory writes
+		program* decodedCache = nullptr;
+
+		// Models fed by run(), see attachCaches(), attachPipeline() and attachProfile()
+		memoryHierarchy* caches = nullptr;
+		pipeline* timing = nullptr;
+		profile* counts = nullptr;
+
+		status exitStatus = status::running;
+
+		// Bits of 'probes': which models the engine feeds, and whether other cores share memory
+		static constexpr int PROBE_CACHES = 1;
+		static constexpr int PROBE_PIPELINE = 2;
+		static constexpr int PROBE_PROFILE = 4;
+		static constexpr int SHARED_MEMORY = 8;
+
+		// Both engines are instantiated for every set of probes, so plain runs don't pay for models
+		// and standalone cpu doesn't pay for atomic byte accesses
+		template<int probes> void execute();
+		template<int probes> void executeDecoded();
+
+		template<bool isDecoded, int probes> void runLoop(uint64_t end);
+
+		// Executes 'count' instructions, unless cpu stops
+		void runBlock(uint64_t count);
+
+		// Words are stored big-endian in guest memory
+		static word toGuestOrder(word val) {
+			if constexpr (std::endian::native == std::endian::little) return (val >> 8) | (val << 8);
+			else return val;
+		}
+
+		// Aligned word never crosses a page
+		std::atomic_ref<word> wordAt(word address) {
+			return std::atomic_ref<word>(*(word*)at(address));
+		}
+
+		std::atomic_ref<word> writableWordAt(word address) {
+			return std::atomic_ref<word>(*(word*)writableAt(address));
+		}
+
+		// Raises exception, kept out of line, so accessors stay small
+		void unalignedAccess();
+
+		// Byte accesses of cores, see writeByte()
+		void writeSharedByte(word address, byte value) {
+			std::atomic_ref<word> target = writableWordAt(address & 0xfffe);
+			word old = target.load(std::memory_order_relaxed);
+			word updated;
+
+			do {
+				byte bytes[2];
+				memcpy(bytes, &old, 2);
+				bytes[address & 1] = value;
+				memcpy(&updated, bytes, 2);
+			} while (!target.compare_exchange_weak(old, updated, std::memory_order_release, std::memory_order_relaxed));
+		}
+
+		byte readSharedByte(word address) {
+			word value = wordAt(address & 0xfffe).load(std::memory_order_acquire);
+
+			byte bytes[2];
+			memcpy(bytes, &value, 2);
+			return bytes[address & 1];
+		}
+
+		// LDB and STB of the engines
+		template<int probes>
+		byte loadByte(word address) {
+			if constexpr ((probes & SHARED_MEMORY) != 0) return readSharedByte(address);
+			else return *at(address);
+		}
+
+		template<int probes>
+		void storeByte(word address, byte value) {
+			if constexpr ((probes & SHARED_MEMORY) != 0) writeSharedByte(address, value);
+			else *writableAt(address) = value;
+
+			if (decodedCache != nullptr) decodedCache->update(address & 0xfffe, readWord(address));
+		}
+
+		// Guest accessors: unaligned access raises exception and returns false
+		bool loadWord(word address, word& value) {
+			if (address & 1) [[unlikely]] {
+				unalignedAccess();
+				return false;
+			}
+
+			value = readWord(address);
+			return true;
+		}
+
+		bool storeWord(word address, word value) {
+			if (address & 1) [[unlikely]] {
+				unalignedAccess();
+				return false;
+			}
+
+			writeWord(address, value);
+			return true;
+		}
 
 	public:
+		cpu();
+
+		// Core of multiprocessor system: memory block of MAX_MEM_SIZE bytes is owned by caller.
+		// Banks are private to every core
+		cpu(byte* sharedMemory);
+
+		~cpu();
+
+		cpu(const cpu&) = delete;
+		cpu& operator=(const cpu&) = delete;
+
 		bool debugHalt = false;
 
+		// Vector of exception, which halted cpu because no handler was installed, or -1
+		int unhandledException = -1;
+
+		// Debug traps: x25 halts and x10 prints R4 to 'console'. Otherwise TRAP jumps through vectors at x0000
+		bool isDebug = IS_DEBUG;
+
+		// Stream for debug traps output
+		FILE* console = stdout;
+
+		// Instructions retired by run(). Instruction, which threw, is counted too
+		uint64_t retired = 0;
+
+		// Nominal cycles of all executed instructions, see CYCLES
+		uint64_t cycles = 0;
+
+		// MAX_MEM_SIZE bytes into the memory block, the bank window into the selected bank. Mapped host buffers stay as they are
 		void loadImage(byte* stream);
 
 		void process();
 
+		// Same as process(), but executes instructions from attached decoded program
+		void processDecoded();
+
+		// 'prog' decodes current memory as it runs and is kept up to date. Pass nullptr to detach
+		void attachDecoded(program* prog);
+
+		// run() sends fetches and guest loads and stores through 'hierarchy' and adds cycles of its misses.
+		// process() and processDecoded() never simulate caches. Pass nullptr to detach
+		void attachCaches(memoryHierarchy* hierarchy) { caches = hierarchy; }
+
+		// run() reports every instruction to timing model 'model', together with cycles of cache misses,
+		// if caches are attached. process() and processDecoded() don't. Pass nullptr to detach
+		void attachPipeline(pipeline* model) { timing = model; }
+
+		// run() counts executed instructions and directions of conditional branches into 'counters'.
+		// process() and processDecoded() don't. Pass nullptr to detach
+		void attachProfile(profile* counters) { counts = counters; }
+
+		// Run until cpu stops or hits one of limits. Uses decoded program, if attached.
+		// Guest faults stop cpu with fault status instead of exceptions
+		status run(const limits& lim);
+		status run(uint64_t budget);
+
+		// Stop cpu, e.g. by watchdog. Stopped cpu has debugHalt set
+		void halt(status why);
+
+		// 'running' until cpu stops
+		status getStatus() const { return exitStatus; }
+
 		void setRegister(Register reg, word value);
 		word getRegister(Register reg);
 
 		void sendInterrupt(byte id, int level);
 
+		// Enter handler of exception. Without handler installed cpu halts
+		void raiseException(exception id);
+
 		void dumpMem();
 		void printRegs();
 
-		void writeWord(word address, word value);
-		word readWord(word address);
+		// Allocates 'count' zeroed banks besides bank 0 and selects bank 0. Old banks are freed
+		void setBankCount(int count);
+		int getBankCount() const { return (int)banks.size() + 1; }
+
+		// BANK_SIZE bytes of bank, for the host to fill or read back
+		byte* getBank(int id) { return id == 0 ? memory + BANK_WINDOW : banks[id - 1].get(); }
+
+		// Bank register. Returns false, if there is no such bank
+		bool selectBank(int id);
+		int getSelectedBank() const { return bank; }
+
+		// Maps host buffer at guest 'address' without copying: guest accesses go straight to the buffer.
+		// Address and size must be multiples of PAGE_SIZE, buffer must be 2-byte aligned and the range must stay
+		// out of the bank window. Guest stores into read-only mapping are discarded, so e.g. read-only mmap of a file
+		// can be used. loadImage() doesn't write into mapped buffers. Buffer is not owned by cpu.
+		// Returns false, if the range can't be mapped
+		bool mapBuffer(word address, byte* buffer, int size, bool isWritable);
+
+		// Memory block shows again under the range. Returns false, if the range can't be mapped
+		bool unmapBuffer(word address, int size);
+
+		// Interrupt, which is sent when DMA transfer is complete, right after its TRAP. Pass -1 to disable
+		void setDmaInterrupt(int id, int level) { dmaInterrupt = id; dmaLevel = level; }
+
+		// TRAP 'vect' calls 'call' instead of the built-in service or the guest handler. Guest continues
+		// after TRAP, unless the call changes PC or halts cpu. Pass nullptr to unbind
+		void bindTrap(byte vect, hostCall call);
+
+		// Host accessors, bit 0 of word address is ignored.
+		// Accesses are atomic, stores release and loads acquire, so cores of machine never see torn words.
+		// Host writes into mapped buffers directly are not seen by attached decoded program
+		void writeWord(word address, word value) {
+			address &= 0xfffe;
+			writableWordAt(address).store(toGuestOrder(value), std::memory_order_release);
+
+			if (decodedCache != nullptr) decodedCache->update(address, readWord(address));
+		}
+
+		word readWord(word address) {
+			return toGuestOrder(wordAt(address & 0xfffe).load(std::memory_order_acquire));
+		}
+
+		// Sequentially consistent read-modify-write, both return old value
+		word compareExchangeWord(word address, word expected, word desired);
+		word fetchAddWord(word address, word addend);
+
+		// Private memory takes plain byte accesses. In shared memory of machine bytes go through their containing word:
+		// a plain byte store would race with word accesses of other cores
+		void writeByte(word address, byte value) {
+			if (ownsMemory) *writableAt(address) = value;
+			else writeSharedByte(address, value);
+
+			if (decodedCache != nullptr) decodedCache->update(address & 0xfffe, readWord(address));
+		}
 
-		void writeByte(word address, byte value);
-		byte readByte(word address);
+		byte readByte(word address) {
+			return ownsMemory ? *at(address) : readSharedByte(address);
+		}
 	};
 }
\ No newline at end of file
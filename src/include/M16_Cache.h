@@ -0,0 +1,142 @@
+#pragma once
+
+#include <memory>
+
+#include "M16_CPU.h"
+
+namespace m16 {
+	class debugInfo;
+
+	enum class writePolicy : byte {
+		writeBack,		// Stores allocate lines and mark them dirty, dirty lines are written back on eviction
+		writeThrough,	// Every store goes to the next level, store miss does not allocate
+	};
+
+	// Size, line size and number of sets must be powers of two. Zero size means no cache at this level
+	struct cacheConfig {
+		int size = 0;
+		int ways = 1;
+		int lineSize = 16;
+		writePolicy policy = writePolicy::writeBack;
+	};
+
+	// Set-associative cache with LRU replacement. Keeps tags only, data stays in cpu memory
+	class cache {
+	public:
+		struct stats {
+			uint64_t accesses = 0;
+			uint64_t misses = 0;
+			uint64_t writeBacks = 0;		// Dirty lines evicted
+		};
+
+	private:
+		struct line {
+			word tag = 0;
+			bool isValid = false;
+			bool isDirty = false;
+			uint64_t lastUse = 0;
+		};
+
+		cacheConfig config;
+		int lineBits;
+		int setMask;
+
+		std::vector<line> lines;		// Set after set, 'ways' lines each
+		uint64_t useClock = 0;		// 32 bits would wrap within a few billion accesses and turn LRU into MRU
+
+		stats counters;
+
+	public:
+		// Throws std::invalid_argument, if configuration is not valid
+		cache(const cacheConfig& config);
+
+		// Returns true on hit. Address of dirty line, which was evicted to make room, is put into 'writeBack', otherwise -1
+		bool access(word address, bool isWrite, int& writeBack);
+
+		// Invalidates every line and clears counters
+		void reset();
+
+		const cacheConfig& getConfig() const { return config; }
+		const stats& getStats() const { return counters; }
+	};
+
+	// Extra cycles of misses, on top of nominal CYCLES. Write-backs and write-through stores
+	// go through write buffer and cost nothing
+	struct hierarchyConfig {
+		cacheConfig l1i = { 4096, 2, 16, writePolicy::writeBack };
+		cacheConfig l1d = { 4096, 4, 16, writePolicy::writeBack };
+		cacheConfig l2;
+		int l2Cycles = 6;			// L1 miss, which hits L2
+		int memoryCycles = 30;		// Miss in the last level
+	};
+
+	// L1 instruction and data caches, optional unified L2 and memory.
+	// Attached by cpu::attachCaches(). Fetches and LDB/LDR/STB/STR go through it, traps, DMA,
+	// handler entry and host accessors bypass caches
+	class memoryHierarchy {
+	public:
+		// Counters of instruction at one address
+		struct site {
+			uint64_t fetches = 0;
+			uint64_t fetchMisses = 0;
+			uint64_t accesses = 0;			// Loads and stores done by the instruction
+			uint64_t accessMisses = 0;
+
+			uint64_t misses() const { return fetchMisses + accessMisses; }
+		};
+
+	private:
+		hierarchyConfig config;
+
+		std::unique_ptr<cache> l1i;
+		std::unique_ptr<cache> l1d;
+		std::unique_ptr<cache> l2;
+
+		std::vector<site> sites;		// Indexed by address of instruction / 2
+
+		uint64_t extraCycles = 0;
+
+		// Cycles of L1 miss. L1 without cache behind it goes straight to L2 or memory
+		int next(word address, bool isWrite);
+
+		int access(cache* level, word address, bool isWrite, uint64_t& count, uint64_t& misses);
+
+	public:
+		// Throws std::invalid_argument, if one of caches is not valid
+		memoryHierarchy(const hierarchyConfig& config = hierarchyConfig());
+
+		// Return extra cycles of the access
+		int fetch(word pc) {
+			site& s = sites[pc >> 1];
+			return access(l1i.get(), pc, false, s.fetches, s.fetchMisses);
+		}
+
+		int load(word pc, word address) {
+			site& s = sites[pc >> 1];
+			return access(l1d.get(), address, false, s.accesses, s.accessMisses);
+		}
+
+		int store(word pc, word address) {
+			site& s = sites[pc >> 1];
+			return access(l1d.get(), address, true, s.accesses, s.accessMisses);
+		}
+
+		// Empties caches and clears counters
+		void reset();
+
+		const hierarchyConfig& getConfig() const { return config; }
+
+		// nullptr, if there is no cache at the level
+		const cache* getL1I() const { return l1i.get(); }
+		const cache* getL1D() const { return l1d.get(); }
+		const cache* getL2() const { return l2.get(); }
+
+		const site& getSite(word pc) const { return sites[pc >> 1]; }
+		uint64_t getExtraCycles() const { return extraCycles; }
+
+		// Summary of every level, then 'count' instructions and labels with the most L1 misses.
+		// Instructions are disassembled from memory of 'vm', labels come from assembler's symbol table.
+		// Source lines of instructions are shown, if there is a line table
+		void report(FILE* out, cpu& vm, const std::unordered_map<std::string, word>& labels, int count = 10, const debugInfo* lines = nullptr) const;
+	};
+}
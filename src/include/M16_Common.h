@@ -1,18 +1,21 @@
 #pragma once
 
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <string>
-#include <format>
 #include <vector>
 #include <unordered_map>
 #include <stack>
 
 namespace m16 {
-	using byte = unsigned __int8;
-	using word = unsigned __int16;
+	using byte = uint8_t;
+	using word = uint16_t;
 
+	// Default of cpu::isDebug and lockstep::isDebug
 	constexpr bool IS_DEBUG = true;
-	constexpr word MAX_MEM_SIZE = (1 << 16) - 1;
+	constexpr int MAX_MEM_SIZE = 1 << 16;
 
 	enum class Register {
 		R0,
@@ -23,5 +26,7 @@ namespace m16 {
 		R5,
 		R6, SP = 6,
 		R7, LR = 7,
+		PC,
+		PSR,
 	};
 }
\ No newline at end of file
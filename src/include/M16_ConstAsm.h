@@ -0,0 +1,414 @@
+#pragma once
+
+#include <array>
+#include <string_view>
+
+#include "M16_Encoder.h"
+
+namespace m16 {
+	// Compile-time counterpart of micrasm.
+	// Understands the same syntax (labels, opcodes, '.dat', '.strz', '.blk', '.orig'),
+	// but runs in constant evaluation, so embedded programs cost nothing at startup:
+	//
+	//     constexpr auto fib = casm::assemble<R"(
+	//         loop:   add r0, r0, #1
+	//                 brp loop
+	//                 halt
+	//     )">();
+	//
+	// Any syntax error is reported as compile error.
+	namespace casm {
+		template<size_t N>
+		struct source {
+			char text[N] = {};
+
+			consteval source(const char (&str)[N]) {
+				for (size_t i = 0; i < N; i++) text[i] = str[i];
+			}
+
+			constexpr std::string_view view() const { return std::string_view(text, N - 1); }
+		};
+
+		class assembler {
+		private:
+			struct label {
+				std::string_view name;
+				word address;
+			};
+
+			std::string_view src;
+			size_t current = 0;
+
+			std::vector<label> labels;
+
+			// During first pass nothing is written and unknown labels are allowed
+			byte* code = nullptr;
+			bool finalPass = false;
+
+			word PC = 0;
+			word size = 0;
+
+			static constexpr bool isAlpha(char c) {
+				return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+			}
+
+			static constexpr bool isDigit(char c) {
+				return c >= '0' && c <= '9';
+			}
+
+			static constexpr bool isAlphaOrDigit(char c) { return isAlpha(c) || isDigit(c); }
+
+			constexpr char peekChar() const {
+				return current < src.size() ? src[current] : '\0';
+			}
+
+			constexpr bool matchChar(char c) {
+				if (peekChar() != c || c == '\0') return false;
+
+				current++;
+				return true;
+			}
+
+			constexpr void skipWhitespace() {
+				while (peekChar() == ' ' || peekChar() == '\t' || peekChar() == '\r') current++;
+			}
+
+			constexpr void expectComma() {
+				skipWhitespace();
+				if (!matchChar(',')) throw encode_error("',' expected between operands.");
+			}
+
+			constexpr void endOfLine() {
+				skipWhitespace();
+
+				if (matchChar(';')) {
+					while (peekChar() != '\n' && peekChar() != '\0') current++;
+				}
+
+				if (!matchChar('\n') && peekChar() != '\0') throw encode_error("Unexpected character after instruction.");
+			}
+
+			constexpr std::string_view scanIdent() {
+				size_t from = current;
+
+				if (isAlpha(peekChar()) || peekChar() == '.') {
+					current++;
+					while (isAlphaOrDigit(peekChar())) current++;
+				}
+
+				return src.substr(from, current - from);
+			}
+
+			constexpr void emitByte(byte value) {
+				if (finalPass) code[PC] = value;
+
+				PC++;
+				if (PC > size) size = PC;
+			}
+
+			constexpr void emitWord(word value) {
+				emitByte(value >> 8);
+				emitByte(value & 0xff);
+			}
+
+			constexpr Register scanRegister() {
+				skipWhitespace();
+
+				if (!matchChar('r') || !isDigit(peekChar())) throw encode_error("Register identifier expected.");
+
+				int regNum = src[current++] - '0';
+				if (regNum > 7) throw encode_error("Only registers R0 through R7 are available.");
+
+				return (Register)regNum;
+			}
+
+			constexpr bool isRegisterNext() {
+				skipWhitespace();
+
+				return peekChar() == 'r' && current + 1 < src.size() && isDigit(src[current + 1]);
+			}
+
+			// Numbers start with '#' - decimal, 'b' - binary, 'o' - octal, 'x' - hexadecimal
+			constexpr long scanNumber() {
+				skipWhitespace();
+
+				int base = 0;
+				if (matchChar('#')) base = 10;
+				else if (matchChar('b')) base = 2;
+				else if (matchChar('o')) base = 8;
+				else if (matchChar('x')) base = 16;
+				else throw encode_error("Unknown number specifier.");
+
+				bool negative = matchChar('-');
+				if (!negative) matchChar('+');
+
+				long value = 0;
+				int digits = 0;
+				while (true) {
+					char c = peekChar();
+					int digit = 0;
+
+					if (isDigit(c)) digit = c - '0';
+					else if (c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+					else if (c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+					else break;
+
+					if (digit >= base) break;
+
+					value = value * base + digit;
+					if (value > 0xffff) throw encode_error("Number exceeds 16-bit range.");
+
+					digits++;
+					current++;
+				}
+
+				if (digits == 0) throw encode_error("Digits expected after number specifier.");
+
+				return negative ? -value : value;
+			}
+
+			// Signed operand is a number or a label, which is resolved relative to the next instruction.
+			// As in micrasm, number specifiers take precedence over label names.
+			constexpr int scanOffset() {
+				skipWhitespace();
+
+				char c = peekChar();
+				if (c == '#' || c == 'b' || c == 'o' || c == 'x' || !isAlpha(c)) return (int)scanNumber();
+
+				std::string_view name = scanIdent();
+				int index = findLabel(name);
+
+				if (index < 0) {
+					if (finalPass) throw encode_error("Can't find the label declaration.");
+					return 0;
+				}
+
+				return (labels[index].address >> 1) - ((PC + 2) >> 1);
+			}
+
+			constexpr int findLabel(std::string_view name) const {
+				for (size_t i = 0; i < labels.size(); i++) {
+					if (labels[i].name == name) return (int)i;
+				}
+
+				return -1;
+			}
+
+			constexpr void declareLabel(std::string_view name) {
+				int index = findLabel(name);
+
+				if (index >= 0) {
+					// Second pass visits the same declarations again
+					if (!finalPass) throw encode_error("Label already exists.");
+					return;
+				}
+
+				labels.push_back({ name, PC });
+			}
+
+			constexpr void strzPseudoOp() {
+				skipWhitespace();
+				if (!matchChar('"')) throw encode_error("'\"' expected after '.strz'.");
+
+				while (peekChar() != '"') {
+					if (peekChar() == '\0' || peekChar() == '\n') throw encode_error("Unterminated string in '.strz'.");
+
+					if (matchChar('\\')) {
+						char c = src[current++];
+						switch (c) {
+						case '0': emitByte('\0'); break;
+						case 'a': emitByte('\a'); break;
+						case 'b': emitByte('\b'); break;
+						case 'f': emitByte('\f'); break;
+						case 'n': emitByte('\n'); break;
+						case 'r': emitByte('\r'); break;
+						case 't': emitByte('\t'); break;
+						case 'v': emitByte('\v'); break;
+						case '\\': emitByte('\\'); break;
+						default:
+							emitByte('\\');
+							emitByte(c);
+							break;
+						}
+
+						continue;
+					}
+
+					emitByte(src[current++]);
+				}
+
+				current++;
+				emitByte('\0');
+			}
+
+			constexpr void datPseudoOp() {
+				do {
+					long value = scanNumber();
+					if (value < -0x8000) throw encode_error("Number exceeds 16-bit range.");
+
+					emitWord((word)value);
+					skipWhitespace();
+				} while (matchChar(','));
+			}
+
+			constexpr void instruction(std::string_view op) {
+				if (op == "add" || op == "and" || op == "mul") {
+					byte opcode = op == "add" ? 0b0001 : op == "and" ? 0b0101 : 0b1010;
+
+					Register dest = scanRegister();
+					expectComma();
+					Register src1 = scanRegister();
+					expectComma();
+
+					if (isRegisterNext()) emitWord(enc::RRR(opcode, dest, src1, scanRegister()));
+					else emitWord(enc::RRI(opcode, dest, src1, scanOffset()));
+				} else if (op == "ldb" || op == "stb" || op == "ldr" || op == "str") {
+					byte opcode = op == "ldb" ? 0b0010 : op == "stb" ? 0b0011 : op == "ldr" ? 0b0110 : 0b0111;
+
+					Register dest = scanRegister();
+					expectComma();
+					Register base = scanRegister();
+					expectComma();
+
+					emitWord(enc::RRB(opcode, dest, base, scanOffset()));
+				} else if (op == "div" || op == "mod") {
+					Register dest = scanRegister();
+					expectComma();
+					Register src1 = scanRegister();
+					expectComma();
+					Register src2 = scanRegister();
+
+					emitWord(op == "div" ? enc::DIV(dest, src1, src2) : enc::MOD(dest, src1, src2));
+				} else if (op == "lshf" || op == "rshf" || op == "arshf") {
+					Register dest = scanRegister();
+					expectComma();
+					Register src1 = scanRegister();
+					expectComma();
+
+					emitWord(enc::SHF(dest, src1, op == "arshf", op == "lshf", (int)scanNumber()));
+				} else if (op == "not") {
+					Register dest = scanRegister();
+					expectComma();
+
+					emitWord(enc::NOT(dest, scanRegister()));
+				} else if (op == "lea") {
+					Register dest = scanRegister();
+					expectComma();
+
+					emitWord(enc::LEA(dest, scanOffset()));
+				} else if (op == "jsr") {
+					if (isRegisterNext()) emitWord(enc::JSRR(scanRegister()));
+					else emitWord(enc::JSR(scanOffset()));
+				} else if (op == "jmp") {
+					emitWord(enc::JMP(scanRegister()));
+				} else if (op == "trap") {
+					emitWord(enc::TRAP((int)scanNumber()));
+				} else if (op == "ret") {
+					emitWord(enc::RET());
+				} else if (op == "rti") {
+					emitWord(enc::RTI());
+				} else if (op == "halt" || op == "hlt") {
+					emitWord(enc::HALT());
+				} else if (op == "nop") {
+					emitWord(enc::NOP());
+				} else if (op.size() >= 2 && op.substr(0, 2) == "br") {
+					// br, brn, brz, brp, brnz, brnp, brzp, brnzp
+					std::string_view flags = op.substr(2);
+					bool n = false, z = false, p = false;
+
+					if (!flags.empty() && flags[0] == 'n') { n = true; flags.remove_prefix(1); }
+					if (!flags.empty() && flags[0] == 'z') { z = true; flags.remove_prefix(1); }
+					if (!flags.empty() && flags[0] == 'p') { p = true; flags.remove_prefix(1); }
+					if (!flags.empty()) throw encode_error("Unknown opcode.");
+
+					emitWord(enc::BR(n, z, p, scanOffset()));
+				} else if (op == ".dat") {
+					datPseudoOp();
+				} else if (op == ".strz") {
+					strzPseudoOp();
+				} else if (op == ".blk") {
+					long length = scanNumber();
+					if (length < 0 || PC + length > 0xffff) throw encode_error("Space needed to be reserved is too large.");
+
+					PC += (word)length;
+					if (PC > size) size = PC;
+				} else if (op == ".orig") {
+					long address = scanNumber();
+					if (address < 0) throw encode_error("'.orig' address can't be negative.");
+
+					PC = (word)address;
+				} else {
+					throw encode_error("Unknown opcode.");
+				}
+			}
+
+			constexpr void pass() {
+				current = 0;
+				PC = 0;
+
+				while (current < src.size()) {
+					skipWhitespace();
+
+					if (peekChar() == '\n' || peekChar() == ';' || peekChar() == '\0') {
+						endOfLine();
+						continue;
+					}
+
+					std::string_view ident = scanIdent();
+					if (ident.empty()) throw encode_error("Label or opcode expected.");
+
+					if (matchChar(':')) {
+						declareLabel(ident);
+
+						// Label may be followed by an instruction on the same line
+						skipWhitespace();
+						if (peekChar() == '\n' || peekChar() == ';' || peekChar() == '\0') {
+							endOfLine();
+							continue;
+						}
+
+						ident = scanIdent();
+						if (ident.empty()) throw encode_error("Opcode expected after label.");
+					}
+
+					instruction(ident);
+					endOfLine();
+				}
+			}
+
+		public:
+			constexpr assembler(std::string_view source) : src(source) {}
+
+			// First pass: collect labels and compute image size
+			constexpr word measure() {
+				finalPass = false;
+				pass();
+
+				return size;
+			}
+
+			// Second pass: put encoded program into 'out', which must hold measure() bytes
+			constexpr void emit(byte* out) {
+				measure();
+
+				code = out;
+				finalPass = true;
+				pass();
+			}
+		};
+
+		template<source Src>
+		consteval word imageSize() {
+			return assembler(Src.view()).measure();
+		}
+
+		template<source Src>
+		consteval std::array<byte, imageSize<Src>()> assemble() {
+			std::array<byte, imageSize<Src>()> image = {};
+
+			assembler(Src.view()).emit(image.data());
+
+			return image;
+		}
+	}
+}
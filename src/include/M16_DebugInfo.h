@@ -0,0 +1,55 @@
+#pragma once
+
+#include "M16_Common.h"
+
+namespace m16 {
+	// Bytes [address, address + size) were assembled from 'line' of 'file'
+	struct lineEntry {
+		word address = 0;
+		word size = 0;
+		int file = 0;
+		int line = 0;
+	};
+
+	// Line table and labels of assembled program, made by micrasm.
+	//
+	// Images carry it in a side section after memory contents:
+	//     <memory> <section> <section size, 4 bytes LE> "M16DEBUG"
+	// Loaders, which don't need it, only strip the 12 bytes footer and the section, see splitImage().
+	// The section is: version byte, files, labels, then line entries by address, delta-encoded with LEB128
+	class debugInfo {
+	private:
+		std::vector<std::string> files;
+		std::vector<lineEntry> lines;		// By address after sortLines()
+		std::unordered_map<std::string, word> labels;
+
+	public:
+		static constexpr int VERSION = 1;
+		static constexpr int FOOTER_SIZE = 12;
+
+		int addFile(const std::string& name);
+		void addLine(word address, word size, int file, int line);
+		void sortLines();
+
+		void setLabels(const std::unordered_map<std::string, word>& labels) { this->labels = labels; }
+		const std::unordered_map<std::string, word>& getLabels() const { return labels; }
+
+		const std::string& getFile(int file) const { return files[file]; }
+		const std::vector<lineEntry>& getLines() const { return lines; }
+
+		// Entry, which covers 'address', or nullptr. O(log n)
+		const lineEntry* find(word address) const;
+
+		// "file:line", "line N" for unnamed source, empty if 'address' has no line
+		std::string describe(word address) const;
+
+		// Appends the section with footer
+		void encode(std::vector<byte>& out) const;
+
+		// Reads the section without footer. Returns false and stays empty, if it is corrupted
+		bool decode(const byte* data, size_t size);
+
+		// Size of memory contents of 'image'. Debug section goes to 'section', if there is one
+		static size_t splitImage(const byte* image, size_t size, const byte** section, size_t* sectionSize);
+	};
+}
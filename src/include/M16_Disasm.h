@@ -0,0 +1,113 @@
+#pragma once
+
+#include <map>
+
+#include "M16_Common.h"
+
+namespace m16 {
+	enum class opcode : byte {
+		BR,
+		ADD,
+		LDB,
+		STB,
+		JSR,
+		JSRR,
+		AND,
+		LDR,
+		STR,
+		RTI,
+		NOT,
+		MUL,
+		DIV,
+		MOD,
+		JMP,
+		LSHF,
+		RSHF,
+		ARSHF,
+		LEA,
+		TRAP,
+		STALE,		// Entry of program, which must be decoded again from memory
+	};
+
+	// Nominal cost of instructions in cycles, by opcode field (bits 15-12)
+	constexpr byte CYCLES[16] = {
+		1, 1, 2, 2,		// BR, ADD, LDB, STB
+		2, 1, 2, 2,		// JSR, AND, LDR, STR
+		4, 1, 3, 12,	// RTI, NOT, MUL, DIV/MOD
+		2, 1, 1, 4,		// JMP, SHF, LEA, TRAP
+	};
+
+	// Instruction with all fields extracted, so nothing is left to decode during execution
+	struct decoded {
+		opcode op = opcode::BR;
+		byte reg1 = 0;			// Destination (source for STB/STR), n/z/p mask for BR
+		byte reg2 = 0;			// First source or base register
+		byte reg3 = 0;			// Second source register, if 'isImm' is not set
+		bool isImm = false;
+		byte cycles = 0;		// See CYCLES
+		int16_t imm = 0;		// Sign-extended immediate. PC-relative and word offsets are already in bytes
+	};
+
+	static_assert(sizeof(decoded) == 8, "decoded instruction must stay compact");
+
+	class disasm {
+	private:
+		std::map<word, std::string> symbols;
+
+	public:
+		disasm() = default;
+
+		// Labels are taken from assembler's symbol table
+		disasm(const std::unordered_map<std::string, word>& labels);
+
+		static decoded decode(word inst);
+
+		static const char* mnemonic(opcode op);
+
+		// Label, declared at the address, or nullptr
+		const char* symbolAt(word address) const;
+
+		// The nearest label at or before the address and distance from it in bytes, or nullptr
+		const char* labelOf(word address, int& offset) const;
+
+		// Text in micrasm syntax, so it can be assembled back
+		std::string format(const decoded& inst, word address) const;
+		std::string format(word inst, word address) const;
+	};
+
+	// Decoded instructions of the whole address space. Entry for the word at 'address' is at(address).
+	// Entries start STALE and are decoded, when they run for the first time. Pages, which never ran,
+	// stay STALE, so stores and DMA into data cost nothing here
+	class program {
+	private:
+		static constexpr int PAGE_BITS = 8;
+		static constexpr int PAGE_COUNT = MAX_MEM_SIZE >> PAGE_BITS;
+
+		std::vector<decoded> insts;
+		std::vector<byte> codePages;		// Pages with decoded entries, every entry of the other pages is STALE
+
+	public:
+		program();
+
+		// Decodes every word at once, for users which never invalidate
+		void decodeImage(const byte* image);
+
+		// Decodes the word, which is about to run. Its page holds code from now on
+		void fetch(word address, word inst) {
+			insts[address >> 1] = disasm::decode(inst);
+			codePages[address >> PAGE_BITS] = 1;
+		}
+
+		// Memory changed, nothing to do for pages without code
+		void update(word address, word inst) {
+			if (codePages[address >> PAGE_BITS] != 0) insts[address >> 1] = disasm::decode(inst);
+		}
+
+		// Marks words, which overlap 'size' bytes at 'address', as STALE. Range wraps around the end of memory
+		void invalidate(word address, int size);
+
+		const decoded& at(word address) const {
+			return insts[address >> 1];
+		}
+	};
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "M16_Common.h"
+
+namespace m16 {
+	class encode_error : public std::runtime_error {
+	public:
+		encode_error(const char* message) : std::runtime_error(message) {}
+	};
+
+	// Compile-time instruction encoders.
+	// Every function mirrors one of the ir::emit* calls, but returns the instruction word
+	// instead of putting it into the code buffer. Operands are range-checked, so when an
+	// encoder is evaluated in constant expression, bad operand is a compile error.
+	namespace enc {
+		constexpr word fitSigned(int value, int size, const char* what) {
+			if (value < -(1 << (size - 1)) || value > (1 << (size - 1)) - 1) throw encode_error(what);
+
+			return (word)value & ((1 << size) - 1);
+		}
+
+		constexpr word fitUnsigned(int value, int size, const char* what) {
+			if (value < 0 || value > (1 << size) - 1) throw encode_error(what);
+
+			return (word)value;
+		}
+
+		constexpr word reg(Register r) {
+			if ((int)r < 0 || (int)r > 7) throw encode_error("Only registers R0 through R7 can be encoded.");
+
+			return (word)r;
+		}
+
+		constexpr word RRR(byte opcode, Register dest, Register src1, Register src2) {
+			return (opcode << 12) | (reg(dest) << 9) | (reg(src1) << 6) | (0 << 5) | reg(src2);
+		}
+
+		constexpr word RRI(byte opcode, Register dest, Register src1, int imm5) {
+			return (opcode << 12) | (reg(dest) << 9) | (reg(src1) << 6) | (1 << 5) | fitSigned(imm5, 5, "imm5 is out of range.");
+		}
+
+		constexpr word RRB(byte opcode, Register dest, Register base, int offset6) {
+			return (opcode << 12) | (reg(dest) << 9) | (reg(base) << 6) | fitSigned(offset6, 6, "offset6 is out of range.");
+		}
+
+		constexpr word BR(bool n, bool z, bool p, int offset9) {
+			return (n << 11) | (z << 10) | (p << 9) | fitSigned(offset9, 9, "offset9 is out of range.");
+		}
+
+		constexpr word ADD(Register dest, Register src1, Register src2) { return RRR(0b0001, dest, src1, src2); }
+		constexpr word ADD(Register dest, Register src1, int imm5) { return RRI(0b0001, dest, src1, imm5); }
+		constexpr word LDB(Register dest, Register base, int offset6) { return RRB(0b0010, dest, base, offset6); }
+		constexpr word STB(Register src, Register base, int offset6) { return RRB(0b0011, src, base, offset6); }
+
+		constexpr word JSR(int offset11) {
+			return (0b0100 << 12) | (1 << 11) | fitSigned(offset11, 11, "offset11 is out of range.");
+		}
+
+		constexpr word JSRR(Register base) { return (0b0100 << 12) | (0 << 11) | (reg(base) << 6); }
+
+		constexpr word AND(Register dest, Register src1, Register src2) { return RRR(0b0101, dest, src1, src2); }
+		constexpr word AND(Register dest, Register src1, int imm5) { return RRI(0b0101, dest, src1, imm5); }
+		constexpr word LDR(Register dest, Register base, int offset6) { return RRB(0b0110, dest, base, offset6); }
+		constexpr word STR(Register src, Register base, int offset6) { return RRB(0b0111, src, base, offset6); }
+		constexpr word RTI() { return 0x8000; }
+		constexpr word NOT(Register dest, Register src1) { return (0b1001 << 12) | (reg(dest) << 9) | (reg(src1) << 6); }
+		constexpr word MUL(Register dest, Register src1, Register src2) { return RRR(0b1010, dest, src1, src2); }
+		constexpr word MUL(Register dest, Register src1, int imm5) { return RRI(0b1010, dest, src1, imm5); }
+		constexpr word DIV(Register dest, Register src1, Register src2) { return RRR(0b1011, dest, src1, src2); }
+		constexpr word MOD(Register dest, Register src1, Register src2) { return RRR(0b1011, dest, src1, src2) | (1 << 5); }
+		constexpr word JMP(Register base) { return (0b1100 << 12) | (reg(base) << 6); }
+		constexpr word RET() { return 0xC1C0; }
+
+		constexpr word SHF(Register dest, Register src1, bool isArith, bool isLeft, int imm4) {
+			return (0b1101 << 12) | (reg(dest) << 9) | (reg(src1) << 6) | (isArith << 5) | (isLeft << 4) |
+				fitUnsigned(imm4, 4, "imm4 is out of range.");
+		}
+
+		constexpr word LSHF(Register dest, Register src1, int imm4) { return SHF(dest, src1, false, true, imm4); }
+		constexpr word RSHF(Register dest, Register src1, int imm4) { return SHF(dest, src1, false, false, imm4); }
+		constexpr word ARSHF(Register dest, Register src1, int imm4) { return SHF(dest, src1, true, false, imm4); }
+
+		constexpr word LEA(Register src, int offset9) {
+			return (0b1110 << 12) | (reg(src) << 9) | fitSigned(offset9, 9, "offset9 is out of range.");
+		}
+
+		constexpr word TRAP(int trapvect8) {
+			return (0b1111 << 12) | fitUnsigned(trapvect8, 8, "trapvect8 is out of range.");
+		}
+
+		/* Macro instructions */
+		constexpr word HALT() { return TRAP(0x25); }
+		constexpr word NOP() { return 0x0000; }
+	}
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "M16_Common.h"
+
+namespace m16 {
+	class profile;
+
+	// Instruction or directive, as micrasm assembled it, with labels declared before it
+	struct sourceStatement {
+		std::vector<std::string> labels;
+		std::string text;				// Opcode and operands without comment
+		word address = 0;				// PC before and after the statement
+		word end = 0;
+		word inst = 0;					// Assembled instruction, 0 for directives
+		int line = 0;					// Source line
+		std::string reference;			// Label in operands and size of its offset, if there is one
+		int referenceBits = 0;
+		bool isDirective = false;		// Also the empty statement, which holds labels at the end of source
+	};
+
+	struct layoutStats {
+		int regions = 0;				// Runs of instructions between directives
+		int laidOut = 0;				// Regions in new order
+		int blocks = 0;
+		int movedBlocks = 0;
+		int invertedBranches = 0;		// Taken path became fall-through
+		int addedBranches = 0;			// Fall-through path moved away
+		int removedBranches = 0;		// Jumps to the next block
+	};
+
+	// Profile-guided order of basic blocks.
+	//
+	// Source is split into regions, runs of instructions between directives, and regions into basic blocks.
+	// Blocks are chained along the hottest edges, so hot paths fall through, then chains follow the
+	// entry chain from the hottest to the coldest one. Directives and the first block of every region
+	// stay in place. Conditional branches are inverted or followed by 'brnzp' where needed. If a label
+	// goes out of reach of its instruction, regions between them keep their original order.
+	//
+	// Regions with numeric PC-relative offsets are not moved. Inverted branches expect exactly one of
+	// N, Z, P flags set, as setFlags() leaves them
+	class blockLayout {
+	private:
+		static constexpr int NONE = -1;
+		static constexpr int EXIT = -2;		// Statement after the region
+
+		enum class kind : byte {
+			plain,			// Falls through
+			branch,			// Conditional BR to label
+			jump,			// BRnzp to label
+			stop,			// JMP, RET, RTI, HALT
+		};
+
+		struct block {
+			int first;				// Statements
+			int last;
+			kind end = kind::plain;
+			int target = NONE;		// Block of branch label in the same region
+			int fallThrough = NONE;	// Next block or EXIT, if control can get there
+			uint64_t weight = 0;	// Executions of the first statement
+		};
+
+		struct region {
+			int first;				// Statements [first, last)
+			int last;
+			int firstBlock;			// Blocks [firstBlock, lastBlock)
+			int lastBlock;
+			bool isMovable = true;
+			bool isLaidOut = false;
+			std::vector<int> order;
+		};
+
+		// Statement of the new source
+		struct item {
+			int statement;			// Original statement, the branch follows it for added branches
+			std::string text;
+			int size;
+			std::string reference;
+			int referenceBits;
+			bool isOrig;
+			bool hasLabels;			// Labels of the statement go before this item
+		};
+
+		const std::vector<sourceStatement>& statements;
+		const profile& counts;
+
+		std::vector<block> blocks;
+		std::vector<region> regions;
+
+		std::unordered_map<std::string, int> labelStatements;
+		std::unordered_map<int, std::string> newLabels;		// Generated for statements by label()
+
+		std::vector<item> items;
+		layoutStats stats;
+		std::string source;
+		std::vector<int> sourceLines;
+
+		kind kindOf(const sourceStatement& s, bool& isRelative) const;
+
+		void split();
+		void chain(region& r);
+
+		// Label of the statement, generated, if it has none
+		const std::string& label(int statement);
+
+		// Label of block 'b' of the region or of the statement after it
+		const std::string& target(const region& r, int b);
+
+		item copy(int statement) const;
+		item branchTo(int statement, byte mask, const std::string& label) const;
+		void emit(const region& r);
+
+		// Restores order of regions between instructions and labels, which are out of reach.
+		// Returns false, if everything is in reach
+		bool keepInReach();
+
+	public:
+		blockLayout(const std::vector<sourceStatement>& statements, const profile& counts);
+
+		const std::string& getSource() const { return source; }
+
+		// Line of the original source for every line of getSource(), starting with 1
+		const std::vector<int>& getLines() const { return sourceLines; }
+		const layoutStats& getStats() const { return stats; }
+	};
+}
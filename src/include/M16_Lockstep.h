@@ -0,0 +1,114 @@
+#pragma once
+
+#include <memory>
+
+#include "M16_Common.h"
+#include "M16_CPU.h"
+
+namespace m16 {
+	struct lockstepKernels;
+
+	// Many copies of the same program running in lockstep.
+	// Registers are stored as structure of arrays, one array per register with one word per lane,
+	// so every decoded instruction is executed for all lanes at once with AVX2 or AVX-512, if the CPU
+	// has them, or with plain loops otherwise. See lockstepKernels.
+	//
+	// Lanes, which took different branches, are reconverged by always running the lowest PC first.
+	// Memory of every lane starts as shared image, pages are copied on the first write.
+	class lockstep {
+	private:
+		static constexpr int PAGE_BITS = 8;
+		static constexpr int PAGE_SIZE = 1 << PAGE_BITS;
+		static constexpr int PAGE_COUNT = 0x10000 >> PAGE_BITS;
+
+		int lanes;
+		const lockstepKernels& kernels;
+		int width;		// Lanes count, rounded up to the whole vectors of kernels
+
+		std::vector<byte> image;
+		program decodedImage;
+
+		// Page table of every lane: lane * PAGE_COUNT + page
+		std::vector<byte*> pages;
+		std::vector<std::unique_ptr<byte[]>> privatePages;
+		std::vector<byte> privateCode;		// Pages, which got private copy in any lane
+
+		std::vector<word> regs[10];
+		std::vector<word> USP;
+		std::vector<word> SSP;
+
+		std::vector<word> active;		// 0xffff for the lanes, which still run
+		std::vector<word> mask;			// 0xffff for the lanes, which execute current instruction
+
+		std::vector<status> exitStatus;
+		std::vector<int> unhandledException;
+		std::vector<uint64_t> retired;
+		std::vector<word> pending;		// Retired since the last flush into 'retired'
+
+		word ctableSegment = 0x1000;
+
+		bool isShared(const byte* page) const {
+			return page >= image.data() && page < image.data() + image.size();
+		}
+
+		byte* pageOf(int lane, word address) const {
+			return pages[lane * PAGE_COUNT + (address >> PAGE_BITS)];
+		}
+
+		byte* writablePageOf(int lane, word address);
+
+		void stop(int lane, status why);
+
+		void push(int lane, word val);
+		void setFlags(int lane, word result);
+		void enterHandler(int lane, word handler);
+		void returnFromHandler(int lane);
+		void raiseException(int lane, exception id);
+		void trap(int lane, byte vect);
+		void dma(int lane, byte vect);
+
+		// Executes instruction for one lane. Used for everything, which is not vectorized
+		void stepLane(int lane, const decoded& inst);
+
+		// Executes instruction for all lanes in mask at once. Returns false, if instruction is not vectorized
+		bool executeVector(word pc, const decoded& inst);
+
+		void execute(word pc);
+
+		// Picks the next PC and sets mask. Returns false, if no lane is active
+		bool schedule(word& pc);
+
+	public:
+		// Same as cpu::isDebug
+		bool isDebug = IS_DEBUG;
+
+		FILE* console = stdout;
+
+		lockstep(int lanes);
+
+		int getLanes() const { return lanes; }
+
+		// Image is shared by all lanes, it must hold MAX_MEM_SIZE bytes. Resets every lane
+		void loadImage(const byte* code);
+
+		void setRegister(int lane, Register reg, word value);
+		word getRegister(int lane, Register reg) const;
+
+		// Bit 0 of address is ignored, as by cpu
+		void writeWord(int lane, word address, word value);
+		word readWord(int lane, word address) const;
+
+		void writeByte(int lane, word address, byte value);
+		byte readByte(int lane, word address) const;
+
+		// Run until every lane halted, faulted or executed 'laneBudget' instructions.
+		// Returns count of instructions executed by all lanes together
+		uint64_t run(uint64_t laneBudget);
+
+		// Same as cpu::getStatus(), lanes stopped by 'laneBudget' are still running
+		status getStatus(int lane) const { return exitStatus[lane]; }
+		bool isHalted(int lane) const { return exitStatus[lane] == status::halted; }
+		int getUnhandledException(int lane) const { return unhandledException[lane]; }
+		uint64_t getRetired(int lane) const { return retired[lane]; }
+	};
+}
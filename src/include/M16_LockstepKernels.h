@@ -0,0 +1,158 @@
+#pragma once
+
+#include "M16_Disasm.h"
+
+namespace m16 {
+	// Vectorized steps of lockstep over register arrays of 'width' words, one set per instruction set.
+	// AVX2 and AVX-512 sets are compiled with their own flags, select() takes the widest one, which CPU runs.
+	// Kernels work on raw arrays only: inline functions of other headers, compiled with AVX flags,
+	// could be picked by the linker for the whole program
+	struct lockstepKernels {
+		const char* name;
+		int lanes;		// Words in vector, 'width' is a multiple of it
+
+		// Executes 'inst' at 'pc' for lanes in 'mask'. Returns false, if the instruction is not vectorized
+		bool (*execute)(word* const* regs, const word* mask, int width, word pc, const decoded& inst);
+
+		// Lowest of 'pcs' of active lanes, 0xffff if there is none. Lanes at it get 0xffff in 'mask', others 0
+		word (*schedule)(const word* pcs, const word* active, word* mask, int width);
+
+		// Mask is 0xffff, so subtracting it from 'pending' counts the instruction
+		void (*count)(word* pending, const word* mask, int width);
+
+		static const lockstepKernels& select();
+	};
+
+	// nullptr, if the set is not compiled in
+	const lockstepKernels* scalarLockstepKernels();
+	const lockstepKernels* avx2LockstepKernels();
+	const lockstepKernels* avx512LockstepKernels();
+
+	// Kernels over vector primitives of 'V', which works on V::LANES words at once
+	template<class V>
+	struct lockstepKernel {
+		using vec = typename V::vec;
+
+		// Lanes in 'm' get 'v', others keep 'old'
+		static vec blend(vec old, vec v, vec m) { return V::bitOr(V::bitAnd(v, m), V::andNot(m, old)); }
+
+		// N, Z, P bits of PSR for every lane
+		static vec flags(vec result) {
+			vec z = V::isZero(result);
+			vec n = V::sar(result, 15);
+			vec p = V::andNot(V::bitOr(z, n), V::set1(0xffff));
+
+			return V::bitOr(V::bitOr(V::bitAnd(n, V::set1(0x4)), V::bitAnd(z, V::set1(0x2))), V::bitAnd(p, V::set1(0x1)));
+		}
+
+		static bool execute(word* const* regs, const word* mask, int width, word pc, const decoded& inst) {
+			// Every lane in mask has the same PC, so PC + 2 and all PC-relative targets are uniform
+			vec nextPC = V::set1(pc + 2);
+			vec imm = V::set1((word)inst.imm);
+
+			switch (inst.op) {
+			case opcode::BR: {
+				vec cc = V::set1(inst.reg1);
+				vec target = V::add(nextPC, imm);
+
+				for (int i = 0; i < width; i += V::LANES) {
+					vec m = V::load(&mask[i]);
+					vec notTaken = V::isZero(V::bitAnd(V::load(&regs[9][i]), cc));
+					vec pcs = blend(target, nextPC, notTaken);
+
+					V::store(&regs[8][i], blend(V::load(&regs[8][i]), pcs, m));
+				}
+
+				return true;
+			}
+			case opcode::JSR: {
+				vec target = V::add(nextPC, imm);
+
+				for (int i = 0; i < width; i += V::LANES) {
+					vec m = V::load(&mask[i]);
+
+					V::store(&regs[7][i], blend(V::load(&regs[7][i]), nextPC, m));
+					V::store(&regs[8][i], blend(V::load(&regs[8][i]), target, m));
+				}
+
+				return true;
+			}
+			case opcode::JMP: {
+				vec aligned = V::set1(0xfffe);
+
+				for (int i = 0; i < width; i += V::LANES) {
+					vec m = V::load(&mask[i]);
+					vec target = V::bitAnd(V::load(&regs[inst.reg2][i]), aligned);
+
+					V::store(&regs[8][i], blend(V::load(&regs[8][i]), target, m));
+				}
+
+				return true;
+			}
+			case opcode::ADD:
+			case opcode::AND:
+			case opcode::MUL:
+			case opcode::NOT:
+			case opcode::LSHF:
+			case opcode::RSHF:
+			case opcode::ARSHF:
+			case opcode::LEA:
+				break;
+			default:
+				return false;
+			}
+
+			for (int i = 0; i < width; i += V::LANES) {
+				vec m = V::load(&mask[i]);
+				vec a = V::load(&regs[inst.reg2][i]);
+				vec b = inst.isImm ? imm : V::load(&regs[inst.reg3][i]);
+				vec result;
+
+				switch (inst.op) {
+				case opcode::ADD: result = V::add(a, b); break;
+				case opcode::AND: result = V::bitAnd(a, b); break;
+				case opcode::MUL: result = V::mul(a, b); break;
+				case opcode::NOT: result = V::andNot(a, V::set1(0xffff)); break;
+				case opcode::LSHF: result = V::shl(a, inst.imm); break;
+				case opcode::RSHF: result = V::shr(a, inst.imm); break;
+				case opcode::ARSHF: result = V::sar(a, inst.imm); break;
+				default: result = V::add(nextPC, imm); break;		// LEA
+				}
+
+				vec psr = V::load(&regs[9][i]);
+				vec flagged = V::bitOr(V::andNot(V::set1(0x7), psr), flags(result));
+
+				V::store(&regs[inst.reg1][i], blend(V::load(&regs[inst.reg1][i]), result, m));
+				V::store(&regs[9][i], blend(psr, flagged, m));
+				V::store(&regs[8][i], blend(V::load(&regs[8][i]), nextPC, m));
+			}
+
+			return true;
+		}
+
+		static word schedule(const word* pcs, const word* active, word* mask, int width) {
+			vec lowest = V::set1(0xffff);
+			for (int i = 0; i < width; i += V::LANES) {
+				lowest = V::min(lowest, blend(V::set1(0xffff), V::load(&pcs[i]), V::load(&active[i])));
+			}
+
+			word pc = V::reduceMin(lowest);
+
+			for (int i = 0; i < width; i += V::LANES) {
+				V::store(&mask[i], V::bitAnd(V::load(&active[i]), V::equal(V::load(&pcs[i]), V::set1(pc))));
+			}
+
+			return pc;
+		}
+
+		static void count(word* pending, const word* mask, int width) {
+			for (int i = 0; i < width; i += V::LANES) {
+				V::store(&pending[i], V::sub(V::load(&pending[i]), V::load(&mask[i])));
+			}
+		}
+
+		static constexpr lockstepKernels make(const char* name) {
+			return { name, V::LANES, &execute, &schedule, &count };
+		}
+	};
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "M16_CPU.h"
+
+namespace m16 {
+	// Multiprocessor MCPU-16 system: several cores sharing one memory.
+	//
+	// In relaxed mode every core runs on its own host thread and cores see stores of each other
+	// in no particular order. In deterministic mode cores run one quantum each in round-robin order
+	// on the calling thread, so every run gives the same result.
+	//
+	// Every core starts at PC 0 with its number in R0.
+	// Inter-processor interrupts are queued and delivered through cpu::sendInterrupt() by the thread
+	// of the target core, before its next quantum. Guests send them with TRAP_IPI.
+	class machine {
+	public:
+		// R0 = target core, R1 = interrupt vector, R2 = level. Bad target is ignored
+		static constexpr byte TRAP_IPI = 0x2c;
+
+		enum class mode {
+			relaxed,
+			deterministic,
+		};
+
+		static constexpr uint64_t DEFAULT_QUANTUM = 1024;
+
+	private:
+		struct interrupt {
+			byte id;
+			int level;
+		};
+
+		struct core {
+			cpu vm;
+
+			std::mutex mailboxLock;
+			std::vector<interrupt> mailbox;
+			std::atomic<bool> hasMail = false;
+
+			core(byte* memory) : vm(memory) {}
+		};
+
+		std::unique_ptr<byte[]> memory;
+		std::vector<std::unique_ptr<core>> cores;
+
+		mode runMode;
+		uint64_t quantum;
+
+		bool isStopped(const core& c) const { return c.vm.debugHalt; }
+
+		void deliverInterrupts(core& c);
+
+		// Runs at most 'count' instructions on core
+		void runQuantum(core& c, uint64_t count);
+
+		// Runs core until it stops or retires 'budget' instructions
+		void runCore(core& c, uint64_t budget);
+
+	public:
+		machine(int coreCount, mode runMode = mode::relaxed, uint64_t quantum = DEFAULT_QUANTUM);
+
+		// Traps of the cores capture 'this'
+		machine(const machine&) = delete;
+		machine& operator=(const machine&) = delete;
+		machine(machine&&) = delete;
+		machine& operator=(machine&&) = delete;
+
+		int getCoreCount() const { return (int)cores.size(); }
+
+		// Core for setup and inspection. Don't touch it while run() is in progress
+		cpu& getCore(int id) { return cores[id]->vm; }
+
+		// Image is copied into shared memory, it must hold MAX_MEM_SIZE bytes
+		void loadImage(const byte* code);
+
+		// Run until every core halted, faulted or retired 'budget' instructions in this call.
+		// Returns count of instructions retired by all cores together
+		uint64_t run(uint64_t budget);
+
+		// Inter-processor interrupt. Can be called from any thread, including cores during run()
+		void sendInterrupt(int target, byte id, int level);
+
+		bool isHalted(int id) const { return cores[id]->vm.getStatus() == status::halted; }
+		bool isFaulted(int id) const { return isFault(cores[id]->vm.getStatus()); }
+		uint64_t getRetired(int id) const { return cores[id]->vm.retired; }
+	};
+}
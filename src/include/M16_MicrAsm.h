@@ -1,13 +1,26 @@
 #pragma once
 
-#include "M16_Common.h"
+#include "M16_DebugInfo.h"
+#include "M16_Layout.h"
+#include "M16_Preprocessor.h"
 
 namespace m16 {
 	class micrasm_error : public std::runtime_error {
 	public:
 		micrasm_error(std::string message) : std::runtime_error(message) {}
 
-		static micrasm_error generr(const char* fmt, ...);
+		static micrasm_error generr(const char* fmt, ...)
+#if defined(__GNUC__)
+			__attribute__((format(printf, 1, 2)))
+#endif
+			;
+	};
+
+	// Error of assemble(). Message starts with "line N: " for the source itself and with "<path>:N: "
+	// for an included file, 'line' is N, the line in that file
+	struct diagnostic {
+		int line;
+		std::string message;
 	};
 
 	class micrasm {
@@ -33,12 +46,46 @@ namespace m16 {
 		word PC = 0;
 		int line = 1;
 		bool lineHasLabelDecl = false;
-		bool panicMode = false;
+		bool panicMode = false;				// After an error: the rest of the line is skipped
+
+		int errorLimit = 0;
+		std::vector<diagnostic> diagnostics;
 
 		const char* start;
 		const char* current;
 
-		void emitWord(word val);
+		// Statements for block layout, recorded by assemble(source, counts) only
+		bool isRecording = false;
+		std::vector<sourceStatement> statements;
+		std::vector<std::string> pendingLabels;
+		std::string lastReference;
+		int lastReferenceBits = 0;
+
+		layoutStats layout;
+
+		std::string sourceName;
+		debugInfo debug;
+
+		// Set, if the source was preprocessed: lines of the assembled text in the original files
+		std::vector<sourceLocation> lineMap;
+		std::vector<std::string> fileNames;
+		std::string expanded;
+
+		sourceCache ownIncludes;
+		sourceCache* includes = &ownIncludes;
+		std::vector<std::string> includePaths;
+
+		// Throws, kept out of line, so accessors stay small
+		void outOfMemory(word at);
+
+		void checkWord(word at) {
+			if ((size_t)at + 2 > MAX_MEM_SIZE) [[unlikely]] outOfMemory(at);
+		}
+
+		void emitWord(word val) {
+			writeWord(PC, val);
+			PC += 2;
+		}
 
 		bool isAlpha(char c) {
 			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
@@ -50,8 +97,16 @@ namespace m16 {
 
 		bool isAlphaOrDigit(char c) { return isAlpha(c) || isDigit(c); }
 
-		word readWord(word at);
-		void writeWord(word at, word v);
+		word readWord(word at) {
+			checkWord(at);
+			return (code[at] << 8) | code[at + 1];
+		}
+
+		void writeWord(word at, word v) {
+			checkWord(at);
+			code[at] = v >> 8;
+			code[at + 1] = v & 0xff;
+		}
 
 		char peekChar();
 		char peekNextChar();
@@ -101,9 +156,53 @@ namespace m16 {
 		// This function is called after assembly process to resolve labels
 		void codeFinalize();
 
+		// Throws, if errors are not collected. Returns false, when the limit is reached
+		bool report(int line, const std::string& message);
+		void skipLine();
+
+		sourceLocation locate(int line);
+
+		// Runs preprocessor, if 'source' has its directives. Returns false on error, if errors are collected
+		bool preprocess(const char* source);
+		void assembleText(const char* source);
+
 	public:
+		~micrasm() {
+			delete[] code;
+		}
+
+		// Throws micrasm_error at the first error, unless there is an error limit
 		void assemble(const char* source);
 
+		// Positive limit: assemble() collects errors into getDiagnostics(), skipping the rest of the line with an error,
+		// and stops after 'limit' errors. 0 (default) throws at the first one. Program with errors is not complete
+		void setErrorLimit(int limit) { errorLimit = limit; }
+
+		// Errors of the last assemble() in source order, except unresolved labels, which go last
+		const std::vector<diagnostic>& getDiagnostics() { return diagnostics; }
+
+		// Assembles 'source', then moves its basic blocks by execution counts of the same program, see blockLayout,
+		// and assembles the result. Addresses in 'counts' are addresses of 'source' as it is
+		void assemble(const char* source, const profile& counts);
+
+		// What the last assemble(source, counts) changed
+		const layoutStats& getLayoutStats() { return layout; }
+
+		// File name of the line table and of errors, empty by default. Relative includes start from its directory
+		void setSourceName(const std::string& name) { sourceName = name; }
+
+		// Directories for .include, searched after the directory of the including file
+		void addIncludePath(const std::string& dir) { includePaths.push_back(dir); }
+
+		// Included files are kept between assemble() calls in 'cache', which may be shared by many assemblers.
+		// nullptr means the own cache
+		void setSourceCache(sourceCache* cache) { includes = cache != nullptr ? cache : &ownIncludes; }
+
+		// Lines and labels of the last assembled source
+		const debugInfo& getDebugInfo() { return debug; }
+
 		byte* getCode();
+
+		const std::unordered_map<std::string, word>& getLabels();
 	};
 }
\ No newline at end of file
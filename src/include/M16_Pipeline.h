@@ -0,0 +1,109 @@
+#pragma once
+
+#include "M16_Disasm.h"
+
+namespace m16 {
+	// Prediction of conditional branches. Branches, which are predicted taken, and direct jumps
+	// redirect fetch from ID, everything else is resolved in EX
+	enum class predictor : byte {
+		notTaken,
+		backwardTaken,		// Backward branches are taken, forward ones are not (loops)
+		twoBit,				// Saturating counters indexed by address of branch
+	};
+
+	// Why instruction entered EX later than right after the previous one
+	enum class stall : byte {
+		data,			// Register written by ALU instruction is not forwarded yet
+		loadUse,		// Register is loaded by the previous instruction
+		flags,			// BR waits for flags of setFlags()
+		execute,		// EX is busy with MUL, DIV or MOD
+		control,		// Bubble after taken jump or predicted-taken branch
+		mispredict,		// Branch resolved in EX against prediction
+		exception,		// Pipeline flushed by exception or interrupt
+		fetch,			// Instruction cache miss
+		memory,			// Data cache miss
+	};
+
+	constexpr int STALL_COUNT = (int)stall::memory + 1;
+
+	const char* stallName(stall s);
+
+	struct pipelineConfig {
+		bool exForwarding = true;		// EX/MEM -> EX: ALU result to the next instruction
+		bool memForwarding = true;		// MEM/WB -> EX: load result, or ALU result two instructions later
+		predictor prediction = predictor::twoBit;
+		int predictorBits = 10;			// Table of 1 << predictorBits counters
+		int mulLatency = 3;				// Cycles in EX
+		int divLatency = 12;
+	};
+
+	// Timing model of in-order 5-stage core (IF, ID, EX, MEM, WB), one instruction per cycle.
+	//
+	// cpu executes instructions as usual and reports every one of them, attached by cpu::attachPipeline().
+	// The model computes, when each instruction enters EX: after the previous one, after its operands
+	// can be forwarded or read from register file, and after fetch redirects. Every cycle of delay is
+	// accounted to the stall, which caused it. Misses of attached caches stall IF and MEM.
+	class pipeline {
+	public:
+		struct stats {
+			uint64_t instructions = 0;
+			uint64_t cycles = 0;
+			uint64_t stalls[STALL_COUNT] = {};
+
+			uint64_t branches = 0;			// Conditional only
+			uint64_t mispredictions = 0;
+
+			uint64_t exForwards = 0;		// Operands, which came through each path
+			uint64_t memForwards = 0;
+
+			double cpi() const { return instructions == 0 ? 0 : (double)cycles / instructions; }
+		};
+
+	private:
+		// Last producer of register or flags
+		struct result {
+			uint64_t cycle = 0;		// Last cycle in EX, for loads the cycle in MEM
+			bool isLoad = false;
+		};
+
+		pipelineConfig config;
+
+		result registers[8];
+		result flags;
+
+		std::vector<byte> history;		// 2-bit counters, 0 and 1 predict not taken
+
+		uint64_t lastEx;				// EX cycle of the previous instruction
+		uint64_t nextEx;				// The earliest EX cycle of the next one and why
+		stall nextCause;
+		word expectedPc = 0;
+
+		stats counters;
+
+		// Delays 'ex' until the operand can be read or forwarded, 'early' cycles before EX (store data is needed in MEM)
+		bool waitFor(const result& r, uint64_t& ex, int early) const;
+
+		// Counts forwarding path, which delivered the operand at 'ex'
+		void countForward(const result& r, uint64_t ex, int early);
+
+		void delayNext(uint64_t cycle, stall cause);
+
+		bool predict(word pc, int16_t offset) const;
+		void train(word pc, bool isTaken);
+
+	public:
+		pipeline(const pipelineConfig& config = pipelineConfig());
+
+		// Instruction at 'pc' was executed, cpu continues at 'nextPc'. Cycles of cache misses, if there are caches
+		void retire(word pc, const decoded& inst, word nextPc, word psr, int fetchStall, int memoryStall);
+
+		// Empty pipeline, counters cleared, predictor reset
+		void reset();
+
+		const pipelineConfig& getConfig() const { return config; }
+		const stats& getStats() const { return counters; }
+
+		// CPI broken down by stall cause, forwarding and prediction
+		void report(FILE* out) const;
+	};
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <string_view>
+
+#include "M16_Common.h"
+
+namespace m16 {
+	// Line of a source file, file 0 is the assembled source
+	struct sourceLocation {
+		int file = 0;
+		int line = 0;
+	};
+
+	struct token {
+		enum class kind : byte {
+			identifier,		// Also directives and numbers like x1f
+			number,			// #-12, 42
+			string,			// With quotes
+			punct,
+		};
+
+		kind type;
+		bool isSpaced;		// Whitespace before it
+		std::string_view text;
+	};
+
+	// Line with tokens, without comment
+	struct tokenLine {
+		int line;
+		std::vector<token> tokens;
+	};
+
+	// Non-empty lines of 'text'. Tokens point into it
+	std::vector<tokenLine> tokenize(const char* text, size_t size);
+
+	// Included files by path. Every file is memory-mapped and tokenized once, and again only if it changed on disk.
+	// Tokens point into the mapping, so they stay valid while the cache holds the file
+	class sourceCache {
+	private:
+		struct file;
+
+		std::unordered_map<std::string, std::unique_ptr<file>> files;
+		unsigned pass = 0;
+
+	public:
+		sourceCache();
+		~sourceCache();
+
+		// Files are checked for changes once per pass
+		void beginPass() { pass++; }
+
+		// Returns nullptr, if the file can't be read
+		const std::vector<tokenLine>* get(const std::string& path);
+	};
+
+	// Stage before micrasm, which expands
+	//     .include "file"					relative to the including file, then to include paths
+	//     .macro name [param[, param...]]	until .endm, invoked as 'name arg, ...'
+	//     .equ name value
+	//     .if value [==|!=|<|<=|>|>= value], .ifdef name, .ifndef name, .else, .endif
+	//
+	// Works on tokens: macro bodies stay tokenized, parameters and constants replace whole identifiers,
+	// never parts of names or strings. Labels declared in a macro get a suffix unique for every expansion.
+	// Output is plain source for micrasm and location of its every line, lines of macros are at the invocation
+	class preprocessor {
+	private:
+		static constexpr int MAX_INCLUDE_DEPTH = 32;
+		static constexpr int MAX_MACRO_DEPTH = 64;
+		static constexpr size_t MAX_OUTPUT_SIZE = 16 << 20;
+		static constexpr size_t MAX_PROCESSED_LINES = 4 << 20;		// Macros that emit nothing don't grow the output
+
+		struct macro {
+			std::vector<std::string_view> params;
+			std::vector<tokenLine> body;
+			std::vector<std::string_view> labels;		// Declared in the body
+			sourceLocation definedAt;
+		};
+
+		struct condition {
+			bool isActive;
+			bool isTaken;			// Some branch was active
+			bool isParentActive;
+			bool hasElse;
+			sourceLocation at;
+		};
+
+		sourceCache& includes;
+		const std::vector<std::string>& includePaths;
+
+		std::string output;
+		std::vector<sourceLocation> lines;
+		std::vector<std::string> files;
+		std::vector<int> includeStack;
+
+		std::unordered_map<std::string_view, macro> macros;
+		std::unordered_map<std::string_view, std::vector<token>> constants;
+		macro* defining = nullptr;
+		std::vector<condition> conditions;
+
+		std::deque<std::string> names;		// Generated labels, tokens point here
+		int expansions = 0;
+		size_t processed = 0;		// Lines, those of macros once per expansion
+
+		mutable sourceLocation errorAt;
+
+		[[noreturn]] void fail(const sourceLocation& at, const char* fmt, ...) const
+#if defined(__GNUC__)
+			__attribute__((format(printf, 3, 4)))
+#endif
+			;
+
+		bool isActive() const { return conditions.empty() || conditions.back().isActive; }
+
+		void processFile(const std::vector<tokenLine>& source, int file);
+		void processLine(const std::vector<token>& tokens, const sourceLocation& at, int depth);
+
+		void include(const token& name, const sourceLocation& at);
+		void define(const std::vector<token>& tokens, size_t first, const sourceLocation& at);
+		void expand(const macro& m, const std::vector<token>& tokens, size_t first, const sourceLocation& at, int depth);
+
+		// Constants replaced
+		std::vector<token> substitute(const std::vector<token>& tokens, size_t first) const;
+
+		bool evaluate(const std::vector<token>& tokens, size_t first, const sourceLocation& at) const;
+		int valueOf(const token& t, const sourceLocation& at) const;
+
+		void emit(const std::vector<token>& tokens, size_t first, size_t last, const sourceLocation& at);
+
+	public:
+		preprocessor(sourceCache& includes, const std::vector<std::string>& includePaths) : includes(includes), includePaths(includePaths) {}
+
+		// Cheap check for directives of the preprocessor. Source without them needs no preprocessing
+		static bool isNeeded(const char* source);
+
+		// Throws micrasm_error "line N: message" for the source itself, "<file>:<line>: message" for included files
+		std::string process(const char* source, const std::string& name);
+
+		// Line 'n' of the output came from getLines()[n], n >= 1
+		const std::vector<sourceLocation>& getLines() const { return lines; }
+		const std::vector<std::string>& getFiles() const { return files; }
+
+		// Where process() failed
+		const sourceLocation& getErrorLocation() const { return errorAt; }
+
+		static std::string describe(const std::vector<std::string>& files, const sourceLocation& at);
+	};
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "M16_CPU.h"
+
+namespace m16 {
+	class debugInfo;
+
+	// Execution profile of run(): how many times every instruction was executed and which way
+	// every conditional branch went. Attached by cpu::attachProfile(), counting costs one increment
+	// per instruction and a few more per branch.
+	//
+	// Every branch site also has its own 2-bit counter, so accuracy of the best dynamic predictor
+	// without aliasing can be compared with static prediction.
+	class profile {
+	public:
+		struct branchSite {
+			word address = 0;
+			uint64_t taken = 0;
+			uint64_t notTaken = 0;
+			uint64_t mispredictions = 0;		// By 2-bit counter of the site
+
+			uint64_t executions() const { return taken + notTaken; }
+
+			// Share of the more frequent direction, 0.5 - 1
+			double bias() const { return executions() == 0 ? 0 : (double)(taken > notTaken ? taken : notTaken) / executions(); }
+		};
+
+	private:
+		// Indexed by address / 2
+		std::vector<uint64_t> executions;
+		std::vector<uint64_t> takenCounts;
+		std::vector<uint64_t> notTakenCounts;
+		std::vector<uint64_t> mispredictions;
+		std::vector<byte> history;
+
+	public:
+		profile();
+
+		void execute(word pc) {
+			executions[pc >> 1]++;
+		}
+
+		void branch(word pc, bool isTaken) {
+			int site = pc >> 1;
+			byte& counter = history[site];
+
+			if (isTaken) {
+				takenCounts[site]++;
+				if (counter < 2) mispredictions[site]++;
+				if (counter < 3) counter++;
+			} else {
+				notTakenCounts[site]++;
+				if (counter >= 2) mispredictions[site]++;
+				if (counter > 0) counter--;
+			}
+		}
+
+		void reset();
+
+		uint64_t getExecutions(word pc) const { return executions[pc >> 1]; }
+		uint64_t getTaken(word pc) const { return takenCounts[pc >> 1]; }
+		uint64_t getNotTaken(word pc) const { return notTakenCounts[pc >> 1]; }
+
+		// Conditional branches, which were executed, by address
+		std::vector<branchSite> getBranches() const;
+
+		// Accuracy of predictors over all branches, then 'count' hottest branches with their bias.
+		// Forward branches, which are mostly taken, are marked: hot path would fall through, if the condition was inverted.
+		// Source lines of branches are shown, if there is a line table
+		void report(FILE* out, cpu& vm, const std::unordered_map<std::string, word>& labels, int count = 10, const debugInfo* lines = nullptr) const;
+
+		// Text export for tools, which lay out code by profile:
+		//     m16-profile 1
+		//     count <address> <executions>				every executed instruction
+		//     branch <address> <taken> <not taken>		every executed conditional branch
+		// Addresses are hexadecimal, lines may end with '; <label+offset>'. Returns false, if the file can't be written
+		bool save(const char* path, const std::unordered_map<std::string, word>& labels) const;
+
+		// Reads counts written by save(), mispredictions are not restored. Returns false and keeps
+		// counters cleared, if the file can't be read or is not a profile
+		bool load(const char* path);
+	};
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+#include "M16_CPU.h"
+
+namespace m16 {
+	// M:N scheduler: many independent cpu instances time-sliced on a fixed pool of host threads.
+	//
+	// Every instance runs by quanta of the same number of instructions, until it stops or hits
+	// one of its limits. Instances don't share memory, so final state of each of them does not
+	// depend on the number of threads or on the order of quanta (except for time limit).
+	//
+	// Every thread has its own queue of instances, idle threads steal from the others.
+	class scheduler {
+	public:
+		static constexpr uint64_t DEFAULT_QUANTUM = 4096;
+
+		struct stats {
+			uint64_t instructions = 0;
+			uint64_t cycles = 0;
+			uint64_t quanta = 0;
+			double seconds = 0;			// Host time spent in quanta of this instance
+			status state = status::running;
+		};
+
+	private:
+		struct instance {
+			cpu* vm;
+			limits lim;
+			stats accounting;
+		};
+
+		struct queue {
+			std::mutex lock;
+			std::deque<int> ids;
+		};
+
+		std::vector<instance> instances;
+
+		int threadCount;
+		uint64_t quantum;
+
+		std::vector<std::unique_ptr<queue>> queues;
+		std::atomic<int> unfinished = 0;
+
+		// Own queue first, then steal from the back of others. Returns -1, if every queue is empty
+		int take(int thread);
+
+		// Returns false, if instance is done
+		bool runQuantum(instance& inst);
+
+		void worker(int thread);
+
+	public:
+		scheduler(int threadCount, uint64_t quantum = DEFAULT_QUANTUM);
+
+		// Instance is not owned by scheduler, limits are for the whole run. Returns its id
+		int add(cpu* vm, const limits& lim);
+
+		// Run every instance to the end
+		void run();
+
+		int getInstanceCount() const { return (int)instances.size(); }
+		const stats& getStats(int id) const { return instances[id].accounting; }
+	};
+}
@@ -1,54 +1,432 @@
-#include <iostream>
-#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
 
-#include "include/M16.h"
+#include "include/M16_C.h"
 
-int main(int argc, const char* argv[]) {
-	if (argc > 2 || argc <= 1) {
-		printf("Usage: m16 [assembly]");
-		getchar();
-		exit(64);
+// Exit codes. Batch run exits with the highest code of its files
+constexpr int EXIT_HALTED = 0;
+constexpr int EXIT_FAULT = 1;			// Unaligned access or unhandled exception
+constexpr int EXIT_LIMIT = 2;			// Instruction or time limit exceeded
+constexpr int EXIT_USAGE = 64;
+constexpr int EXIT_BAD_INPUT = 65;		// Assembly error or image too large
+constexpr int EXIT_NO_INPUT = 66;
+
+enum class format {
+	automatic,		// By extension: .bin and .img are images, anything else is micrasm source
+	assembly,
+	image,
+};
+
+struct options {
+	bool isQuiet = false;
+	bool isJson = false;
+	bool dumpMemory = false;
+	bool pause = false;
+	bool isDecoded = true;
+	bool isCached = false;
+	bool isPipelined = false;
+	bool isForwarding = true;
+	bool isProfiled = false;
+	const char* profilePath = nullptr;
+	const char* layoutPath = nullptr;
+	const char* imagePath = nullptr;
+	m16_predictor prediction = M16_PREDICT_TWO_BIT;
+	uint64_t instructions = 0;
+	int maxErrors = 20;
+	double seconds = 60;
+	format inputFormat = format::automatic;
+	std::vector<const char*> files;
+	std::vector<const char*> includePaths;
+
+	// Zero size means no cache at the level
+	m16_cache_config l1i = { 4096, 2, 16, M16_WRITE_BACK };
+	m16_cache_config l1d = { 4096, 4, 16, M16_WRITE_BACK };
+	m16_cache_config l2 = { 0, 1, 16, M16_WRITE_BACK };
+};
+
+static void usage() {
+	fprintf(stderr,
+		"Usage: m16 [options] <file>...\n"
+		"  -q, --quiet            print only guest output and errors\n"
+		"  --json                 print one JSON object per file, guest output included\n"
+		"  --limit <count>        stop after <count> instructions (default: no limit)\n"
+		"  --time <seconds>       stop after <seconds>, 0 for no limit (default: 60)\n"
+		"  --engine <name>        'decoded' (default) or 'reference'\n"
+		"  --format <name>        'asm' or 'bin' (default: by extension, .bin and .img are images)\n"
+		"  --cache                simulate caches and print cache report\n"
+		"  --l1i, --l1d, --l2 <size>[:<ways>[:<line>[:wb|wt]]]\n"
+		"                         configure cache level, implies --cache, size 0 for none\n"
+		"                         (default: --l1i 4k:2:16 --l1d 4k:4:16:wb --l2 0)\n"
+		"  --pipeline <predictor> model 5-stage pipeline and print CPI breakdown,\n"
+		"                         predictor 'not-taken', 'backward-taken' or '2bit'\n"
+		"  --no-forwarding        pipeline without forwarding paths\n"
+		"  --branches             count branch directions and print hot-branch report\n"
+		"  --profile <file>       save execution and branch counts to <file>, see README\n"
+		"  --layout <file>        lay basic blocks out by profile <file> of the same source\n"
+		"  --save-image <file>    save loaded program to <file> with source lines and labels\n"
+		"  --max-errors <count>   stop assembling after <count> errors, 0 for no limit (default: 20)\n"
+		"  -I <dir>               look for .include files in <dir> too\n"
+		"  --dump-memory          print memory dump before run\n"
+		"  --pause                wait for a key before exit\n"
+		"Exit code: 0 - halted, 1 - guest fault, 2 - limit exceeded, 64 - usage, 65 - bad input, 66 - no input\n");
+}
+
+// E.g. "8k:4:32:wt"
+static bool parseCache(const char* spec, m16_cache_config& config) {
+	char* end;
+	config = { (uint32_t)strtoul(spec, &end, 10), 1, 16, M16_WRITE_BACK };
+
+	if (*end == 'k' || *end == 'K') {
+		config.size *= 1024;
+		end++;
+	}
+
+	if (*end == ':') config.ways = (uint32_t)strtoul(end + 1, &end, 10);
+	if (*end == ':') config.line_size = (uint32_t)strtoul(end + 1, &end, 10);
+
+	if (*end == ':') {
+		if (strcmp(end + 1, "wb") == 0) config.policy = M16_WRITE_BACK;
+		else if (strcmp(end + 1, "wt") == 0) config.policy = M16_WRITE_THROUGH;
+		else return false;
+
+		return true;
 	}
 
-	m16::cpu* vm = new m16::cpu();
+	return *end == '\0';
+}
+
+static bool parseOptions(int argc, const char* argv[], options& opts) {
+	for (int i = 1; i < argc; i++) {
+		const char* arg = argv[i];
+		bool hasValue = i + 1 < argc;
+
+		if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) opts.isQuiet = true;
+		else if (strcmp(arg, "--json") == 0) opts.isJson = true;
+		else if (strcmp(arg, "--dump-memory") == 0) opts.dumpMemory = true;
+		else if (strcmp(arg, "--pause") == 0) opts.pause = true;
+		else if (strcmp(arg, "--cache") == 0) opts.isCached = true;
+		else if (strcmp(arg, "--no-forwarding") == 0) opts.isForwarding = false;
+		else if (strcmp(arg, "--branches") == 0) opts.isProfiled = true;
+		else if (strcmp(arg, "--profile") == 0 && hasValue) opts.profilePath = argv[++i];
+		else if (strcmp(arg, "--layout") == 0 && hasValue) opts.layoutPath = argv[++i];
+		else if (strcmp(arg, "--save-image") == 0 && hasValue) opts.imagePath = argv[++i];
+		else if (strcmp(arg, "--max-errors") == 0 && hasValue) opts.maxErrors = atoi(argv[++i]);
+		else if (strcmp(arg, "-I") == 0 && hasValue) opts.includePaths.push_back(argv[++i]);
+		else if (strcmp(arg, "--pipeline") == 0 && hasValue) {
+			const char* name = argv[++i];
+
+			if (strcmp(name, "not-taken") == 0) opts.prediction = M16_PREDICT_NOT_TAKEN;
+			else if (strcmp(name, "backward-taken") == 0) opts.prediction = M16_PREDICT_BACKWARD_TAKEN;
+			else if (strcmp(name, "2bit") == 0) opts.prediction = M16_PREDICT_TWO_BIT;
+			else return false;
+
+			opts.isPipelined = true;
+		}
+		else if (strcmp(arg, "--l1i") == 0 && hasValue) {
+			if (!parseCache(argv[++i], opts.l1i)) return false;
+			opts.isCached = true;
+		} else if (strcmp(arg, "--l1d") == 0 && hasValue) {
+			if (!parseCache(argv[++i], opts.l1d)) return false;
+			opts.isCached = true;
+		} else if (strcmp(arg, "--l2") == 0 && hasValue) {
+			if (!parseCache(argv[++i], opts.l2)) return false;
+			opts.isCached = true;
+		}
+		else if (strcmp(arg, "--limit") == 0 && hasValue) opts.instructions = strtoull(argv[++i], nullptr, 10);
+		else if (strcmp(arg, "--time") == 0 && hasValue) opts.seconds = atof(argv[++i]);
+		else if (strcmp(arg, "--engine") == 0 && hasValue) {
+			const char* name = argv[++i];
 
-	m16::micrasm assembly;
+			if (strcmp(name, "decoded") == 0) opts.isDecoded = true;
+			else if (strcmp(name, "reference") == 0) opts.isDecoded = false;
+			else return false;
+		} else if (strcmp(arg, "--format") == 0 && hasValue) {
+			const char* name = argv[++i];
 
-	FILE* file;
-	fopen_s(&file, argv[1], "rb");
+			if (strcmp(name, "asm") == 0) opts.inputFormat = format::assembly;
+			else if (strcmp(name, "bin") == 0) opts.inputFormat = format::image;
+			else return false;
+		} else if (arg[0] == '-') return false;
+		else opts.files.push_back(arg);
+	}
+
+	return !opts.files.empty();
+}
 
-	fseek(file, 0L, SEEK_END);
-	size_t fileSize = ftell(file);
-	rewind(file);
+static bool readFile(const char* path, std::string& data) {
+	FILE* file = fopen(path, "rb");
+	if (file == nullptr) return false;
 
-	char* src = new char[fileSize + 1];
-	size_t bytesRead = fread(src, sizeof(char), fileSize, file);
-	src[bytesRead] = '\0';
+	char buf[4096];
+	size_t bytesRead;
+	while ((bytesRead = fread(buf, 1, sizeof(buf), file)) > 0) data.append(buf, bytesRead);
 
 	fclose(file);
+	return true;
+}
+
+static bool isImage(const char* path, format inputFormat) {
+	if (inputFormat != format::automatic) return inputFormat == format::image;
+
+	const char* ext = strrchr(path, '.');
+	return ext != nullptr && (strcmp(ext, ".bin") == 0 || strcmp(ext, ".img") == 0);
+}
+
+static int exitCodeOf(m16_status status) {
+	switch (status) {
+	case M16_HALTED: return EXIT_HALTED;
+	case M16_RUNNING:
+	case M16_INSTRUCTION_LIMIT:
+	case M16_CYCLE_LIMIT:
+	case M16_TIME_LIMIT: return EXIT_LIMIT;
+	default: return EXIT_FAULT;
+	}
+}
+
+static std::string jsonString(const std::string& text) {
+	std::string out = "\"";
+
+	for (char c : text) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		} else {
+			out += c;
+		}
+	}
+
+	return out + "\"";
+}
+
+// Same format as cpu::dumpMem(): non-empty lines only
+static void dumpMem(m16_vm* vm) {
+	printf("*** <Memory dump>\n");
+	bool previousIsEmpty = false;
+
+	for (int line = 0; line < 0x10000; line += 16) {
+		uint8_t bytes[16];
+		m16_read_memory(vm, (uint16_t)line, bytes, sizeof(bytes));
+
+		bool isEmpty = true;
+		for (int i = 0; i < 16; i++) isEmpty &= bytes[i] == 0;
+
+		if (previousIsEmpty && !isEmpty) printf("...\n");
+
+		previousIsEmpty = isEmpty;
+		if (isEmpty) continue;
 
-	try {
-		assembly.assemble(src);
-	} catch (m16::micrasm_error e) {
-		printf("[ERROR] - %s\n", e.what());
-		return -1;
+		printf("%04x: ", line);
+		for (int i = 0; i < 16; i++) printf("%02x ", bytes[i]);
+
+		printf("| ");
+		for (int i = 0; i < 16; i++) printf("%c", bytes[i] >= 32 ? bytes[i] : '.');
+
+		printf("\n");
+	}
+}
+
+// Same format as cpu::printRegs()
+static void printRegs(m16_vm* vm) {
+	uint16_t r[10];
+	for (int i = 0; i < 10; i++) r[i] = m16_get_register(vm, (m16_register)i);
+
+	printf("*** <Registers dump>\n");
+
+	printf("General purpose registers:\n");
+	for (int i = 0; i < 4; i++) {
+		printf("R%d = 0x%04x : %-6d | R%d = 0x%04x : %d\n", i, r[i], (int16_t)r[i], i + 4, r[i + 4], (int16_t)r[i + 4]);
 	}
 
-	delete[] src;
+	printf("\nControl registers:\n");
+	printf("PC  = 0x%04x\n", r[M16_PC]);
+	printf("PSR = 0x%04x(n = %s, ", r[M16_PSR], r[M16_PSR] & 0x4 ? "true" : "false");
+	printf("z = %s, ", r[M16_PSR] & 0x2 ? "true" : "false");
+	printf("p = %s)\n***\n", r[M16_PSR] & 0x1 ? "true" : "false");
+}
+
+static void reportError(const options& opts, const char* path, const char* message) {
+	if (opts.isJson) printf("{ \"file\": %s, \"error\": %s }\n", jsonString(path).c_str(), jsonString(message).c_str());
+	else fprintf(stderr, "[ERROR] - %s: %s\n", path, message);
+}
+
+static void collectOutput(const char* text, size_t size, void* user) {
+	((std::string*)user)->append(text, size);
+}
 
-	//vm->loadImage(assembly.getCode());
-	vm->loadImage(assembly.getCode());
+static void collectDiagnostic(int, const char* message, void* user) {
+	((std::vector<std::string>*)user)->push_back(message);
+}
+
+static int runFile(const options& opts, const char* path) {
+	std::string input;
+	if (!readFile(path, input)) {
+		reportError(opts, path, "can't open file");
+		return EXIT_NO_INPUT;
+	}
 
-	vm->dumpMem();
-	
-	while (!vm->debugHalt) {
-		vm->process();
+	m16_vm* vm = m16_create();
+	if (vm == nullptr) {
+		reportError(opts, path, "out of memory");
+		return EXIT_BAD_INPUT;
 	}
 
-	vm->printRegs();
+	std::string output;
+	if (opts.isJson) m16_set_output(vm, collectOutput, &output);
+
+	// Engine goes first, so loading decodes the image once
+	m16_use_decoded(vm, opts.isDecoded);
+
+	char error[512] = "";
+	bool isLoaded;
+
+	// Reports show lines as <file>:<line>, includes are relative to the file
+	m16_set_source_name(vm, path);
+	for (const char* dir : opts.includePaths) m16_add_include_path(vm, dir);
+
+	if (isImage(path, opts.inputFormat)) {
+		isLoaded = m16_load_image(vm, (const uint8_t*)input.data(), input.size()) == 0;
+		if (!isLoaded) snprintf(error, sizeof(error), "image is larger than 64 KiB");
+	} else if (opts.layoutPath != nullptr) {
+		m16_layout_stats layout;
+		isLoaded = m16_assemble_with_profile(vm, input.c_str(), opts.layoutPath, &layout, error, sizeof(error)) == 0;
+
+		if (isLoaded && !opts.isQuiet && !opts.isJson) {
+			printf("Layout: %d of %d regions, %d of %d blocks moved, %d branches inverted, %d added, %d removed\n",
+				layout.laid_out, layout.regions, layout.moved_blocks, layout.blocks,
+				layout.inverted_branches, layout.added_branches, layout.removed_branches);
+		}
+	} else {
+		std::vector<std::string> diagnostics;
+		isLoaded = m16_assemble_report(vm, input.c_str(), opts.maxErrors, collectDiagnostic, &diagnostics) == 0;
+
+		if (!isLoaded) {
+			// JSON output gets all errors in one message
+			std::string message;
+			for (size_t i = 0; i < diagnostics.size(); i++) {
+				if (opts.isJson) message += (i > 0 ? "\n" : "") + diagnostics[i];
+				else reportError(opts, path, diagnostics[i].c_str());
+			}
+
+			if (opts.isJson) reportError(opts, path, message.c_str());
+
+			m16_destroy(vm);
+			return EXIT_BAD_INPUT;
+		}
+	}
+
+	if (!isLoaded) {
+		reportError(opts, path, error);
+		m16_destroy(vm);
+		return EXIT_BAD_INPUT;
+	}
+
+	if (opts.imagePath != nullptr && m16_save_image(vm, opts.imagePath, 1) != 0) {
+		fprintf(stderr, "[ERROR] - %s: can't write image %s\n", path, opts.imagePath);
+	}
+
+	if (opts.isCached) {
+		const m16_cache_config* l1i = opts.l1i.size != 0 ? &opts.l1i : nullptr;
+		const m16_cache_config* l1d = opts.l1d.size != 0 ? &opts.l1d : nullptr;
+		const m16_cache_config* l2 = opts.l2.size != 0 ? &opts.l2 : nullptr;
+
+		if (m16_set_caches(vm, l1i, l1d, l2) != 0) {
+			reportError(opts, path, "invalid cache configuration");
+			m16_destroy(vm);
+			return EXIT_USAGE;
+		}
+	}
+
+	if ((opts.isPipelined && m16_set_pipeline(vm, opts.prediction, opts.isForwarding) != 0) ||
+		((opts.isProfiled || opts.profilePath != nullptr) && m16_enable_profile(vm) != 0)) {
+		reportError(opts, path, "out of memory");
+		m16_destroy(vm);
+		return EXIT_BAD_INPUT;
+	}
+
+	if (opts.dumpMemory && !opts.isQuiet && !opts.isJson) dumpMem(vm);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	m16_status status = m16_run_limits(vm, opts.instructions, 0, opts.seconds);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	if (opts.profilePath != nullptr && m16_save_profile(vm, opts.profilePath) != 0) {
+		// Not through reportError(), JSON output has one object per file
+		fprintf(stderr, "[ERROR] - %s: can't write profile %s\n", path, opts.profilePath);
+	}
+
+	if (opts.isJson) {
+		printf("{ \"file\": %s, \"status\": %s, \"exit_code\": %d, \"instructions\": %llu, \"cycles\": %llu, \"seconds\": %.6f, \"registers\": [",
+			jsonString(path).c_str(), jsonString(m16_status_name(status)).c_str(), exitCodeOf(status),
+			(unsigned long long)m16_get_retired(vm), (unsigned long long)m16_get_cycles(vm), seconds);
+
+		for (int r = 0; r < 10; r++) printf("%s%u", r ? ", " : "", m16_get_register(vm, (m16_register)r));
+
+		printf("], ");
+
+		if (opts.isCached) {
+			static const char* LEVELS[] = { "l1i", "l1d", "l2" };
+			bool isFirst = true;
+
+			printf("\"caches\": [");
+			for (int level = M16_L1I; level <= M16_L2; level++) {
+				m16_cache_stats stats;
+				if (m16_get_cache_stats(vm, (m16_cache_level)level, &stats) != 0) continue;
+
+				printf("%s{ \"level\": \"%s\", \"accesses\": %llu, \"misses\": %llu, \"write_backs\": %llu }", isFirst ? "" : ", ", LEVELS[level],
+					(unsigned long long)stats.accesses, (unsigned long long)stats.misses, (unsigned long long)stats.write_backs);
+				isFirst = false;
+			}
+			printf("], ");
+		}
+
+		m16_pipeline_stats timing;
+		if (m16_get_pipeline_stats(vm, &timing) == 0) {
+			printf("\"pipeline\": { \"cycles\": %llu, \"cpi\": %.4f, \"branches\": %llu, \"mispredictions\": %llu, \"stalls\": { ",
+				(unsigned long long)timing.cycles, timing.instructions == 0 ? 0.0 : (double)timing.cycles / timing.instructions,
+				(unsigned long long)timing.branches, (unsigned long long)timing.mispredictions);
+
+			for (int c = 0; c < M16_STALL_COUNT; c++) {
+				printf("%s\"%s\": %llu", c ? ", " : "", m16_stall_name((m16_stall)c), (unsigned long long)timing.stalls[c]);
+			}
+			printf(" } }, ");
+		}
+
+		printf("\"output\": %s }\n", jsonString(output).c_str());
+	} else {
+		if (status != M16_HALTED) fprintf(stderr, "[ERROR] - %s: program stopped: %s\n", path, m16_status_name(status));
+		if (!opts.isQuiet) printRegs(vm);
+		if (!opts.isQuiet && opts.isCached) m16_print_cache_report(vm, stdout, 10);
+		if (!opts.isQuiet && opts.isPipelined) m16_print_pipeline_report(vm, stdout);
+		if (!opts.isQuiet && opts.isProfiled) m16_print_branch_report(vm, stdout, 10);
+	}
+
+	m16_destroy(vm);
+	return exitCodeOf(status);
+}
+
+int main(int argc, const char* argv[]) {
+	options opts;
+
+	if (!parseOptions(argc, argv, opts)) {
+		usage();
+		return EXIT_USAGE;
+	}
+
+	int exitCode = EXIT_HALTED;
+	for (const char* path : opts.files) {
+		int code = runFile(opts, path);
+		if (code > exitCode) exitCode = code;
+	}
 
-	delete vm;
+	if (opts.pause) getchar();
 
-	getchar();
-	return 0;
-}
\ No newline at end of file
+	return exitCode;
+}